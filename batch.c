@@ -0,0 +1,367 @@
+/*
+    This file is part of "psdparse"
+    Copyright (C) 2004-2012 Toby Thain, toby@telegraphics.com.au
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Batch mode: process many files, each in a worker process of its own.
+// A fresh process per file keeps a crash on one damaged file from
+// taking the others with it, and gives back all of its memory when done.
+// A worker's stdout and stderr go to temporary files, which are copied
+// to ours when it exits, so the logs of different files never interleave.
+
+#include "psdparse.h"
+
+#ifdef HAVE_FORK
+	#include <unistd.h>
+	#include <sys/wait.h>
+	#include <sys/time.h>
+#else
+	#include <time.h>
+#endif
+
+// Read file names, one per line (e.g. a manifest on stdin).
+// Blank lines are skipped. Returns the count of names in *names.
+
+int readmanifest(FILE *in, char ***names){
+	char line[PATH_MAX+2], *p;
+	int n = 0, size = 0;
+
+	*names = NULL;
+	while(fgets(line, sizeof(line), in)){
+		p = line + strlen(line);
+		while(p > line && (p[-1] == '\n' || p[-1] == '\r'))
+			*--p = 0;
+		if(!line[0])
+			continue;
+
+		if(n == size){
+			size = size ? 2*size : 256;
+			if( !(*names = realloc(*names, size*sizeof(char*))) )
+				fatal("# can't allocate file list\n");
+		}
+		(*names)[n++] = strdup(line);
+	}
+	return n;
+}
+
+static double now(void){
+#ifdef HAVE_FORK
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec*1e-6;
+#else
+	return time(NULL);
+#endif
+}
+
+#ifdef HAVE_FORK
+
+struct worker{
+	pid_t pid;
+	char *name;
+	FILE *out, *err; // the worker's stdout and stderr
+};
+
+// Pass on (and discard) a finished worker's output.
+
+static void copylog(FILE *log, FILE *to){
+	char buf[0x4000];
+	size_t n;
+
+	rewind(log);
+	while( (n = fread(buf, 1, sizeof(buf), log)) )
+		fwrite(buf, 1, n, to);
+	fclose(log);
+	fflush(to);
+}
+
+#endif
+
+// Process n files with up to 'workers' running at once, calling
+// dofile() for each (which returns zero on failure). Unless --quiet, print
+// a summary of throughput at the end. Returns the count of files that failed.
+
+int batch(int workers, char **names, int n, int (*dofile)(char *name)){
+	int i, failed = 0;
+	double bytes = 0, start = now(), t;
+	struct stat sb;
+#ifdef HAVE_FORK
+	int next = 0, running = 0, status;
+	struct worker *w = checkmalloc(workers*sizeof(struct worker)), *p;
+	pid_t pid;
+#endif
+
+	if(!quiet)
+		for(i = 0; i < n; ++i)
+			if(!stat(names[i], &sb))
+				bytes += sb.st_size;
+
+#ifdef HAVE_FORK
+	while(next < n || running){
+		// keep the pool full
+		while(running < workers && next < n){
+			p = w + running;
+			p->name = names[next++];
+			p->out = tmpfile();
+			p->err = tmpfile();
+			fflush(stdout);
+			fflush(stderr);
+			if(!p->out || !p->err || (pid = fork()) < 0){
+				alwayswarn("# \"%s\": couldn't start worker, processing here\n", p->name);
+				if(p->out) fclose(p->out);
+				if(p->err) fclose(p->err);
+				failed += !dofile(p->name);
+				continue;
+			}
+			if(!pid){
+				// worker
+				dup2(fileno(p->out), fileno(stdout));
+				dup2(fileno(p->err), fileno(stderr));
+				exit(dofile(p->name) ? EXIT_SUCCESS : EXIT_FAILURE);
+			}
+			p->pid = pid;
+			++running;
+		}
+		if(!running)
+			break;
+
+		if((pid = wait(&status)) < 0)
+			fatal("# wait() failed\n");
+		for(p = w; p < w + running && p->pid != pid; ++p)
+			;
+		if(p == w + running)
+			continue; // not one of ours
+
+		copylog(p->out, stdout);
+		copylog(p->err, stderr);
+		if(WIFSIGNALED(status)){
+			alwayswarn("# \"%s\": worker stopped by signal %d\n", p->name, WTERMSIG(status));
+			++failed;
+		}else if(WEXITSTATUS(status) != EXIT_SUCCESS)
+			++failed;
+		*p = w[--running];
+	}
+	free(w);
+#else
+	for(i = 0; i < n; ++i)
+		failed += !dofile(names[i]);
+#endif
+
+	// there is no document context here, so UNQUIET can't be used
+	t = now() - start;
+	if(!quiet)
+		fprintf(stderr, "batch: %d files (%d failed), %.1f MB in %.2f s: %.2f files/s, %.1f MB/s\n",
+				n, failed, bytes/1e6, t, t > 0 ? n/t : 0., t > 0 ? bytes/1e6/t : 0.);
+	return failed;
+}
+
+// Inventory mode (--inventory): a one line summary of each file's header,
+// as CSV or JSON, for cataloguing very many files. Only the file header
+// and the lengths of the sections before the layer info are looked at;
+// usually they all fall within the first read, so a file costs one small
+// pread(). Files are read on 'jobs' threads, and summaries are printed
+// in order, a block of files at a time.
+
+#define INVENTORY_READ  0x8000 // bytes read from the start of each file
+#define INVENTORY_BLOCK 0x1000 // files summarised between outputs
+
+struct inventory{
+	char **names, **lines, *failed;
+	int json;
+};
+
+// Fetch n bytes at pos: from the initial read if it covers them, otherwise
+// from the file. Returns a pointer to them, or NULL if past the end of file.
+
+static unsigned char *invbytes(psd_file_t f, unsigned char *buf, size_t got,
+							   psd_bytes_t pos, size_t n, unsigned char *tmp)
+{
+	if(pos + n <= got)
+		return buf + pos;
+	return psd_pread(f, tmp, n, pos) == n ? tmp : NULL;
+}
+
+static int64_t invlength(unsigned char *p, int version){
+	return version == 1 ? (uint32_t)peek4B(p) : peek8B(p);
+}
+
+// With an empty layer info section, 16 and 32 bit documents keep their
+// layers in a global 'Lr16' or 'Lr32' block, which begins with the layer
+// count just like the ordinary section (see ed_layer16()). Walk the global
+// additional info, from the global layer mask info at pos up to the end
+// of layer & mask info, to find it. Only block headers are read, and
+// that block usually comes first, so this costs at most one more pread().
+// Returns the (signed) layer count, or zero if there is no such block.
+
+static int invglobal(psd_file_t f, unsigned char *buf, size_t got,
+					 psd_bytes_t pos, psd_bytes_t end, int version)
+{
+	unsigned char tmp[4+4+8+2], *p; // signature, key, PSB length, layer count
+	int64_t len;
+	int hdr;
+
+	if( !(p = invbytes(f, buf, got, pos, 4, tmp)) )
+		return 0;
+	for(pos += 4 + (uint32_t)peek4B(p); pos + 12 <= end; pos += hdr + len){
+		if( !(p = invbytes(f, buf, got, pos, sizeof(tmp), tmp))
+		   || !(KEYMATCH(p, "8BIM") || KEYMATCH(p, "8B64")) )
+			break;
+		hdr = version == 2 && widelengthkey((char*)p+4) ? 16 : 12;
+		len = hdr == 16 ? peek8B(p+8) : (uint32_t)peek4B(p+8);
+		if(len < 0 || pos + hdr + len > end)
+			break;
+		if(KEYMATCH(p+4, "Lr16") || KEYMATCH(p+4, "Lr32"))
+			return len >= 2 ? peek2B(p+hdr) : 0;
+	}
+	return 0;
+}
+
+// Append s to the line, quoted as a CSV field or JSON string.
+
+static char *invquote(char *q, char *s, int json){
+	*q++ = '"';
+	for(; *s; ++s)
+		if(json && (*s == '"' || *s == '\\'))
+			q += sprintf(q, "\\%c", *s);
+		else if(json && (unsigned char)*s < 0x20)
+			q += sprintf(q, "\\u%04x", *s);
+		else if(*s == '"')
+			q += sprintf(q, "\"\"");
+		else
+			*q++ = *s;
+	*q++ = '"';
+	*q = 0;
+	return q;
+}
+
+static void inventoryfile(void *arg, long i){
+	struct inventory *inv = arg;
+	char *line, *q, *err = NULL;
+	unsigned char buf[INVENTORY_READ], tmp[18], *p; // tmp: two PSB lengths and a count
+	struct psd_file pf;
+	FILE *fp;
+	size_t got = 0;
+	psd_bytes_t pos;
+	int64_t len;
+	int version = 0, channels = 0, depth = 0, mode = -1, layers = 0, mergedalpha = 0;
+	long rows = 0, cols = 0;
+
+	if( (fp = fopen(inv->names[i], "rb")) ){
+		// positional reads only, no mapping
+		pf.fp = fp;
+		pf.addr = NULL;
+		pf.size = pf.pos = 0;
+		pf.eof = 0;
+
+		got = psd_pread(&pf, buf, sizeof(buf), 0);
+		if(got < 30 || !KEYMATCH(buf, "8BPS"))
+			err = "not a PSD/PSB";
+		else if( (version = peek2Bu(buf+4)) != 1 && version != 2 )
+			err = "unsupported version";
+		else{
+			channels = peek2Bu(buf+12);
+			rows = (uint32_t)peek4B(buf+14);
+			cols = (uint32_t)peek4B(buf+18);
+			depth = peek2Bu(buf+22);
+			mode = peek2Bu(buf+24);
+
+			// skip colour mode data and image resources
+			pos = 30 + (uint32_t)peek4B(buf+26);
+			if( !(p = invbytes(&pf, buf, got, pos, 4, tmp)) )
+				err = "truncated";
+			else{
+				pos += 4 + (uint32_t)peek4B(p);
+				// layer & mask info length, then layer info length, then layer count
+				if( !(p = invbytes(&pf, buf, got, pos, 2*version*4 + 2, tmp)) )
+					err = "truncated";
+				else if( (len = invlength(p, version)) ){
+					if(invlength(p + version*4, version))
+						layers = peek2B(p + 2*version*4);
+					else if(depth > 8)
+						layers = invglobal(&pf, buf, got, pos + 2*version*4,
+										   pos + version*4 + len, version);
+					if( (mergedalpha = layers < 0) )
+						layers = -layers;
+				}
+			}
+		}
+		fclose(fp);
+	}else
+		err = "can't open";
+
+	// quoting expands each character of the name to at most 6 (\u00XX)
+	q = line = checkmalloc(6*strlen(inv->names[i]) + 0x200);
+	if(inv->json){
+		q = invquote(q + sprintf(q, "{\"file\":"), inv->names[i], 1);
+		if(err)
+			q = invquote(q + sprintf(q, ",\"error\":"), err, 1);
+		else
+			q += sprintf(q, ",\"version\":%d,\"channels\":%d,\"rows\":%ld,\"cols\":%ld"
+						 ",\"depth\":%d,\"mode\":%d,\"modename\":\"%s\",\"layers\":%d,\"mergedalpha\":%s",
+						 version, channels, rows, cols, depth, mode,
+						 mode < 16 ? mode_names[mode] : "", layers, mergedalpha ? "true" : "false");
+		strcpy(q, "}\n");
+	}else{
+		q = invquote(q, inv->names[i], 0);
+		if(err)
+			sprintf(q, ",,,,,,,,,%s\n", err);
+		else
+			sprintf(q, ",%d,%d,%ld,%ld,%d,%d,%s,%d,%d,\n",
+					version, channels, rows, cols, depth, mode,
+					mode < 16 ? mode_names[mode] : "", layers, mergedalpha);
+	}
+	inv->lines[i] = line;
+	inv->failed[i] = err != NULL;
+}
+
+// Summarise n files, using 'threads' threads. With --verbose,
+// print the rate at the end.
+// Returns the count of files that couldn't be summarised.
+
+int inventory(int threads, char **names, int n, int json){
+	struct inventory inv;
+	int i, j, count, failed = 0;
+	double start = now(), t;
+
+	if(!json)
+		puts("file,version,channels,rows,cols,depth,mode,modename,layers,mergedalpha,error");
+
+	inv.json = json;
+	inv.lines = checkmalloc(INVENTORY_BLOCK*sizeof(char*));
+	inv.failed = checkmalloc(INVENTORY_BLOCK);
+	for(i = 0; i < n; i += count){
+		count = n - i < INVENTORY_BLOCK ? n - i : INVENTORY_BLOCK;
+		inv.names = names + i;
+		parallel_for(threads, count, inventoryfile, &inv);
+		for(j = 0; j < count; ++j){
+			failed += inv.failed[j];
+			if(inv.lines[j])
+				fputs(inv.lines[j], stdout);
+			free(inv.lines[j]);
+		}
+	}
+	free(inv.lines);
+	free(inv.failed);
+	fflush(stdout);
+
+	t = now() - start;
+	if(verbose)
+		fprintf(stderr, "inventory: %d files (%d failed) in %.2f s: %.0f files/s\n",
+				n, failed, t, t > 0 ? n/t : 0.);
+	return failed;
+}
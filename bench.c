@@ -0,0 +1,357 @@
+/*
+    This file is part of "psdparse"
+    Copyright (C) 2004-2012 Toby Thain, toby@telegraphics.com.au
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Benchmarks for psdparse's hot spots ('make -f Makefile.unix bench'):
+//   bench packbits          PackBits encoder: the previous byte-at-a-time
+//                           encoder against the current one, with byte loops
+//                           only and with the SSE2 and AVX2 scans
+//   bench inflate           inflate backends on 16-bit ZIP channels
+//   bench png psdfile...    --pngprofile speed against size, running the
+//                           psdparse binary ($PSDPARSE, default ./psdparse)
+// Timings are the best of several passes, on synthetic data that is the
+// same on every run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "zlib.h"
+
+// The encoder's scanning variants are private to packbits.c,
+// so compile it in here to be able to choose between them.
+#include "packbits.c"
+
+#define PASSES 15
+
+static double now(void){
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+// Reproducible pseudo-random numbers (a 32 bit LCG).
+
+static unsigned long seed;
+
+static unsigned rnd(unsigned n){
+	seed = (seed*1103515245 + 12345) & 0xffffffff;
+	return (seed >> 8) % n;
+}
+
+void *ckmalloc(size_t n, char *file, int line){
+	void *p = malloc(n);
+
+	if(!p){
+		fprintf(stderr, "can't get %ld bytes @ %s:%d\n", (long)n, file, line);
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+// PackBits ===========================================================
+
+#define PACK_ROWS  1000
+#define PACK_BYTES 8000 // bytes per row
+
+// The encoder as it was before run detection was vectorised. It was
+// called from another file, so keep it from being inlined or
+// specialised for the constant row length here.
+
+__attribute__((noipa))
+static psd_pixels_t packbits_old(unsigned char *src, unsigned char *dst, psd_pixels_t n){
+	unsigned char *p, *q, *run, *dataend;
+	int count, maxrun;
+
+	dataend = src + n;
+	for( run = src, q = dst; n > 0; run = p, n -= count ){
+		maxrun = n < 128 ? n : 128;
+		if(run <= (dataend-3) && run[1] == run[0] && run[2] == run[0]){
+			for( p = run+3; p < (run+maxrun) && *p == run[0]; )
+				++p;
+			count = p - run;
+			*q++ = 1+256-count;
+			*q++ = run[0];
+		}else{
+			for( p = run; p < (run+maxrun); )
+				if(p <= (dataend-3) && p[1] == p[0] && p[2] == p[0])
+					break;
+				else
+					++p;
+			count = p - run;
+			*q++ = count-1;
+			memcpy(q, run, count);
+			q += count;
+		}
+	}
+	return q - dst;
+}
+
+// Fill a row with one kind of data.
+
+static void packdata(unsigned char *p, int n, int kind){
+	unsigned char *end = p + n;
+	int k, c;
+
+	while(p < end){
+		switch(kind){
+		case 0: // random bytes
+			*p++ = rnd(256);
+			continue;
+		case 1: // long runs with bursts of noise
+			k = 50 + rnd(250);
+			c = rnd(256);
+			while(k-- && p < end)
+				*p++ = c;
+			for(k = 1 + rnd(20); k-- && p < end;)
+				*p++ = rnd(256);
+			continue;
+		case 2: // short runs
+			k = 1 + rnd(5);
+			c = rnd(256);
+			while(k-- && p < end)
+				*p++ = c;
+			continue;
+		default: // two-level noise
+			*p++ = rnd(2) ? 0x40 : 0xc0;
+		}
+	}
+}
+
+static int packbench(void){
+	static const char *kinds[] = {"random bytes", "long runs + noise", "short runs", "two-level noise"};
+	struct{
+		char *name;
+		int old; // the previous encoder
+#ifdef PACK_SIMD
+		const struct packscan *scan; // NULL for byte loops only
+#endif
+	} v[4];
+	unsigned char *src = checkmalloc(PACK_ROWS*PACK_BYTES),
+				  *ref = checkmalloc(PACKBITSWORST(PACK_BYTES)),
+				  *dst = checkmalloc(PACK_ROWS*PACKBITSWORST(PACK_BYTES));
+	psd_pixels_t len[PACK_ROWS], n;
+	int i, j, r, pass, nv = 0, bad = 0;
+	double t, best;
+
+	memset(v, 0, sizeof(v));
+	v[nv].name = "previous"; v[nv++].old = 1;
+#ifdef PACK_SIMD
+	v[nv++].name = "bytes";
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")){
+		v[nv].name = "sse2"; v[nv++].scan = &scan_sse2;
+	}
+	if(__builtin_cpu_supports("avx2")){
+		v[nv].name = "avx2"; v[nv++].scan = &scan_avx2;
+	}
+#else
+	v[nv++].name = "current";
+#endif
+
+	printf("PackBits, %d rows of %d bytes, MB/s (best of %d)\n%-20s", PACK_ROWS, PACK_BYTES, PASSES, "");
+	for(j = 0; j < nv; ++j)
+		printf("%10s", v[j].name);
+	putchar('\n');
+
+	for(i = 0; i < 4; ++i){
+		seed = i;
+		for(r = 0; r < PACK_ROWS; ++r)
+			packdata(src + r*PACK_BYTES, PACK_BYTES, i);
+
+		printf("%-20s", kinds[i]);
+		for(j = 0; j < nv; ++j){
+#ifdef PACK_SIMD
+			scan = v[j].scan;
+#endif
+			for(pass = 0, best = 1e9; pass < PASSES; ++pass){
+				t = now();
+				for(r = 0; r < PACK_ROWS; ++r)
+					len[r] = v[j].old ? packbits_old(src + r*PACK_BYTES, dst + r*PACKBITSWORST(PACK_BYTES), PACK_BYTES)
+								  : packbits(src + r*PACK_BYTES, dst + r*PACKBITSWORST(PACK_BYTES), PACK_BYTES);
+				if((t = now() - t) < best)
+					best = t;
+			}
+			printf("%10.0f", PACK_ROWS*PACK_BYTES/1e6/best);
+
+			// every variant must give the previous encoder's output
+			for(r = 0; r < PACK_ROWS; ++r){
+				n = packbits_old(src + r*PACK_BYTES, ref, PACK_BYTES);
+				if(len[r] != n || n > PACKBITSWORST(PACK_BYTES)
+				   || memcmp(ref, dst + r*PACKBITSWORST(PACK_BYTES), n))
+					++bad;
+			}
+		}
+		putchar('\n');
+	}
+	if(bad)
+		printf("*** %d rows differ from the previous encoder's output\n", bad);
+
+	free(src);
+	free(ref);
+	free(dst);
+	return !bad;
+}
+
+// Inflate ============================================================
+
+#define ZIP_ROWS 1500
+#define ZIP_COLS 2000 // 16 bit samples
+
+// A 16-bit channel: a smooth gradient plus noise of the given amplitude,
+// optionally with Photoshop's prediction (each sample less the one before).
+
+static void zipdata(unsigned char *p, int noise, int predict){
+	unsigned v, prev;
+	int r, c;
+
+	for(r = 0; r < ZIP_ROWS; ++r)
+		for(c = 0, prev = 0; c < ZIP_COLS; ++c, p += 2){
+			v = (r*23 + c*17 + (noise ? rnd(noise) : 0)) & 0xffff;
+			p[0] = (v - (predict ? prev : 0)) >> 8;
+			p[1] = (v - (predict ? prev : 0));
+			prev = v;
+		}
+}
+
+static int inflatebench(void){
+	static const struct{
+		char *name;
+		int noise, predict;
+	} cases[] = {
+		{"ZIP, noisy",             256, 0},
+		{"ZIP+prediction, smooth",   4, 1},
+		{"ZIP+prediction, noisy",  256, 1},
+	};
+	static char *backends[] = {"fast", "zlib"};
+	uLongf zlen, size = ZIP_ROWS*ZIP_COLS*2;
+	unsigned char *src = checkmalloc(size), *zip = checkmalloc(compressBound(size)),
+				  *dst = checkmalloc(size);
+	size_t out;
+	int i, j, pass, bad = 0;
+	double t, best;
+
+	printf("\nInflate, 16-bit %dx%d channel, ms (best of %d)\n%-24s%12s",
+		   ZIP_COLS, ZIP_ROWS, PASSES, "", "compressed");
+	for(j = 0; j < 2; ++j)
+		printf("%8s", backends[j]);
+	putchar('\n');
+
+	for(i = 0; i < 3; ++i){
+		seed = i;
+		zipdata(src, cases[i].noise, cases[i].predict);
+		zlen = compressBound(size);
+		compress2(zip, &zlen, src, size, Z_DEFAULT_COMPRESSION);
+
+		printf("%-24s%12lu", cases[i].name, (unsigned long)zlen);
+		for(j = 0; j < 2; ++j){
+			psd_setinflater(backends[j]);
+			for(pass = 0, best = 1e9; pass < PASSES; ++pass){
+				t = now();
+				if(!psd_inflate(zip, zlen, dst, size, &out) || out != size || memcmp(src, dst, size))
+					++bad;
+				if((t = now() - t) < best)
+					best = t;
+			}
+			printf("%8.1f", best*1e3);
+		}
+		putchar('\n');
+	}
+	if(bad)
+		printf("*** %d inflates failed or differ from the input\n", bad);
+
+	free(src);
+	free(zip);
+	free(dst);
+	return !bad;
+}
+
+// PNG profiles =======================================================
+
+// Total size of the PNG files in a directory.
+
+static double pngbytes(char *dir){
+	char path[PATH_MAX];
+	DIR *d;
+	struct dirent *e;
+	struct stat sb;
+	double total = 0;
+	size_t n;
+
+	if( (d = opendir(dir)) ){
+		while( (e = readdir(d)) )
+			if((n = strlen(e->d_name)) > 4 && !strcmp(e->d_name + n - 4, ".png")){
+				snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+				if(!stat(path, &sb))
+					total += sb.st_size;
+			}
+		closedir(d);
+	}
+	return total;
+}
+
+static int pngbench(int n, char **names){
+	static char *profiles[] = {"fastest", "balanced", "smallest"};
+	char *psdparse = getenv("PSDPARSE") ? getenv("PSDPARSE") : "./psdparse", *cmd, dir[32];
+	size_t len = strlen(psdparse) + 0x100;
+	int i, j;
+	double t;
+
+	for(i = 0; i < n; ++i)
+		len += strlen(names[i]) + 3;
+	cmd = checkmalloc(len);
+
+	printf("\nPNG profiles, %d files: %s -w (one pass)\n%-12s%10s%14s\n", n, psdparse, "", "seconds", "PNG bytes");
+	for(j = 0; j < 3; ++j){
+		sprintf(dir, "bench_%s", profiles[j]);
+		sprintf(cmd, "rm -rf %s", dir);
+		system(cmd);
+
+		sprintf(cmd, "%s -q -w --pngprofile %s -d %s", psdparse, profiles[j], dir);
+		for(i = 0; i < n; ++i)
+			strcat(strcat(strcat(cmd, " \""), names[i]), "\"");
+		t = now();
+		if(system(cmd)){
+			printf("*** %s failed\n", psdparse);
+			return 0;
+		}
+		printf("%-12s%10.2f%14.0f\n", profiles[j], now() - t, pngbytes(dir));
+	}
+	free(cmd);
+	return 1;
+}
+
+int main(int argc, char *argv[]){
+	int ok;
+
+	if(argc > 1 && !strcmp(argv[1], "packbits"))
+		ok = packbench();
+	else if(argc > 1 && !strcmp(argv[1], "inflate"))
+		ok = inflatebench();
+	else if(argc > 2 && !strcmp(argv[1], "png"))
+		ok = pngbench(argc - 2, argv + 2);
+	else{
+		fprintf(stderr, "usage: %s packbits | inflate | png psdfile...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -19,29 +19,24 @@
 
 #include "psdparse.h"
 
-// Read one row's data from the PSD file, according to the parameters:
-//   chan   - points to the channel info struct
-//   row    - row index
-//   inrow  - destination for uncompressed row data (at least rowbytes in size)
-//   rlebuf - temporary buffer for RLE decompression (at least 2*rowbytes in size)
+// Fetch row 'row' of the whole channel, or of its window: n bytes
+// starting win_skip bytes in. 'last' is nonzero if no later row
+// will be wanted, so that any inflate state can be released.
 
-void readunpackrow(psd_file_t psd,        // input file handle
-				   struct channel_info *chan, // channel info
-				   psd_pixels_t row,      // row index
-				   unsigned char *inrow,  // dest buffer for the uncompressed row (rb bytes)
-				   unsigned char *rlebuf) // temporary buffer for compressed data, 2 x rb in size
+static void readwindowrow(psd_file_t psd, struct channel_info *chan, psd_pixels_t row,
+						  psd_pixels_t n, unsigned char *inrow, unsigned char *rlebuf, int last)
 {
-	psd_pixels_t n = 0, rlebytes;
+	psd_pixels_t got = 0, rlebytes;
 	psd_bytes_t pos;
-	int seekres = 0;
+	unsigned char *p;
+
+	row += chan->win_top;
 
 	switch(chan->comptype){
 	case RAWDATA: /* uncompressed */
 		if(chan->rawpos){
-			pos = chan->rawpos + chan->rowbytes*row;
-			seekres = fseeko(psd, pos, SEEK_SET);
-			if(seekres != -1)
-				n = fread(inrow, 1, chan->rowbytes, psd);
+			pos = chan->rawpos + (psd_bytes_t)chan->full_rowbytes*row + chan->win_skip;
+			got = psd_pread(psd, inrow, n, pos);
 		}else{
 			warn_msg("# readunpackrow() called for raw data, but rawpos is zero");
 		}
@@ -49,36 +44,150 @@ void readunpackrow(psd_file_t psd,        // input file handle
 	case RLECOMP:
 		if(chan->rowpos){
 			pos = chan->rowpos[row];
-			seekres = fseeko(psd, pos, SEEK_SET);
-			if(seekres != -1){
-				rlebytes = fread(rlebuf, 1, chan->rowpos[row+1] - pos, psd);
-				n = unpackbits(inrow, rlebuf, chan->rowbytes, rlebytes);
+			rlebytes = chan->rowpos[row+1] - pos;
+			if( !(p = psd_mapped(psd, pos, rlebytes)) ){
+				rlebytes = psd_pread(psd, rlebuf, rlebytes, pos);
+				p = rlebuf;
 			}
+			// (if mapped, decode straight from the file, no copy)
+			got = n == chan->full_rowbytes
+				  ? unpackbits(inrow, p, n, rlebytes)
+				  : unpackbits_window(inrow, p, chan->full_rowbytes, chan->win_skip, n, rlebytes);
 		}else{
 			warn_msg("# readunpackrow() called for RLE data, but rowpos is NULL");
 		}
 		break;
 	case ZIPNOPREDICT:
 	case ZIPPREDICT:
-		if(chan->unzipdata)
-			memcpy(inrow, chan->unzipdata + chan->rowbytes*row, chan->rowbytes);
-		else
-			warn_msg("# readunpackrow() called for ZIP data, but unzipdata is NULL");
-		return;
+		if(chan->zippos){
+			if(!chan->unzip)
+				chan->unzip = psd_unzip_open(psd, chan->zippos, chan->length - 2,
+											 chan->comptype == ZIPPREDICT, chan->depth,
+											 chan->full_rows, chan->full_rowbytes);
+			if(chan->unzip){
+				got = psd_unzip_row(chan->unzip, row, chan->win_skip, n, inrow);
+				if(last || row == chan->full_rows-1){
+					psd_unzip_close(chan->unzip);
+					chan->unzip = NULL;
+				}
+			}
+		}else
+			warn_msg("# readunpackrow() called for ZIP data, but zippos is zero");
+		break;
 	}
 	// if we don't recognise the compression type, skip the row
 	// FIXME: or would it be better to use the last valid type seen?
 
-	if(seekres == -1)
-		alwayswarn("# can't seek to " LL_L("%lld\n","%ld\n"), pos);
-
-	if(n < chan->rowbytes){
-		warn_msg("row data short (wanted %d, got %d bytes)", chan->rowbytes, n);
+	if(got < n){
+		warn_msg("row data short (wanted %d, got %d bytes)", n, got);
 		// zero out unwritten part of row
-		memset(inrow + n, 0xff, chan->rowbytes - n);
+		memset(inrow + got, 0xff, n - got);
+	}
+}
+
+// Shrink a row of src_cols samples down to cols, averaging each
+// run of 'scale' samples (the last run may be shorter), or if the
+// channel has no box filter (e.g. palette indexes), taking the middle one.
+// Bitmap samples take the majority value.
+
+static void shrinkrow(unsigned char *dst, unsigned char *src, struct channel_info *chan){
+	psd_pixels_t i, j, k, end, s = chan->scale;
+	unsigned long sum;
+	union { uint32_t i; float f; } v;
+	float fsum;
+
+	if(chan->depth == 1)
+		memset(dst, 0, chan->rowbytes);
+
+	for(i = 0, j = 0; i < chan->cols; ++i, j = end){
+		end = j + s < chan->src_cols ? j + s : chan->src_cols;
+		if(!chan->box){
+			k = (j + end)/2;
+			switch(chan->depth){
+			case 8:  dst[i] = src[k]; break;
+			case 16: memcpy(dst + 2*i, src + 2*k, 2); break;
+			case 32: memcpy(dst + 4*i, src + 4*k, 4); break;
+			}
+			continue;
+		}
+		switch(chan->depth){
+		case 1:
+			for(k = j, sum = 0; k < end; ++k)
+				sum += (src[k >> 3] >> (7 - (k & 7))) & 1;
+			if(2*sum >= end - j)
+				dst[i >> 3] |= 0x80 >> (i & 7);
+			break;
+		case 8:
+			for(k = j, sum = 0; k < end; ++k)
+				sum += src[k];
+			dst[i] = (sum + (end - j)/2)/(end - j);
+			break;
+		case 16:
+			for(k = j, sum = 0; k < end; ++k)
+				sum += peek2Bu(src + 2*k);
+			sum = (sum + (end - j)/2)/(end - j);
+			dst[2*i]   = sum >> 8;
+			dst[2*i+1] = sum;
+			break;
+		case 32:
+			for(k = j, fsum = 0; k < end; ++k){
+				v.i = peek4B(src + 4*k);
+				fsum += v.f;
+			}
+			v.f = fsum/(end - j);
+			dst[4*i]   = v.i >> 24;
+			dst[4*i+1] = v.i >> 16;
+			dst[4*i+2] = v.i >> 8;
+			dst[4*i+3] = v.i;
+			break;
+		}
 	}
 }
 
+// Read one row's data from the PSD file, according to the parameters:
+//   chan   - points to the channel info struct
+//   row    - row index (within the window, if one is set)
+//   inrow  - destination for uncompressed row data (at least rowbytes in size)
+//   rlebuf - temporary buffer, of at least rlebufsize(chan) bytes
+// Data is fetched by position (chan->rawpos or chan->rowpos[]) and the
+// file's read cursor is left alone, so rows of different channels
+// may be decoded concurrently from the same open file.
+// A ZIP channel is inflated a few rows at a time as they are needed
+// (quickest in row order), and the inflate state is released once its
+// last row has been read; so each ZIP channel should only be read
+// by one thread at a time.
+// If the channel has a window (setwindow()), only the window's part
+// of the row is decoded: RLE decoding stops at its right edge.
+// If it has a scale (setscale()), only the middle row of each band of
+// 'scale' rows is decoded, and box filtered down to size.
+
+void readunpackrow(psd_file_t psd,        // input file handle
+				   struct channel_info *chan, // channel info
+				   psd_pixels_t row,      // row index
+				   unsigned char *inrow,  // dest buffer for the uncompressed row (rb bytes)
+				   unsigned char *rlebuf) // temporary buffer, rlebufsize(chan) bytes
+{
+	psd_pixels_t src_row;
+	unsigned char *src;
+
+	if(chan->scale > 1){
+		// the full size row goes after the space for compressed data
+		src = rlebuf + 2*(size_t)chan->full_rowbytes;
+		src_row = row*chan->scale + chan->scale/2;
+		if(src_row >= chan->src_rows)
+			src_row = chan->src_rows-1;
+		readwindowrow(psd, chan, src_row, chan->src_rowbytes, src, rlebuf, row == chan->rows-1);
+		shrinkrow(inrow, src, chan);
+	}else
+		readwindowrow(psd, chan, row, chan->rowbytes, inrow, rlebuf, row == chan->rows-1);
+}
+
+// Size of the temporary buffer needed by readunpackrow().
+
+size_t rlebufsize(struct channel_info *chan){
+	return 2*(size_t)chan->full_rowbytes + (chan->scale > 1 ? chan->src_rowbytes : 0);
+}
+
 // Read channel metadata and populate the chan[] struct
 // in preparation for later reading/decompression of image data.
 // Called individually for layer channels (channels always == 1), and
@@ -94,10 +203,9 @@ void dochannel(psd_file_t f,
 {
 	int compr, ch;
 	psd_bytes_t chpos, pos;
-	unsigned char *zipdata;
 	psd_pixels_t count, last, j, rb;
 
-	chpos = ftello(f);
+	chpos = psd_ftello(f);
 
 	if(li){
 		VERBOSE(">>> channel id = %2d @ " LL_L("%7lld, %lld","%7ld, %ld") " bytes\n",
@@ -160,14 +268,21 @@ void dochannel(psd_file_t f,
 		chan[ch].rows = chan->rows;
 		chan[ch].cols = chan->cols;
 		chan[ch].rowpos = NULL;
-		chan[ch].unzipdata = NULL;
+		chan[ch].zippos = 0;
+		chan[ch].depth = h->depth;
+		chan[ch].unzip = NULL;
 		chan[ch].rawpos = 0;
+		chan[ch].win_top = chan[ch].win_skip = 0;
+		chan[ch].full_rows = chan->rows;
+		chan[ch].full_rowbytes = rb;
+		chan[ch].scale = 1;
 
 		if(!chan->rows)
 			continue;
 
 		// For RLE, we read the row count array and compute file positions.
-		// For ZIP, read and decompress whole channel.
+		// For ZIP, just note where the data is; it is inflated on demand
+		// by readunpackrow().
 		switch(compr){
 		case RAWDATA:
 			chan[ch].rawpos = pos;
@@ -178,7 +293,7 @@ void dochannel(psd_file_t f,
 			/* accumulate RLE counts, to make array of row start positions */
 			chan[ch].rowpos = checkmalloc((chan[ch].rows+1)*sizeof(psd_bytes_t));
 			last = chan[ch].rowbytes;
-			for(j = 0; j < chan[ch].rows && !feof(f); ++j){
+			for(j = 0; j < chan[ch].rows && !psd_feof(f); ++j){
 				count = h->version==1 ? get2Bu(f) : (psd_pixels_t)get4B(f);
 
 				if(count < 2 || count > 2*chan[ch].rowbytes)  // this would be impossible
@@ -197,23 +312,8 @@ void dochannel(psd_file_t f,
 		case ZIPNOPREDICT:
 		case ZIPPREDICT:
 			if(li){
+				chan->zippos = pos;
 				pos += chan->length - 2;
-
-				zipdata = checkmalloc(chan->length);
-				count = fread(zipdata, 1, chan->length - 2, f);
-				if(count < chan->length - 2)
-					alwayswarn("ZIP data short: wanted %ld bytes, got %ld", chan->length, count);
-
-				chan->unzipdata = checkmalloc(chan->rows*chan->rowbytes);
-				if(compr == ZIPNOPREDICT)
-					psd_unzip_without_prediction(zipdata, count, chan->unzipdata,
-												 chan->rows*chan->rowbytes);
-				else
-					psd_unzip_with_prediction(zipdata, count, chan->unzipdata,
-											  chan->rows*chan->rowbytes,
-											  chan->cols, h->depth);
-
-				free(zipdata);
 			}else{
 				alwayswarn("## can't process ZIP outside layer\n");
 			}
@@ -227,7 +327,7 @@ void dochannel(psd_file_t f,
 				alwayswarn("## bad compression type: %d; skipping channel\n", compr);
 
 			if(li)
-				fseeko(f, chan->length - 2, SEEK_CUR);
+				psd_fseeko(f, chan->length - 2, SEEK_CUR);
 			break;
 		}
 	}
@@ -236,5 +336,56 @@ void dochannel(psd_file_t f,
 		alwayswarn("# channel data is %lu bytes, but length = %lu\n",
 				   (unsigned long)(pos - chpos), (unsigned long)chan->length);
 
-	fseeko(f, pos, SEEK_SET);
+	psd_fseeko(f, pos, SEEK_SET);
+}
+
+// Restrict a channel (set up by dochannel()) to a window of its image,
+// given relative to any window it already has, and clipped to it.
+// Afterwards rows, cols and rowbytes describe the window, and
+// readunpackrow() returns only the window's part of each row.
+// Bitmap (1 bit) windows are widened to whole bytes.
+// Returns zero if the window is empty.
+
+int setwindow(struct channel_info *chan, psd_pixels_t left, psd_pixels_t top,
+			  psd_pixels_t cols, psd_pixels_t rows)
+{
+	psd_pixels_t right;
+
+	if(left >= chan->cols || top >= chan->rows || !cols || !rows){
+		chan->rows = chan->cols = chan->rowbytes = 0;
+		return 0;
+	}
+	if(cols > chan->cols - left)
+		cols = chan->cols - left;
+	if(rows > chan->rows - top)
+		rows = chan->rows - top;
+
+	if(chan->depth == 1){
+		right = (left + cols + 7) & -8;
+		left &= -8;
+		cols = (right < chan->cols ? right : chan->cols) - left;
+	}
+
+	chan->win_top += top;
+	chan->win_skip += (left*chan->depth)/8;
+	chan->rows = rows;
+	chan->cols = cols;
+	chan->rowbytes = (cols*chan->depth + 7)/8;
+	return 1;
+}
+
+// Give the channel (or its window) a reduced-resolution view:
+// 1/scale of its size in each direction, rounded up.
+// readunpackrow() then returns rows of the smaller image, with
+// columns box filtered if 'box' is set, otherwise sampled.
+
+void setscale(struct channel_info *chan, int scale, int box){
+	chan->scale = scale;
+	chan->box = box;
+	chan->src_rows = chan->rows;
+	chan->src_cols = chan->cols;
+	chan->src_rowbytes = chan->rowbytes;
+	chan->rows = (chan->rows + scale - 1)/scale;
+	chan->cols = (chan->cols + scale - 1)/scale;
+	chan->rowbytes = (chan->cols*chan->depth + 7)/8;
 }
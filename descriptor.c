@@ -33,10 +33,10 @@ static void desc_alias(psd_file_t f, int level, int len, struct dictentry *paren
 extern void desc_pdf(psd_file_t f, int level, int len, struct dictentry *parent);
 
 static void ascii_string(psd_file_t f, long count){
-	fputs(" <STRING>", xml);
+	fputs(" <STRING>", psd_ctx->xml);
 	while(count--)
-		fputcxml(fgetc(f), xml);
-	fputs("</STRING>", xml);
+		fputcxml(psd_fgetc(f), psd_ctx->xml);
+	fputs("</STRING>", psd_ctx->xml);
 }
 
 // Return pointer to a newly allocated, NUL-terminated buffer of UTF-8
@@ -48,20 +48,20 @@ char *conv_unicodestr(psd_file_t f, long count){
 	char *buf = checkmalloc(2*count), *utf8 = NULL;
 
 	if(buf){
-		size_t n = fread(buf, 2, count, f);
+		size_t n = psd_fread(buf, 2, count, f);
 #ifdef HAVE_ICONV_H
 		size_t inb, outb;
 		char *inbuf, *outbuf;
 
-		iconv(ic, NULL, &inb, NULL, &outb); // reset iconv state
+		iconv(psd_ctx->ic, NULL, &inb, NULL, &outb); // reset iconv state
 
-		outb = 6*count; // sloppy overestimate of buffer (FIXME)
+		outb = 6*count + 1; // sloppy overestimate of buffer, plus NUL (FIXME)
 		if( (utf8 = checkmalloc(outb)) ){
 			inbuf = buf;
 			inb = 2*n;
 			outbuf = utf8;
-			if(ic != (iconv_t)-1){
-				if(iconv(ic, &inbuf, &inb, &outbuf, &outb) != (size_t)-1){
+			if(psd_ctx->ic != (iconv_t)-1){
+				if(iconv(psd_ctx->ic, &inbuf, &inb, &outbuf, &outb) != (size_t)-1){
 					*outbuf = 0; // add NUL termination
 				}else{
 					alwayswarn("conv_unicodestr(): iconv() failed, errno=%u (count=%d)\n", errno, count);
@@ -79,22 +79,22 @@ char *conv_unicodestr(psd_file_t f, long count){
 void xml_unicodestr(psd_file_t f, long count){
 	char *buf = conv_unicodestr(f, count);
 	if(buf){
-		fputsxml(buf, xml);
+		fputsxml(buf, psd_ctx->xml);
 		free(buf);
 	}
 }
 
 static void stringorid(psd_file_t f, int level, char *tag){
 	long count = get4B(f);
-	fprintf(xml, "%s<%s>", tabs(level), tag);
+	fprintf(psd_ctx->xml, "%s<%s>", tabs(level), tag);
 	if(count)
 		ascii_string(f, count);
 	else{
-		fputs(" <ID>", xml);
-		fputsxml(getkey(f), xml);
-		fputs("</ID>", xml);
+		fputs(" <ID>", psd_ctx->xml);
+		fputsxml(getkey(f), psd_ctx->xml);
+		fputs("</ID>", psd_ctx->xml);
 	}
-	fprintf(xml, " </%s>\n", tag);
+	fprintf(psd_ctx->xml, " </%s>\n", tag);
 }
 
 static void ref_property(psd_file_t f, int level, int len, struct dictentry *parent){
@@ -159,9 +159,10 @@ struct dictentry *item(psd_file_t f, int level){
 	p = findbykey(f, level, itemdict, k = getkey(f), 1, 0);
 
 	if(!p){
-		fprintf(stderr, "### item(): unknown key '%s'; file offset %#lx\n",
-				k, (unsigned long)ftello(f));
-		exit(1);
+		char s[0x200];
+		snprintf(s, sizeof(s), "### item(): unknown key '%s'; file offset %#lx\n",
+				 k, (unsigned long)psd_ftello(f));
+		fatal(s);
 	}
 	return p;
 }
@@ -182,13 +183,13 @@ void descriptor(psd_file_t f, int level, int len, struct dictentry *parent){
 
 	desc_class(f, level, len, parent);
 	count = get4B(f);
-	fprintf(xml, "%s<!--count:%ld-->\n", tabs(level), count);
+	fprintf(psd_ctx->xml, "%s<!--count:%ld-->\n", tabs(level), count);
 	while(count--)
 		desc_item(f, level);
 }
 
 static void desc_double(psd_file_t f, int level, int len, struct dictentry *parent){
-	fprintf(xml, "%g", getdoubleB(f));
+	fprintf(psd_ctx->xml, "%g", getdoubleB(f));
 };
 
 static void desc_unitfloat(psd_file_t f, int level, int len, struct dictentry *parent){
@@ -207,9 +208,9 @@ static void desc_unitfloat(psd_file_t f, int level, int len, struct dictentry *p
 
 static void desc_unicodestr(psd_file_t f, int level, int len, struct dictentry *parent){
 	long count = get4B(f);
-	fprintf(xml, "%s<UNICODE>", parent->tag[0] == '-' ? " " : tabs(level));
+	fprintf(psd_ctx->xml, "%s<UNICODE>", parent->tag[0] == '-' ? " " : tabs(level));
 	xml_unicodestr(f, count);
-	fprintf(xml, "</UNICODE>%c", parent->tag[0] == '-' ? ' ' : '\n');
+	fprintf(psd_ctx->xml, "</UNICODE>%c", parent->tag[0] == '-' ? ' ' : '\n');
 }
 
 static void desc_enumerated(psd_file_t f, int level, int len, struct dictentry *parent){
@@ -218,15 +219,15 @@ static void desc_enumerated(psd_file_t f, int level, int len, struct dictentry *
 }
 
 static void desc_integer(psd_file_t f, int level, int len, struct dictentry *parent){
-	fprintf(xml, "%d", get4B(f));
+	fprintf(psd_ctx->xml, "%d", get4B(f));
 }
 
 static void desc_boolean(psd_file_t f, int level, int len, struct dictentry *parent){
-	fprintf(xml, "%d", fgetc(f));
+	fprintf(psd_ctx->xml, "%d", psd_fgetc(f));
 }
 
 static void desc_alias(psd_file_t f, int level, int len, struct dictentry *parent){
 	psd_bytes_t count = get4B(f);
-	fprintf(xml, " <!-- %lu bytes alias data --> ", (unsigned long)count);
-	fseeko(f, count, SEEK_CUR); // skip over
+	fprintf(psd_ctx->xml, " <!-- %lu bytes alias data --> ", (unsigned long)count);
+	psd_fseeko(f, count, SEEK_CUR); // skip over
 }
@@ -34,51 +34,51 @@ void duotone_data(psd_file_t f, int level){
 
 	if(n < DUOTONE_DATA_SIZE)
 		alwayswarn("Duotone data too short; %d bytes but expected %d", n, DUOTONE_DATA_SIZE);
-	else if(xml){
-		fprintf(xml, "%s<DUOTONE>\n", indent);
-		fprintf(xml, "\t%s<VERSION>%d</VERSION>\n", indent, get2B(f));
+	else if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<DUOTONE>\n", indent);
+		fprintf(psd_ctx->xml, "\t%s<VERSION>%d</VERSION>\n", indent, get2B(f));
 		plates = get2B(f);
-		fread(data, 1, DUOTONE_DATA_SIZE, f);
+		psd_fread(data, 1, DUOTONE_DATA_SIZE, f);
 		n -= 4 + DUOTONE_DATA_SIZE; // skip any extra
 		for(i = 0; i < 4; ++i){
 			if(i < plates){
-				fprintf(xml, "\t%s<PLATE>\n", indent);
+				fprintf(psd_ctx->xml, "\t%s<PLATE>\n", indent);
 
 				p = data + i*10;
 				colorspace(level+2, peek2B(p), p + 2);
 
-				fprintf(xml, "\t\t%s<INKNAME>", indent);
+				fprintf(psd_ctx->xml, "\t\t%s<INKNAME>", indent);
 				p = data + 40 + i*64; // points to Pascal string (i.e. preceded by length)
-				fwritexml((char*)(p+1), p[0], xml);
-				fputs("</INKNAME>\n", xml);
+				fwritexml((char*)(p+1), p[0], psd_ctx->xml);
+				fputs("</INKNAME>\n", psd_ctx->xml);
 
-				fprintf(xml, "\t\t%s<TRANSFER>\n", indent);
+				fprintf(psd_ctx->xml, "\t\t%s<TRANSFER>\n", indent);
 				p = data + 4*(10+64) + i*28;
 				for(j = 0; j < 13; ++j){
 					int v = peek2B(p);
 					if(v == -1)
-						fprintf(xml, "\t\t\t%s<POINT/>\n", indent);
+						fprintf(psd_ctx->xml, "\t\t\t%s<POINT/>\n", indent);
 					else
-						fprintf(xml, "\t\t\t%s<POINT>%.1f</POINT>\n", indent, v/10.);
+						fprintf(psd_ctx->xml, "\t\t\t%s<POINT>%.1f</POINT>\n", indent, v/10.);
 					p += 2;
 				}
-				fprintf(xml, "\t\t\t%s<OVERRIDE>%d</OVERRIDE>\n", indent, peek2B(p));
-				fprintf(xml, "\t\t%s</TRANSFER>\n", indent);
+				fprintf(psd_ctx->xml, "\t\t\t%s<OVERRIDE>%d</OVERRIDE>\n", indent, peek2B(p));
+				fprintf(psd_ctx->xml, "\t\t%s</TRANSFER>\n", indent);
 
-				fprintf(xml, "\t%s</PLATE>\n", indent);
+				fprintf(psd_ctx->xml, "\t%s</PLATE>\n", indent);
 			}
 		}
 		p = data + 4*(10+64+28);
-		fprintf(xml, "\t%s<DOTGAIN>%d</DOTGAIN>\n", indent, peek2B(p));
+		fprintf(psd_ctx->xml, "\t%s<DOTGAIN>%d</DOTGAIN>\n", indent, peek2B(p));
 		p += 2;
-		fprintf(xml, "\t%s<OVERPRINTCOLOR>\n", indent);
+		fprintf(psd_ctx->xml, "\t%s<OVERPRINTCOLOR>\n", indent);
 		for(i = 0; i < overprints[plates-1]; ++i){
 			colorspace(level+2, peek2B(p), p + 2);
 			p += 10;
 		}
-		fprintf(xml, "\t%s</OVERPRINTCOLOR>\n", indent);
-		fprintf(xml, "%s</DUOTONE>\n", indent);
+		fprintf(psd_ctx->xml, "\t%s</OVERPRINTCOLOR>\n", indent);
+		fprintf(psd_ctx->xml, "%s</DUOTONE>\n", indent);
 	}
 
-	fseeko(f, n, SEEK_CUR);
+	psd_fseeko(f, n, SEEK_CUR);
 }
@@ -19,76 +19,60 @@
 
 #include <stdio.h>
 
-#include "psdparse.h"
+#include "libpsdparse.h"
 
 /* This program is an example of using psdparse as a library.
  * It accepts one filename as the first parameter, opens this PSD file,
- * and prints some information about its contents.
+ * and prints some information about its contents, along with
+ * a checksum of each channel's decoded image data.
  *
  * build:
  *     make example -f Makefile.unix
+ * (which links it with the shared library, libpsdparse.so)
  */
 
-// These flags control psdparse behaviour.
-// You WILL get text output unless you set quiet = 1 !
-int verbose = 0, quiet = 1, rsrc = 0, print_rsrc = 0, resdump = 0, extra = 0,
-	makedirs = 0, numbered = 0, help = 0, split = 0, xmlout = 0,
-	writepng = 0, writelist = 0, writexml = 0, unicode_filenames = 1,
-	rebuild = 0;
-long hres, vres; // we don't use these, but they're set within doresources()
-char *pngdir;
+// Decode a channel a row at a time, adding up its bytes.
 
-int main(int argc, char *argv[]){
-	FILE *f;
-	struct psd_header h;
-
-	if(argc == 2 && (f = fopen(argv[1], "rb"))){
-		h.version = h.nlayers = 0;
-		h.layerdatapos = 0;
-
-		if(dopsd(f, argv[1], &h)){
-			/* The following members of psd_header struct h are initialised:
-			 * sig, version, channels, rows, cols, depth, mode */
-			printf("PS%c file, %u rows x %u cols, %u channels, %u bit depth, %u layers\n",
-				   h.version == 1 ? 'D' : 'B',
-				   h.rows, h.cols, h.channels, h.depth, h.nlayers);
-
-			// process the layers in 'image data' section.
-			// this will, in turn, call doimage() for each layer.
-			processlayers(f, &h);
-
-			// position file after 'layer & mask info', i.e. at the
-			// beginning of the merged image data.
-			fseeko(f, h.lmistart + h.lmilen, SEEK_SET);
-
-			// process merged (composite) image data
-			doimage(f, NULL, NULL, &h);
-
-			return EXIT_SUCCESS;
-		}else{
-			fprintf(stderr, "Not a PSD or PSB file.\n");
-		}
+static unsigned long channelsum(struct psd_document *doc, struct channel_info *chan){
+	unsigned char *row = malloc(chan->rowbytes);
+	unsigned long sum = 0;
+	psd_pixels_t i, j;
 
-		fclose(f);
-	}else{
-		fprintf(stderr, "Could not open: %s\n", argv[1]);
+	if(row){
+		for(i = 0; i < chan->rows; ++i)
+			if(psd_channel_read_rows(doc, chan, i, 1, row) == 1)
+				for(j = 0; j < chan->rowbytes; ++j)
+					sum += row[j];
+		free(row);
 	}
-
-	return EXIT_FAILURE;
+	return sum;
 }
 
-/* This function must be supplied as a callback. It assumes that the
- * current file position points to the beginning of the image data
- * for the layer, or merged (flattened) image data. */
-
-void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header *h)
-{
+int main(int argc, char *argv[]){
+	struct psd_document *doc;
+	struct psd_header *h;
+	struct layer_info *li;
+	struct channel_info *chan;
 	int ch;
 
-	/* li points to layer information. If it is NULL, then
-	 * the merged image is being being processed, not a layer. */
+	if(argc != 2){
+		fprintf(stderr, "usage: %s psdfile\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if( !(doc = psd_open(argv[1])) ){
+		fprintf(stderr, "Not a PSD or PSB file, or could not open: %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
 
-	/* You probably want to treat the layer/image differently
+	/* The following members of psd_header struct h are initialised:
+	 * sig, version, channels, rows, cols, depth, mode,
+	 * as well as the layer information. */
+	h = psd_document_header(doc);
+	printf("PS%c file, %u rows x %u cols, %u channels, %u bit depth, %u layers\n",
+		   h->version == 1 ? 'D' : 'B',
+		   h->rows, h->cols, h->channels, h->depth, h->nlayers);
+
+	/* You probably want to treat the layers/image differently
 	 * according to its mode. */
 	switch(h->mode){
 	case ModeBitmap:
@@ -106,10 +90,8 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 		;
 	}
 
-	if(li){
-		// Process layer, described by struct layer_info pointed to by li
-
-		// The following members of this struct may be useful:
+	for(li = NULL; (li = psd_next_layer(doc, li)); ){
+		// The following members of struct layer_info may be useful:
 		//   top, left, bottom, right       - position/size of layer in document
 		//     (the layer may lie partly or wholly outside the document bounds,
 		//      as defined by PSD header)
@@ -118,44 +100,42 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 		//   struct blend_mode_info blend   - blending information
 		//   struct layer_mask_info mask    - layer mask info
 		//   char *name                     - layer name
+		//   char *unicode_name             - layer name in UTF-8, if present
 
 		printf("layer \"%s\"\n", li->name);
 		for(ch = 0; ch < li->channels; ++ch){
-			// dochannel() initialises the li->chan[ch] struct, including:
+			// Each struct channel_info has, among others:
 			//   id                    - channel id
 			//   comptype              - channel's compression type
-			//   rows, cols, rowbytes  - set by dochannel()
+			//   rows, cols, rowbytes  - size of the channel's image data
 			//   length                - channel byte count in file
-			// how to find image data, depending on compression type:
-			//   rawpos                - file offset of RAW channel data (AFTER compression type)
-			//   rowpos                - row data file positions (RLE ONLY)
-			//   unzipdata             - uncompressed data (ZIP ONLY)
-
-			dochannel(f, li, li->chan + ch, 1, h);
-			printf("  channel %d  id=%2d  %4u rows x %4u cols  %6ld bytes\n",
-				   ch, li->chan[ch].id, li->chan[ch].rows, li->chan[ch].cols,
-				   (long)li->chan[ch].length);
-		}
-	}else{
-		// The merged image has the size, mode, depth, and channel count
-		// given by the main PSD header (h).
-
-		struct channel_info *merged_chans = checkmalloc(h->channels*sizeof(struct channel_info));
-
-		// The 'merged' or 'composite' image is where the flattened image is stored
-		// when 'Maximise Compatibility' is used.
-		// It consists of:
-		// - the alpha channel for merged image (if mergedalpha is TRUE)
-		// - the merged image (1 or 3 channels)
-		// - any remaining alpha or spot channels.
-
-		printf("\nmerged channels:\n");
-		dochannel(f, NULL, merged_chans, h->channels, h);
-		for(ch = 0; ch < h->channels; ++ch){
-			printf("  channel %d  id=%2d  %4u rows x %4u cols\n",
-				   ch, merged_chans[ch].id, merged_chans[ch].rows, merged_chans[ch].cols);
+			chan = li->chan + ch;
+			printf("  channel %d  id=%2d  %4u rows x %4u cols  %6ld bytes  sum=%lu\n",
+				   ch, chan->id, chan->rows, chan->cols, (long)chan->length,
+				   channelsum(doc, chan));
 		}
 
-		free(merged_chans);
+		// a particular channel can be found by its id, e.g.
+		if( (chan = psd_layer_channel(li, TRANS_CHAN_ID)) )
+			printf("  (has transparency)\n");
 	}
+
+	// The merged image has the size, mode, depth, and channel count
+	// given by the main PSD header (h).
+	// The 'merged' or 'composite' image is where the flattened image is stored
+	// when 'Maximise Compatibility' is used.
+	// It consists of:
+	// - the merged image (1 or 3 channels)
+	// - the alpha channel for merged image (if mergedalpha is TRUE)
+	// - any remaining alpha or spot channels.
+
+	printf("\nmerged channels:\n");
+	for(ch = 0; ch < h->channels; ++ch){
+		chan = h->merged_chans + ch;
+		printf("  channel %d  id=%2d  %4u rows x %4u cols  sum=%lu\n",
+			   ch, chan->id, chan->rows, chan->cols, channelsum(doc, chan));
+	}
+
+	psd_close(doc);
+	return EXIT_SUCCESS;
 }
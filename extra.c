@@ -19,45 +19,39 @@
 
 #include "psdparse.h"
 
-#ifdef HAVE_ICONV_H
-	extern iconv_t ic;
-#endif
-
 /* 'Extra data' handling. *Work in progress*
  *
  * There's guesswork and trial-and-error in here,
  * due to many errors and omissions in Adobe's documentation.
  */
 
-static struct psd_header *psd_header = NULL;
-
 #define BITSTR(f) ((f) ? "(1)" : "(0)")
 
 void entertag(psd_file_t f, int level, int len, struct dictentry *parent,
 			  struct dictentry *d, int resetpos)
 {
-	psd_bytes_t savepos = ftello(f);
+	psd_bytes_t savepos = psd_ftello(f);
 	int oneline = d->tag[0] == '-';
 	char *tagname = d->tag + oneline;
 
-	if(xml){
+	if(psd_ctx->xml){
 		// check parent's one-line-ness, because what precedes our <TAG>
 		// belongs to our parent.
-		fprintf(xml, "%s<%s>", parent->tag[0] == '-' ? " " : tabs(level), tagname);
+		fprintf(psd_ctx->xml, "%s<%s>", parent->tag[0] == '-' ? " " : tabs(level), tagname);
 		if(!oneline)
-			fputc('\n', xml);
+			fputc('\n', psd_ctx->xml);
 	}
 
 	d->func(f, level+1, len, d); // parse contents of this datum
 
-	if(xml){
-		fprintf(xml, "%s</%s>", oneline ? "" : tabs(level), tagname);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s</%s>", oneline ? "" : tabs(level), tagname);
 		// if parent's not one-line, then we can safely newline after our tag.
-		fputc(parent->tag[0] == '-' ? ' ' : '\n', xml);
+		fputc(parent->tag[0] == '-' ? ' ' : '\n', psd_ctx->xml);
 	}
 
 	if(resetpos)
-		fseeko(f, savepos, SEEK_SET);
+		psd_fseeko(f, savepos, SEEK_SET);
 }
 
 // This uses a dumb linear search. But it's efficient enough in practice.
@@ -77,11 +71,11 @@ struct dictentry *findbykey(psd_file_t f, int level, struct dictentry *parent,
 				// there is no function to parse this block.
 				// because tag is empty in this case, we only need to consider
 				// parent's one-line-ness.
-				if(xml){
+				if(psd_ctx->xml){
 					if(parent->tag[0] == '-')
-						fprintf(xml, " <%s /> <!-- not parsed --> ", tagname);
+						fprintf(psd_ctx->xml, " <%s /> <!-- not parsed --> ", tagname);
 					else
-						fprintf(xml, "%s<%s /> <!-- not parsed -->\n", tabs(level), tagname);
+						fprintf(psd_ctx->xml, "%s<%s /> <!-- not parsed -->\n", tabs(level), tagname);
 				}
 			}
 			return d;
@@ -128,17 +122,17 @@ void layerblendmode(psd_file_t f, int level, int len, struct blend_mode_info *bm
 	struct dictentry *d;
 	const char *indent = tabs(level);
 
-	if(xml && KEYMATCH(bm->sig, "8BIM")){
-		fprintf(xml, "%s<BLENDMODE OPACITY='%g' CLIPPING='%d'>\n",
+	if(psd_ctx->xml && KEYMATCH(bm->sig, "8BIM")){
+		fprintf(psd_ctx->xml, "%s<BLENDMODE OPACITY='%g' CLIPPING='%d'>\n",
 				indent, bm->opacity/2.55, bm->clipping);
 		findbykey(f, level+1, bmdict, bm->key, len, 1);
-		if(bm->flags & 1) fprintf(xml, "%s\t<TRANSPARENCYPROTECTED />\n", indent);
-		if(bm->flags & 2) fprintf(xml, "%s\t<HIDDEN />\n", indent);
+		if(bm->flags & 1) fprintf(psd_ctx->xml, "%s\t<TRANSPARENCYPROTECTED />\n", indent);
+		if(bm->flags & 2) fprintf(psd_ctx->xml, "%s\t<HIDDEN />\n", indent);
 		if((bm->flags & (8|16)) == (8|16))  // both bits set
-			fprintf(xml, "%s\t<PIXELDATAIRRELEVANT />\n", indent);
-		fprintf(xml, "%s</BLENDMODE>\n", indent);
+			fprintf(psd_ctx->xml, "%s\t<PIXELDATAIRRELEVANT />\n", indent);
+		fprintf(psd_ctx->xml, "%s</BLENDMODE>\n", indent);
 	}
-	if(!xml){
+	if(!psd_ctx->xml){
 		d = findbykey(f, level+1, bmdict, bm->key, len, 1);
 		VERBOSE("  blending mode: sig='%c%c%c%c' key='%c%c%c%c'(%s) opacity=%d(%d%%) clipping=%d(%s)\n\
     flags=%#x(transp_prot%s visible%s bit4valid%s pixel_data_irrelevant%s)\n",
@@ -155,12 +149,12 @@ void layerblendmode(psd_file_t f, int level, int len, struct blend_mode_info *bm
 static void blendmode(psd_file_t f, int level, int len, struct dictentry *parent){
 	char sig[4], key[4];
 
-	fread(sig, 1, 4, f);
-	fread(key, 1, 4, f);
-	if(xml && KEYMATCH(sig, "8BIM")){
-		fprintf(xml, "%s<BLENDMODE>\n", tabs(level));
+	psd_fread(sig, 1, 4, f);
+	psd_fread(key, 1, 4, f);
+	if(psd_ctx->xml && KEYMATCH(sig, "8BIM")){
+		fprintf(psd_ctx->xml, "%s<BLENDMODE>\n", tabs(level));
 		findbykey(f, level+1, bmdict, key, len, 1);
-		fprintf(xml, "%s</BLENDMODE>\n", tabs(level));
+		fprintf(psd_ctx->xml, "%s</BLENDMODE>\n", tabs(level));
 	}
 }
 
@@ -182,47 +176,47 @@ void colorspace(int level, int space, unsigned char data[]){
 	unsigned char str[9];
 	struct colour_space *sp = find_colour_space(space);
 
-	if(xml){
+	if(psd_ctx->xml){
 		memcpy(str, data, 8);
 		str[8] = 0;
 
-		fprintf(xml, "%s<COLOR>\n", indent);
+		fprintf(psd_ctx->xml, "%s<COLOR>\n", indent);
 		if(!sp){ // did not find the matching colour space id
 			// There's not much point in parsing this, but spit out
 			// the component values and a possible string anyway.
-			fprintf(xml, "\t%s<UNKNOWNCOLORSPACE>\n", indent);
-			fprintf(xml, "\t\t%s<ID>%d</ID>\n", indent, space);
-			fprintf(xml, "\t\t%s<STRING>%s</STRING>\n", indent, str);
+			fprintf(psd_ctx->xml, "\t%s<UNKNOWNCOLORSPACE>\n", indent);
+			fprintf(psd_ctx->xml, "\t\t%s<ID>%d</ID>\n", indent, space);
+			fprintf(psd_ctx->xml, "\t\t%s<STRING>%s</STRING>\n", indent, str);
 			for(i = 0; i < 4; ++i)
-				fprintf(xml, "\t\t%s<COMPONENT>%u</COMPONENT>\n",
+				fprintf(psd_ctx->xml, "\t\t%s<COMPONENT>%u</COMPONENT>\n",
 						indent, peek2Bu(data+i*2));
-			fprintf(xml, "\t%s</UNKNOWNCOLORSPACE>\n", indent);
+			fprintf(psd_ctx->xml, "\t%s</UNKNOWNCOLORSPACE>\n", indent);
 		}
 		else if(sp->components && sp->components[0] == '*'){
 			// In some spaces, this is a readable string value
 			// (though this isn't endorsed by documentation).
-			fprintf(xml, "\t%s<%s>", indent, sp->name);
-			fputsxml((char*)str, xml);
-			fprintf(xml, "</%s>\n", sp->name);
+			fprintf(psd_ctx->xml, "\t%s<%s>", indent, sp->name);
+			fputsxml((char*)str, psd_ctx->xml);
+			fprintf(psd_ctx->xml, "</%s>\n", sp->name);
 		}
 		else if(sp->components){
 			// This is a recognised colour space, so we can label
 			// the component elements.
 			int n = strlen(sp->components);
-			fprintf(xml, "\t%s<%s>", indent, sp->name);
+			fprintf(psd_ctx->xml, "\t%s<%s>", indent, sp->name);
 			for(i = 0; i < 4; ++i){
 				unsigned value = peek2Bu(data+i*2);
 				// use initials for each component's element
 				if(i < n)
-					fprintf(xml, " <%c>%u</%c>",
+					fprintf(psd_ctx->xml, " <%c>%u</%c>",
 							sp->components[i], value, sp->components[i]);
 			}
-			fprintf(xml, " </%s>\n", sp->name);
+			fprintf(psd_ctx->xml, " </%s>\n", sp->name);
 		}
 		else{
-			fprintf(xml, "\t%s<%s/>\n", indent, sp->name);
+			fprintf(psd_ctx->xml, "\t%s<%s/>\n", indent, sp->name);
 		}
-		fprintf(xml, "%s</COLOR>\n", indent);
+		fprintf(psd_ctx->xml, "%s</COLOR>\n", indent);
 	}
 }
 
@@ -233,7 +227,7 @@ void colorspace(int level, int space, unsigned char data[]){
 static void color(psd_file_t f, int level, int space){
 	unsigned char data[8];
 
-	fread(data, 1, 8, f);
+	psd_fread(data, 1, 8, f);
 	colorspace(level, space, data);
 }
 
@@ -247,7 +241,7 @@ void ed_colorspace(psd_file_t f, int level, int len, struct dictentry *parent){
 // Print XML for colour description in current mode.
 
 void ed_color(psd_file_t f, int level, int len, struct dictentry *parent){
-	color(f, level, mode_colour_space[psd_header->mode]);
+	color(f, level, mode_colour_space[psd_ctx->h->mode]);
 }
 
 void conv_unicodestyles(psd_file_t f, long count, const char *indent){
@@ -264,23 +258,23 @@ void conv_unicodestyles(psd_file_t f, long count, const char *indent){
 		}
 
 #ifdef HAVE_ICONV_H
-		iconv(ic, NULL, &inb, NULL, &outb); // reset iconv state
+		iconv(psd_ctx->ic, NULL, &inb, NULL, &outb); // reset iconv state
 
 		outb = 6*count; // sloppy overestimate of buffer (FIXME)
 		if( (utf8 = checkmalloc(outb)) ){
 			inbuf = (char*)utf16;
 			inb = 2*count;
 			outbuf = utf8;
-			if(ic != (iconv_t)-1){
-				if(iconv(ic, &inbuf, &inb, &outbuf, &outb) != (size_t)-1){
-					if(xml){
-						fprintf(xml, "%s<UNICODE>", indent);
-						fwritexml(utf8, outbuf-utf8, xml);
-						fputs("</UNICODE>\n", xml);
+			if(psd_ctx->ic != (iconv_t)-1){
+				if(iconv(psd_ctx->ic, &inbuf, &inb, &outbuf, &outb) != (size_t)-1){
+					if(psd_ctx->xml){
+						fprintf(psd_ctx->xml, "%s<UNICODE>", indent);
+						fwritexml(utf8, outbuf-utf8, psd_ctx->xml);
+						fputs("</UNICODE>\n", psd_ctx->xml);
 					}
 
 					// copy to terminal
-					if(verbose)
+					if(psd_ctx->verbose)
 						fwrite(utf8, 1, outbuf-utf8, stdout);
 				}else
 					alwayswarn("iconv() failed, errno=%u\n", errno);
@@ -288,9 +282,9 @@ void conv_unicodestyles(psd_file_t f, long count, const char *indent){
 			free(utf8);
 		}
 #endif
-		if(xml)
+		if(psd_ctx->xml)
 			for(i = 0; i < count; ++i)
-				fprintf(xml, "%s<S>%d</S>\n", indent, style[i]);
+				fprintf(psd_ctx->xml, "%s<S>%d</S>\n", indent, style[i]);
 	}else
 		fatal("conv_unicodestyle(): can't get memory");
 
@@ -305,36 +299,36 @@ static void ed_typetool(psd_file_t f, int level, int len, struct dictentry *pare
 	static const char *coeff[] = {"XX","XY","YX","YY","TX","TY"}; // from CS doc
 	const char *indent = tabs(level);
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, v);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, v);
 
 		// read transform (6 doubles)
-		fprintf(xml, "%s<TRANSFORM>", indent);
+		fprintf(psd_ctx->xml, "%s<TRANSFORM>", indent);
 		for(i = 0; i < 6; ++i)
-			fprintf(xml, " <%s>%g</%s>", coeff[i], getdoubleB(f), coeff[i]);
-		fputs(" </TRANSFORM>\n", xml);
+			fprintf(psd_ctx->xml, " <%s>%g</%s>", coeff[i], getdoubleB(f), coeff[i]);
+		fputs(" </TRANSFORM>\n", psd_ctx->xml);
 
 		// read font information
 		v = get2B(f);
-		fprintf(xml, "%s<FONTINFOVERSION>%d</FONTINFOVERSION>\n", indent, v);
+		fprintf(psd_ctx->xml, "%s<FONTINFOVERSION>%d</FONTINFOVERSION>\n", indent, v);
 
 		if(v <= 6){
 			for(i = get2B(f); i--;){
 				mark = get2B(f);
 				type = get4B(f);
-				fprintf(xml, "%s<FACE MARK='%d' TYPE='%d' FONTNAME='%s'", indent, mark, type, getpstr(f));
-				fprintf(xml, " FONTFAMILY='%s'", getpstr(f));
-				fprintf(xml, " FONTSTYLE='%s'", getpstr(f));
+				fprintf(psd_ctx->xml, "%s<FACE MARK='%d' TYPE='%d' FONTNAME='%s'", indent, mark, type, getpstr(f));
+				fprintf(psd_ctx->xml, " FONTFAMILY='%s'", getpstr(f));
+				fprintf(psd_ctx->xml, " FONTSTYLE='%s'", getpstr(f));
 				script = get2B(f);
-				fprintf(xml, " SCRIPT='%d'>\n", script);
+				fprintf(psd_ctx->xml, " SCRIPT='%d'>\n", script);
 
 				// doc is unclear, but this may work:
-				fprintf(xml, "%s\t<DESIGNVECTOR>", indent);
+				fprintf(psd_ctx->xml, "%s\t<DESIGNVECTOR>", indent);
 				for(j = get4B(f); j--;)
-					fprintf(xml, " <AXIS>%d</AXIS>", get4B(f));
-				fputs(" </DESIGNVECTOR>\n", xml);
+					fprintf(psd_ctx->xml, " <AXIS>%d</AXIS>", get4B(f));
+				fputs(" </DESIGNVECTOR>\n", psd_ctx->xml);
 
-				fprintf(xml, "%s</FACE>\n", indent);
+				fprintf(psd_ctx->xml, "%s</FACE>\n", indent);
 			}
 
 			j = get2B(f); // count of styles
@@ -346,12 +340,12 @@ static void ed_typetool(psd_file_t f, int level, int len, struct dictentry *pare
 				kerning = FIXEDPT(get4B(f));   // taking
 				leading = FIXEDPT(get4B(f));   // a punt
 				baseshift = FIXEDPT(get4B(f)); // on these
-				autokern = fgetc(f);
-				fprintf(xml, "%s<STYLE MARK='%d' FACEMARK='%d' SIZE='%g' TRACKING='%g' KERNING='%g' LEADING='%g' BASESHIFT='%g' AUTOKERN='%d'",
+				autokern = psd_fgetc(f);
+				fprintf(psd_ctx->xml, "%s<STYLE MARK='%d' FACEMARK='%d' SIZE='%g' TRACKING='%g' KERNING='%g' LEADING='%g' BASESHIFT='%g' AUTOKERN='%d'",
 						indent, mark, facemark, size, tracking, kerning, leading, baseshift, autokern);
 				if(v <= 5)
-					fprintf(xml, " EXTRA='%d'", fgetc(f));
-				fprintf(xml, " ROTATE='%d' />\n", fgetc(f));
+					fprintf(psd_ctx->xml, " EXTRA='%d'", psd_fgetc(f));
+				fprintf(psd_ctx->xml, " ROTATE='%d' />\n", psd_fgetc(f));
 			}
 
 			type = get2B(f);
@@ -362,46 +356,45 @@ static void ed_typetool(psd_file_t f, int level, int len, struct dictentry *pare
 			selstart = get4B(f);
 			selend = get4B(f);
 			linecount = get2B(f);
-			fprintf(xml, "%s<TEXT TYPE='%d' SCALING='%g' CHARCOUNT='%d' HPLACEMENT='%g' VPLACEMENT='%g' SELSTART='%d' SELEND='%d'>\n",
+			fprintf(psd_ctx->xml, "%s<TEXT TYPE='%d' SCALING='%g' CHARCOUNT='%d' HPLACEMENT='%g' VPLACEMENT='%g' SELSTART='%d' SELEND='%d'>\n",
 					indent, type, scaling, charcount, hplace, vplace, selstart, selend);
 			for(i = linecount; i--;){
 				charcount = get4B(f);
 				orient = get2B(f);
 				align = get2B(f);
-				fprintf(xml, "%s\t<LINE ORIENTATION='%d' ALIGNMENT='%d'>\n", indent, orient, align);
+				fprintf(psd_ctx->xml, "%s\t<LINE ORIENTATION='%d' ALIGNMENT='%d'>\n", indent, orient, align);
 				conv_unicodestyles(f, charcount, indent-2);
-				fprintf(xml, "%s\t</LINE>\n", indent);
+				fprintf(psd_ctx->xml, "%s\t</LINE>\n", indent);
 			}
 			ed_colorspace(f, level+1, len, parent);
-			fprintf(xml, "%s\t<ANTIALIAS>%d</ANTIALIAS>\n", indent, fgetc(f));
+			fprintf(psd_ctx->xml, "%s\t<ANTIALIAS>%d</ANTIALIAS>\n", indent, psd_fgetc(f));
 
-			fprintf(xml, "%s</TEXT>\n", indent);
+			fprintf(psd_ctx->xml, "%s</TEXT>\n", indent);
 		}else if(v == 50){
 			ed_versdesc(f, level, len, parent); // text
 
-			fprintf(xml, "%s<WARPVERSION>%d</WARPVERSION>\n", indent, get2B(f));
+			fprintf(psd_ctx->xml, "%s<WARPVERSION>%d</WARPVERSION>\n", indent, get2B(f));
 			ed_versdesc(f, level, len, parent); // warp
 
-			fprintf(xml, "%s<LEFT>%d</LEFT>\n", indent, get4B(f));
-			fprintf(xml, "%s<TOP>%d</TOP>\n", indent, get4B(f));
-			fprintf(xml, "%s<RIGHT>%d</RIGHT>\n", indent, get4B(f));
-			fprintf(xml, "%s<BOTTOM>%d</BOTTOM>\n", indent, get4B(f));
+			fprintf(psd_ctx->xml, "%s<LEFT>%d</LEFT>\n", indent, get4B(f));
+			fprintf(psd_ctx->xml, "%s<TOP>%d</TOP>\n", indent, get4B(f));
+			fprintf(psd_ctx->xml, "%s<RIGHT>%d</RIGHT>\n", indent, get4B(f));
+			fprintf(psd_ctx->xml, "%s<BOTTOM>%d</BOTTOM>\n", indent, get4B(f));
 		}else
-			fprintf(xml, "%s<!-- don't know how to parse version %d -->\n", indent, v);
+			fprintf(psd_ctx->xml, "%s<!-- don't know how to parse version %d -->\n", indent, v);
 	}else
 		UNQUIET("    (%s, version = %d)\n", parent->desc, v);
 }
 
 // Stores last layer name encountered; pointer to UTF-8 string.
-char *last_layer_name = NULL;
 
 static void ed_unicodename(psd_file_t f, int level, int len, struct dictentry *parent){
 	unsigned long length = get4B(f); // character count, not byte count
-	char *buf = last_layer_name = conv_unicodestr(f, length);
+	char *buf = psd_ctx->last_layer_name = conv_unicodestr(f, length);
 
 	if(buf){
-		if(xml)
-			fputsxml(buf, xml);
+		if(psd_ctx->xml)
+			fputsxml(buf, psd_ctx->xml);
 		UNQUIET("    (Unicode name = '%s')\n", buf);
 		//free(buf); // caller may use it via global
 	}
@@ -409,28 +402,28 @@ static void ed_unicodename(psd_file_t f, int level, int len, struct dictentry *p
 
 static void ed_long(psd_file_t f, int level, int len, struct dictentry *parent){
 	unsigned long id = get4B(f);
-	if(xml)
-		fprintf(xml, "%lu", id);
+	if(psd_ctx->xml)
+		fprintf(psd_ctx->xml, "%lu", id);
 	else
 		UNQUIET("    (%s = %lu)\n", parent->desc, id);
 }
 
 static void ed_key(psd_file_t f, int level, int len, struct dictentry *parent){
 	char *key = getkey(f);
-	if(xml)
-		fprintf(xml, "%s", key);
+	if(psd_ctx->xml)
+		fprintf(psd_ctx->xml, "%s", key);
 	else
 		UNQUIET("    (%s = '%s')\n", parent->desc, key);
 }
 
 static void ed_sectiondivider(psd_file_t f, int level, int len, struct dictentry *parent){
 	static const char *type[] = {"OTHER", "OPENFOLDER", "CLOSEDFOLDER", "BOUNDING"};
-	if(xml){
+	if(psd_ctx->xml){
 		int t = get4B(f);
 		if(t >= 0 && t <= 3)
-			fprintf(xml, "%s<%s/>\n", tabs(level), type[t]);
+			fprintf(psd_ctx->xml, "%s<%s/>\n", tabs(level), type[t]);
 		else
-			fprintf(xml, "%s<TYPE>%d</TYPE>\n", tabs(level), t);
+			fprintf(psd_ctx->xml, "%s<TYPE>%d</TYPE>\n", tabs(level), t);
 		if(len >= 12)
 			blendmode(f, level, len, parent);
 	}
@@ -438,54 +431,54 @@ static void ed_sectiondivider(psd_file_t f, int level, int len, struct dictentry
 
 static void ed_blendingrestrictions(psd_file_t f, int level, int len, struct dictentry *parent){
 	int i = len/4;
-	if(len && xml)
+	if(len && psd_ctx->xml)
 		while(i--)
-			fprintf(xml, "%s<CHANNEL>%d</CHANNEL>\n", tabs(level), get4B(f));
+			fprintf(psd_ctx->xml, "%s<CHANNEL>%d</CHANNEL>\n", tabs(level), get4B(f));
 }
 
 static void ed_gradient(psd_file_t f, int level, int len, struct dictentry *parent){
 	int stops, expcount, length, space;
 	const char *indent = tabs(level);
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, get2B(f));
-		fprintf(xml, "%s<REVERSED>%d</REVERSED>\n", indent, fgetc(f));
-		fprintf(xml, "%s<DITHERED>%d</DITHERED>\n", indent, fgetc(f));
-		fprintf(xml, "%s<NAME>", indent);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, get2B(f));
+		fprintf(psd_ctx->xml, "%s<REVERSED>%d</REVERSED>\n", indent, psd_fgetc(f));
+		fprintf(psd_ctx->xml, "%s<DITHERED>%d</DITHERED>\n", indent, psd_fgetc(f));
+		fprintf(psd_ctx->xml, "%s<NAME>", indent);
 		xml_unicodestr(f, get4B(f));
-		fputs("</NAME>\n", xml);
+		fputs("</NAME>\n", psd_ctx->xml);
 		for(stops = get2Bu(f); stops--;){
-			fprintf(xml, "%s<COLORSTOP>\n", indent);
-			fprintf(xml, "\t%s<LOCATION>%g</LOCATION>\n", indent, FIXEDPT(get4B(f)));
-			fprintf(xml, "\t%s<MIDPOINT>%g</MIDPOINT>\n", indent, FIXEDPT(get4B(f)));
-			fprintf(xml, "\t%s<MODE>%d</MODE>\n", indent, get2B(f));
+			fprintf(psd_ctx->xml, "%s<COLORSTOP>\n", indent);
+			fprintf(psd_ctx->xml, "\t%s<LOCATION>%g</LOCATION>\n", indent, FIXEDPT(get4B(f)));
+			fprintf(psd_ctx->xml, "\t%s<MIDPOINT>%g</MIDPOINT>\n", indent, FIXEDPT(get4B(f)));
+			fprintf(psd_ctx->xml, "\t%s<MODE>%d</MODE>\n", indent, get2B(f));
 			color(f, level+1, -2 /* FIXME: What colour space *is* meant?? */ );
-			fprintf(xml, "%s</COLORSTOP>\n", indent);
+			fprintf(psd_ctx->xml, "%s</COLORSTOP>\n", indent);
 		}
 		for(stops = get2Bu(f); stops--;){
-			fprintf(xml, "%s<TRANSPARENCYSTOP>\n", indent);
-			fprintf(xml, "\t%s<LOCATION>%g</LOCATION>\n", indent, FIXEDPT(get4B(f)));
-			fprintf(xml, "\t%s<MIDPOINT>%g</MIDPOINT>\n", indent, FIXEDPT(get4B(f)));
-			fprintf(xml, "\t%s<OPACITY>%d</OPACITY>\n", indent, get2B(f));
-			fprintf(xml, "%s</TRANSPARENCYSTOP>\n", indent);
+			fprintf(psd_ctx->xml, "%s<TRANSPARENCYSTOP>\n", indent);
+			fprintf(psd_ctx->xml, "\t%s<LOCATION>%g</LOCATION>\n", indent, FIXEDPT(get4B(f)));
+			fprintf(psd_ctx->xml, "\t%s<MIDPOINT>%g</MIDPOINT>\n", indent, FIXEDPT(get4B(f)));
+			fprintf(psd_ctx->xml, "\t%s<OPACITY>%d</OPACITY>\n", indent, get2B(f));
+			fprintf(psd_ctx->xml, "%s</TRANSPARENCYSTOP>\n", indent);
 		}
-		fprintf(xml, "%s<EXPANSIONCOUNT>%d</EXPANSIONCOUNT>\n", indent, expcount = fgetc(f));
+		fprintf(psd_ctx->xml, "%s<EXPANSIONCOUNT>%d</EXPANSIONCOUNT>\n", indent, expcount = psd_fgetc(f));
 		if(expcount){
-			fprintf(xml, "%s<INTERPOLATION>%d</INTERPOLATION>\n", indent, fgetc(f));
+			fprintf(psd_ctx->xml, "%s<INTERPOLATION>%d</INTERPOLATION>\n", indent, psd_fgetc(f));
 			length = get2B(f);
 			if(length >= 32){
-				fprintf(xml, "%s<MODE>%d</MODE>\n", indent, get2B(f));
-				fprintf(xml, "%s<RANDOMSEED>%u</RANDOMSEED>\n", indent, get4B(f));
-				fprintf(xml, "%s<SHOWTRANSPARENCY>%d</SHOWTRANSPARENCY>\n", indent, get2B(f));
-				fprintf(xml, "%s<VECTORCOLOR>%d</VECTORCOLOR>\n", indent, get2B(f));
-				fprintf(xml, "%s<ROUGHNESS>%d</ROUGHNESS>\n", indent, get4B(f));
-				fprintf(xml, "%s<COLORSPACE>%d</COLORSPACE>\n", indent, space = get2B(f));
-				fprintf(xml, "%s<MINIMUM>\n", indent);
+				fprintf(psd_ctx->xml, "%s<MODE>%d</MODE>\n", indent, get2B(f));
+				fprintf(psd_ctx->xml, "%s<RANDOMSEED>%u</RANDOMSEED>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "%s<SHOWTRANSPARENCY>%d</SHOWTRANSPARENCY>\n", indent, get2B(f));
+				fprintf(psd_ctx->xml, "%s<VECTORCOLOR>%d</VECTORCOLOR>\n", indent, get2B(f));
+				fprintf(psd_ctx->xml, "%s<ROUGHNESS>%d</ROUGHNESS>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "%s<COLORSPACE>%d</COLORSPACE>\n", indent, space = get2B(f));
+				fprintf(psd_ctx->xml, "%s<MINIMUM>\n", indent);
 				color(f, level+1, space);
-				fprintf(xml, "%s</MINIMUM>\n", indent);
-				fprintf(xml, "%s<MAXIMUM>\n", indent);
+				fprintf(psd_ctx->xml, "%s</MINIMUM>\n", indent);
+				fprintf(psd_ctx->xml, "%s<MAXIMUM>\n", indent);
 				color(f, level+1, space);
-				fprintf(xml, "%s</MAXIMUM>\n", indent);
+				fprintf(psd_ctx->xml, "%s</MAXIMUM>\n", indent);
 			}
 		}
 	}
@@ -497,13 +490,13 @@ static void ed_annotation(psd_file_t f, int level, int len, struct dictentry *pa
 	const char *indent = tabs(level);
 	long datalen, len2, rects[8];
 
-	if(xml){
-		fprintf(xml, "%s<VERSION MAJOR='%d' MINOR='%d' />\n", indent, major, minor);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION MAJOR='%d' MINOR='%d' />\n", indent, major, minor);
 		for(i = get4B(f); i--;){
 			length = get4B(f);
-			fread(type, 1, 4, f);
-			open = fgetc(f);
-			flags = fgetc(f);
+			psd_fread(type, 1, 4, f);
+			open = psd_fgetc(f);
+			flags = psd_fgetc(f);
 			optblocks = get2B(f);
 			// read two rectangles - icon and popup
 			for(j = 0; j < 8;)
@@ -511,57 +504,57 @@ static void ed_annotation(psd_file_t f, int level, int len, struct dictentry *pa
 			ed_colorspace(f, level, len, parent);
 
 			if(KEYMATCH(type, "txtA"))
-				fprintf(xml, "%s<TEXT", indent);
+				fprintf(psd_ctx->xml, "%s<TEXT", indent);
 			else if(KEYMATCH(type, "sndA"))
-				fprintf(xml, "%s<SOUND", indent);
+				fprintf(psd_ctx->xml, "%s<SOUND", indent);
 			else
-				fprintf(xml, "%s<UNKNOWN", indent);
-			fprintf(xml, " OPEN='%d' FLAGS='%d' AUTHOR='", open, flags);
-			fputsxml(getpstr2(f), xml);
-			fputs("' NAME='", xml);
-			fputsxml(getpstr2(f), xml);
-			fputs("' MODDATE='", xml);
-			fputsxml(getpstr2(f), xml);
-			fprintf(xml, "' ICONT='%ld' ICONL='%ld' ICONB='%ld' ICONR='%ld'", rects[0],rects[1],rects[2],rects[3]);
-			fprintf(xml, " POPUPT='%ld' POPUPL='%ld' POPUPB='%ld' POPUPR='%ld'", rects[4],rects[5],rects[6],rects[7]);
+				fprintf(psd_ctx->xml, "%s<UNKNOWN", indent);
+			fprintf(psd_ctx->xml, " OPEN='%d' FLAGS='%d' AUTHOR='", open, flags);
+			fputsxml(getpstr2(f), psd_ctx->xml);
+			fputs("' NAME='", psd_ctx->xml);
+			fputsxml(getpstr2(f), psd_ctx->xml);
+			fputs("' MODDATE='", psd_ctx->xml);
+			fputsxml(getpstr2(f), psd_ctx->xml);
+			fprintf(psd_ctx->xml, "' ICONT='%ld' ICONL='%ld' ICONB='%ld' ICONR='%ld'", rects[0],rects[1],rects[2],rects[3]);
+			fprintf(psd_ctx->xml, " POPUPT='%ld' POPUPL='%ld' POPUPB='%ld' POPUPR='%ld'", rects[4],rects[5],rects[6],rects[7]);
 
 			len2 = get4B(f)-12; // remaining bytes in annotation
-			fread(key, 1, 4, f);
+			psd_fread(key, 1, 4, f);
 			datalen = get4B(f);
 			//printf(" optblocks=%d key=%c%c%c%c len2=%ld datalen=%ld\n", optblocks, key[0],key[1],key[2],key[3],len2,datalen);
 			if(KEYMATCH(key, "txtC")){
 				unsigned char bom[2];
 
-				fputc('>', xml);
+				fputc('>', psd_ctx->xml);
 				// use the same BOM test as PDF strings
-				fread(bom, 1, 2, f);
+				psd_fread(bom, 1, 2, f);
 				len2 -= datalen; // we consumed this much from the file
 				datalen -= 2;
 				if(bom[0] == 0xfe && bom[1] == 0xff)
 					xml_unicodestr(f, datalen/2);
 				else{
-					fputcxml(bom[0], xml);
-					fputcxml(bom[1], xml);
+					fputcxml(bom[0], psd_ctx->xml);
+					fputcxml(bom[1], psd_ctx->xml);
 					while(datalen--)
-						fputcxml(fgetc(f), xml);
+						fputcxml(psd_fgetc(f), psd_ctx->xml);
 				}
-				fputs("</TEXT>\n", xml);
+				fputs("</TEXT>\n", psd_ctx->xml);
 			}else if(KEYMATCH(key, "sndM")){
 				// TODO: Check PDF doc for format of sound annotation
-				fprintf(xml, " RATE='%ld' BYTES='%ld' />\n", datalen, len2);
+				fprintf(psd_ctx->xml, " RATE='%ld' BYTES='%ld' />\n", datalen, len2);
 			}else
-				fputs(" /> <!-- don't know -->\n", xml);
+				fputs(" /> <!-- don't know -->\n", psd_ctx->xml);
 
-			fseeko(f, len2, SEEK_CUR); // skip whatever's left of this annotation's data
+			psd_fseeko(f, len2, SEEK_CUR); // skip whatever's left of this annotation's data
 		}
 	}else
 		UNQUIET("    (%s, version = %d.%d)\n", parent->desc, major, minor);
 }
 
 static void ed_byte(psd_file_t f, int level, int len, struct dictentry *parent){
-	int k = fgetc(f);
-	if(xml)
-		fprintf(xml, "%d", k);
+	int k = psd_fgetc(f);
+	if(psd_ctx->xml)
+		fprintf(psd_ctx->xml, "%d", k);
 	else
 		UNQUIET("    (%s = %d)\n", parent->desc, k);
 }
@@ -571,8 +564,8 @@ static void ed_referencepoint(psd_file_t f, int level, int len, struct dictentry
 
 	x = getdoubleB(f);
 	y = getdoubleB(f);
-	if(xml)
-		fprintf(xml, " <X>%g</X> <Y>%g</Y> ", x, y);
+	if(psd_ctx->xml)
+		fprintf(psd_ctx->xml, " <X>%g</X> <Y>%g</Y> ", x, y);
 	else
 		UNQUIET("    (%s X=%g Y=%g)\n", parent->desc, x, y);
 }
@@ -580,18 +573,18 @@ static void ed_referencepoint(psd_file_t f, int level, int len, struct dictentry
 // CS doc
 void ed_versdesc(psd_file_t f, int level, int len, struct dictentry *parent){
 	long v = get4B(f);
-	if(xml){
-		fprintf(xml, "%s<DESCRIPTORVERSION>%ld</DESCRIPTORVERSION>\n", tabs(level), v);
-		fprintf(xml, "%s<DESCRIPTOR>\n", tabs(level));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<DESCRIPTORVERSION>%ld</DESCRIPTORVERSION>\n", tabs(level), v);
+		fprintf(psd_ctx->xml, "%s<DESCRIPTOR>\n", tabs(level));
 		descriptor(f, level+1, len, parent);
-		fprintf(xml, "%s</DESCRIPTOR>\n", tabs(level));
+		fprintf(psd_ctx->xml, "%s</DESCRIPTOR>\n", tabs(level));
 	}
 }
 
 // CS doc
 static void ed_objecteffects(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", tabs(level), get4B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", tabs(level), get4B(f));
 		ed_versdesc(f, level, len, parent);
 	}
 }
@@ -602,72 +595,76 @@ static void ed_vectormask(psd_file_t f, int level, int len, struct dictentry *pa
 	const char *indent = tabs(level);
 	int flags;
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, get4B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, get4B(f));
 		flags = get4B(f);
-		if(flags & 2) fprintf(xml, "%s<INVERT/>\n", indent);
-		if(flags & 4) fprintf(xml, "%s<NOTLINK/>\n", indent);
-		if(flags & 8) fprintf(xml, "%s<DISABLE/>\n", indent);
-		fprintf(xml, "%s<PATH>\n", indent);
+		if(flags & 2) fprintf(psd_ctx->xml, "%s<INVERT/>\n", indent);
+		if(flags & 4) fprintf(psd_ctx->xml, "%s<NOTLINK/>\n", indent);
+		if(flags & 8) fprintf(psd_ctx->xml, "%s<DISABLE/>\n", indent);
+		fprintf(psd_ctx->xml, "%s<PATH>\n", indent);
 		ir_path(f, level+1, len-8, parent);
-		fprintf(xml, "%s</PATH>\n", indent);
+		fprintf(psd_ctx->xml, "%s</PATH>\n", indent);
 	}
 }
 
+// In PSB, these blocks have an 8-byte length (GETPSDBYTES).
+
+int widelengthkey(char *key){
+	return KEYMATCH(key, "LMsk") || KEYMATCH(key, "Lr16") || KEYMATCH(key, "Lr32")
+		|| KEYMATCH(key, "Layr") || KEYMATCH(key, "Mt16") || KEYMATCH(key, "Mt32")
+		|| KEYMATCH(key, "Mtrn") || KEYMATCH(key, "Alph") || KEYMATCH(key, "FMsk")
+		|| KEYMATCH(key, "Ink2") || KEYMATCH(key, "FEid") || KEYMATCH(key, "FXid")
+		|| KEYMATCH(key, "PxSD");
+}
+
 static int sigkeyblock(psd_file_t f, struct psd_header *h, int level, int len, struct dictentry *dict){
 	char sig[4], key[4];
 	long length;
 	struct dictentry *d;
 	int is_photoshop;
 
-	fread(sig, 1, 4, f);
+	psd_fread(sig, 1, 4, f);
 	is_photoshop = KEYMATCH(sig, "8BIM") || KEYMATCH(sig, "8B64");
-	fread(key, 1, 4, f);
-	length = is_photoshop
-			 && ( KEYMATCH(key, "LMsk") || KEYMATCH(key, "Lr16") || KEYMATCH(key, "Lr32")
-			   || KEYMATCH(key, "Layr") || KEYMATCH(key, "Mt16") || KEYMATCH(key, "Mt32")
-			   || KEYMATCH(key, "Mtrn") || KEYMATCH(key, "Alph") || KEYMATCH(key, "FMsk")
-			   || KEYMATCH(key, "Ink2") || KEYMATCH(key, "FEid") || KEYMATCH(key, "FXid")
-			   || KEYMATCH(key, "PxSD") )
-			  ? GETPSDBYTES(f) : get4B(f);
-	if(!xml)
+	psd_fread(key, 1, 4, f);
+	length = is_photoshop && widelengthkey(key) ? GETPSDBYTES(f) : get4B(f);
+	if(!psd_ctx->xml)
 		VERBOSE("    data block: sig='%c%c%c%c' key='%c%c%c%c' length=%7ld\n",
 				sig[0],sig[1],sig[2],sig[3], key[0],key[1],key[2],key[3], length);
 	if(is_photoshop && dict && (d = findbykey(f, level, dict, key, length, 1))
-	   && !d->func && !xml)
+	   && !d->func && !psd_ctx->xml)
 	{
 		// there is no function to parse this block
 		UNQUIET("    (data: %s)\n", d->desc);
-		if(verbose){
-			psd_bytes_t pos = ftello(f);
+		if(psd_ctx->verbose){
+			psd_bytes_t pos = psd_ftello(f);
 			int n = length > 32 ? 32 : length;
 			printf("    ");
 			while(n--)
-				printf("%02x ", fgetc(f));
+				printf("%02x ", psd_fgetc(f));
 			printf(length > 32 ? "...\n" : "\n");
-			fseeko(f, pos, SEEK_SET);
+			psd_fseeko(f, pos, SEEK_SET);
 		}
 	}
-	fseeko(f, length, SEEK_CUR);
+	psd_fseeko(f, length, SEEK_CUR);
 	return length + 12; // return number of bytes consumed
 }
 
 static void dumpblock(psd_file_t f, int level, int len, struct dictentry *dict){
 	// FIXME: this can over-run the actual block; need to pass block length into the function
-	if(verbose){
+	if(psd_ctx->verbose){
 		int n = 32;
 		printf("%s: ", dict->desc);
 		while(n--)
-			printf("%02x ", fgetc(f));
+			printf("%02x ", psd_fgetc(f));
 		putchar('\n');
 	}
 }
 
 // CS doc
 static void fx_commonstate(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", tabs(level), get4B(f));
-		fprintf(xml, "%s<VISIBLE>%d</VISIBLE>\n", tabs(level), fgetc(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", tabs(level), get4B(f));
+		fprintf(psd_ctx->xml, "%s<VISIBLE>%d</VISIBLE>\n", tabs(level), psd_fgetc(f));
 	}
 }
 
@@ -675,17 +672,17 @@ static void fx_commonstate(psd_file_t f, int level, int len, struct dictentry *p
 static void fx_shadow(psd_file_t f, int level, int len, struct dictentry *parent){
 	const char *indent = tabs(level);
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, get4B(f));
-		fprintf(xml, "%s<BLUR>%g</BLUR>\n", indent, FIXEDPT(get4B(f))); // this is fixed point, but you wouldn't know it from the doc
-		fprintf(xml, "%s<INTENSITY>%g</INTENSITY>\n", indent, FIXEDPT(get4B(f))); // they're trying to make it more interesting for
-		fprintf(xml, "%s<ANGLE>%g</ANGLE>\n", indent, FIXEDPT(get4B(f)));         // implementors, I guess, by setting little puzzles
-		fprintf(xml, "%s<DISTANCE>%g</DISTANCE>\n", indent, FIXEDPT(get4B(f)));   // "pit yourself against our documentation!"
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, get4B(f));
+		fprintf(psd_ctx->xml, "%s<BLUR>%g</BLUR>\n", indent, FIXEDPT(get4B(f))); // this is fixed point, but you wouldn't know it from the doc
+		fprintf(psd_ctx->xml, "%s<INTENSITY>%g</INTENSITY>\n", indent, FIXEDPT(get4B(f))); // they're trying to make it more interesting for
+		fprintf(psd_ctx->xml, "%s<ANGLE>%g</ANGLE>\n", indent, FIXEDPT(get4B(f)));         // implementors, I guess, by setting little puzzles
+		fprintf(psd_ctx->xml, "%s<DISTANCE>%g</DISTANCE>\n", indent, FIXEDPT(get4B(f)));   // "pit yourself against our documentation!"
 		ed_colorspace(f, level, len, parent);
 		blendmode(f, level, len, parent);
-		fprintf(xml, "%s<ENABLED>%d</ENABLED>\n", indent, fgetc(f));
-		fprintf(xml, "%s<USEANGLE>%d</USEANGLE>\n", indent, fgetc(f));
-		fprintf(xml, "%s<OPACITY>%g</OPACITY>\n", indent, fgetc(f)/2.55); // doc implies this is a percentage; it's not, it's 0-255 as usual
+		fprintf(psd_ctx->xml, "%s<ENABLED>%d</ENABLED>\n", indent, psd_fgetc(f));
+		fprintf(psd_ctx->xml, "%s<USEANGLE>%d</USEANGLE>\n", indent, psd_fgetc(f));
+		fprintf(psd_ctx->xml, "%s<OPACITY>%g</OPACITY>\n", indent, psd_fgetc(f)/2.55); // doc implies this is a percentage; it's not, it's 0-255 as usual
 		ed_colorspace(f, level, len, parent);
 	}
 }
@@ -694,14 +691,14 @@ static void fx_shadow(psd_file_t f, int level, int len, struct dictentry *parent
 static void fx_outerglow(psd_file_t f, int level, int len, struct dictentry *parent){
 	const char *indent = tabs(level);
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, get4B(f));
-		fprintf(xml, "%s<BLUR>%g</BLUR>\n", indent, FIXEDPT(get4B(f)));
-		fprintf(xml, "%s<INTENSITY>%g</INTENSITY>\n", indent, FIXEDPT(get4B(f)));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, get4B(f));
+		fprintf(psd_ctx->xml, "%s<BLUR>%g</BLUR>\n", indent, FIXEDPT(get4B(f)));
+		fprintf(psd_ctx->xml, "%s<INTENSITY>%g</INTENSITY>\n", indent, FIXEDPT(get4B(f)));
 		ed_colorspace(f, level, len, parent);
 		blendmode(f, level, len, parent);
-		fprintf(xml, "%s<ENABLED>%d</ENABLED>\n", indent, fgetc(f));
-		fprintf(xml, "%s<OPACITY>%g</OPACITY>\n", indent, fgetc(f)/2.55);
+		fprintf(psd_ctx->xml, "%s<ENABLED>%d</ENABLED>\n", indent, psd_fgetc(f));
+		fprintf(psd_ctx->xml, "%s<OPACITY>%g</OPACITY>\n", indent, psd_fgetc(f)/2.55);
 		ed_colorspace(f, level, len, parent);
 	}
 }
@@ -711,16 +708,16 @@ static void fx_innerglow(psd_file_t f, int level, int len, struct dictentry *par
 	const char *indent = tabs(level);
 	long version;
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%ld</VERSION>\n", indent, version = get4B(f));
-		fprintf(xml, "%s<BLUR>%g</BLUR>\n", indent, FIXEDPT(get4B(f)));
-		fprintf(xml, "%s<INTENSITY>%g</INTENSITY>\n", indent, FIXEDPT(get4B(f)));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%ld</VERSION>\n", indent, version = get4B(f));
+		fprintf(psd_ctx->xml, "%s<BLUR>%g</BLUR>\n", indent, FIXEDPT(get4B(f)));
+		fprintf(psd_ctx->xml, "%s<INTENSITY>%g</INTENSITY>\n", indent, FIXEDPT(get4B(f)));
 		ed_colorspace(f, level, len, parent);
 		blendmode(f, level, len, parent);
-		fprintf(xml, "%s<ENABLED>%d</ENABLED>\n", indent, fgetc(f));
-		fprintf(xml, "%s<OPACITY>%g</OPACITY>\n", indent, fgetc(f)/2.55);
+		fprintf(psd_ctx->xml, "%s<ENABLED>%d</ENABLED>\n", indent, psd_fgetc(f));
+		fprintf(psd_ctx->xml, "%s<OPACITY>%g</OPACITY>\n", indent, psd_fgetc(f)/2.55);
 		if(version==2)
-			fprintf(xml, "%s<INVERT>%d</INVERT>\n", indent, fgetc(f));
+			fprintf(psd_ctx->xml, "%s<INVERT>%d</INVERT>\n", indent, psd_fgetc(f));
 		ed_colorspace(f, level, len, parent);
 	}
 }
@@ -730,21 +727,21 @@ static void fx_bevel(psd_file_t f, int level, int len, struct dictentry *parent)
 	const char *indent = tabs(level);
 	long version;
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%ld</VERSION>\n", indent, version = get4B(f));
-		fprintf(xml, "%s<ANGLE>%g</ANGLE>\n", indent, FIXEDPT(get4B(f)));
-		fprintf(xml, "%s<STRENGTH>%g</STRENGTH>\n", indent, FIXEDPT(get4B(f)));
-		fprintf(xml, "%s<BLUR>%g</BLUR>\n", indent, FIXEDPT(get4B(f)));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%ld</VERSION>\n", indent, version = get4B(f));
+		fprintf(psd_ctx->xml, "%s<ANGLE>%g</ANGLE>\n", indent, FIXEDPT(get4B(f)));
+		fprintf(psd_ctx->xml, "%s<STRENGTH>%g</STRENGTH>\n", indent, FIXEDPT(get4B(f)));
+		fprintf(psd_ctx->xml, "%s<BLUR>%g</BLUR>\n", indent, FIXEDPT(get4B(f)));
 		blendmode(f, level, len, parent);
 		blendmode(f, level, len, parent);
 		ed_colorspace(f, level, len, parent);
 		ed_colorspace(f, level, len, parent);
-		fprintf(xml, "%s<STYLE>%d</STYLE>\n", indent, fgetc(f));
-		fprintf(xml, "%s<HIGHLIGHTOPACITY>%g</HIGHLIGHTOPACITY>\n", indent, fgetc(f)/2.55);
-		fprintf(xml, "%s<SHADOWOPACITY>%g</SHADOWOPACITY>\n", indent, fgetc(f)/2.55);
-		fprintf(xml, "%s<ENABLED>%d</ENABLED>\n", indent, fgetc(f));
-		fprintf(xml, "%s<USEANGLE>%d</USEANGLE>\n", indent, fgetc(f));
-		fprintf(xml, "%s<UPDOWN>%d</UPDOWN>\n", indent, fgetc(f)); // heh, interpretation is undocumented
+		fprintf(psd_ctx->xml, "%s<STYLE>%d</STYLE>\n", indent, psd_fgetc(f));
+		fprintf(psd_ctx->xml, "%s<HIGHLIGHTOPACITY>%g</HIGHLIGHTOPACITY>\n", indent, psd_fgetc(f)/2.55);
+		fprintf(psd_ctx->xml, "%s<SHADOWOPACITY>%g</SHADOWOPACITY>\n", indent, psd_fgetc(f)/2.55);
+		fprintf(psd_ctx->xml, "%s<ENABLED>%d</ENABLED>\n", indent, psd_fgetc(f));
+		fprintf(psd_ctx->xml, "%s<USEANGLE>%d</USEANGLE>\n", indent, psd_fgetc(f));
+		fprintf(psd_ctx->xml, "%s<UPDOWN>%d</UPDOWN>\n", indent, psd_fgetc(f)); // heh, interpretation is undocumented
 		if(version==2){
 			ed_colorspace(f, level, len, parent);
 			ed_colorspace(f, level, len, parent);
@@ -757,13 +754,13 @@ static void fx_solidfill(psd_file_t f, int level, int len, struct dictentry *par
 	const char *indent = tabs(level);
 	long version;
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%ld</VERSION>\n", indent, version = get4B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%ld</VERSION>\n", indent, version = get4B(f));
 		// blendmode is the usual 8 bytes; doc only mentions 4
 		blendmode(f, level, len, parent);
 		ed_colorspace(f, level, len, parent);
-		fprintf(xml, "%s<OPACITY>%g</OPACITY>\n", indent, fgetc(f)/2.55);
-		fprintf(xml, "%s<ENABLED>%d</ENABLED>\n", indent, fgetc(f));
+		fprintf(psd_ctx->xml, "%s<OPACITY>%g</OPACITY>\n", indent, psd_fgetc(f)/2.55);
+		fprintf(psd_ctx->xml, "%s<ENABLED>%d</ENABLED>\n", indent, psd_fgetc(f));
 		ed_colorspace(f, level, len, parent);
 	}
 }
@@ -782,8 +779,8 @@ static void ed_layereffects(psd_file_t f, int level, int len, struct dictentry *
 	};
 	int count;
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", tabs(level), get2B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", tabs(level), get2B(f));
 		for(count = get2B(f); count--;)
 			if(!sigkeyblock(f, NULL/*FIXME*/, level, len, fxdict))
 				break; // got bad signature
@@ -796,20 +793,20 @@ static void mdblock(psd_file_t f, int level, int len){
 	int copy;
 	const char *indent = tabs(level);
 
-	fread(sig, 1, 4, f);
-	fread(key, 1, 4, f);
-	copy = fgetc(f);
-	fseeko(f, 3, SEEK_CUR); // padding
+	psd_fread(sig, 1, 4, f);
+	psd_fread(key, 1, 4, f);
+	copy = psd_fgetc(f);
+	psd_fseeko(f, 3, SEEK_CUR); // padding
 	length = get4B(f);
-	if(xml){
-		fprintf(xml, "%s<METADATA SIG='", indent);
-		fwritexml(sig, 4, xml);
-		fputs("' KEY='", xml);
-		fwritexml(key, 4, xml);
-		fputs("'>\n", xml);
-		fprintf(xml, "\t%s<COPY>%d</COPY>\n", indent, copy);
-		fprintf(xml, "\t%s<!-- %ld bytes of undocumented data -->\n", indent, length); // the documentation tells us that it's undocumented
-		fprintf(xml, "%s</METADATA>\n", indent);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<METADATA SIG='", indent);
+		fwritexml(sig, 4, psd_ctx->xml);
+		fputs("' KEY='", psd_ctx->xml);
+		fwritexml(key, 4, psd_ctx->xml);
+		fputs("'>\n", psd_ctx->xml);
+		fprintf(psd_ctx->xml, "\t%s<COPY>%d</COPY>\n", indent, copy);
+		fprintf(psd_ctx->xml, "\t%s<!-- %ld bytes of undocumented data -->\n", indent, length); // the documentation tells us that it's undocumented
+		fprintf(psd_ctx->xml, "%s</METADATA>\n", indent);
 	}else
 		UNQUIET("    (Metadata: sig='%c%c%c%c' key='%c%c%c%c' %ld bytes)\n",
 				sig[0],sig[1],sig[2],sig[3], key[0],key[1],key[2],key[3], length);
@@ -828,8 +825,8 @@ static void ed_layer16(psd_file_t f, int level, int len, struct dictentry *paren
 	// This block is an entire layer info section (i.e. it begins with
 	// a layer count and is followed by layer info just like the ordinary section).
 	// Update the main header struct with the layer count, info pointers, etc.
-	dolayerinfo(f, psd_header);
-	processlayers(f, psd_header);
+	dolayerinfo(f, psd_ctx->h);
+	processlayers(psd_ctx, f, psd_ctx->h);
 }
 
 // v6 doc
@@ -837,19 +834,19 @@ static void adj_levels(psd_file_t f, int level, int len, struct dictentry *paren
 	const char *indent = tabs(level);
 	int i, j, v[5], version = get2B(f);
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, version);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, version);
 		for(i = 0; i < 29; ++i){
 			for(j = 0; j < 5; ++j)
 				v[j] = get2B(f);
 
-			fprintf(xml, "%s<CHANNEL>\n", indent);
-			fprintf(xml, "\t%s<INPUTFLOOR>%d</INPUTFLOOR>\n",   indent, v[0]);
-			fprintf(xml, "\t%s<INPUTCEIL>%d</INPUTCEIL>\n",     indent, v[1]);
-			fprintf(xml, "\t%s<OUTPUTFLOOR>%d</OUTPUTFLOOR>\n", indent, v[2]);
-			fprintf(xml, "\t%s<OUTPUTCEIL>%d</OUTPUTCEIL>\n",   indent, v[3]);
-			fprintf(xml, "\t%s<GAMMA>%g</GAMMA>\n",             indent, v[4]/100.);
-			fprintf(xml, "%s</CHANNEL>\n", indent);
+			fprintf(psd_ctx->xml, "%s<CHANNEL>\n", indent);
+			fprintf(psd_ctx->xml, "\t%s<INPUTFLOOR>%d</INPUTFLOOR>\n",   indent, v[0]);
+			fprintf(psd_ctx->xml, "\t%s<INPUTCEIL>%d</INPUTCEIL>\n",     indent, v[1]);
+			fprintf(psd_ctx->xml, "\t%s<OUTPUTFLOOR>%d</OUTPUTFLOOR>\n", indent, v[2]);
+			fprintf(psd_ctx->xml, "\t%s<OUTPUTCEIL>%d</OUTPUTCEIL>\n",   indent, v[3]);
+			fprintf(psd_ctx->xml, "\t%s<GAMMA>%g</GAMMA>\n",             indent, v[4]/100.);
+			fprintf(psd_ctx->xml, "%s</CHANNEL>\n", indent);
 		}
 	}
 }
@@ -859,21 +856,21 @@ static void adj_curves(psd_file_t f, int level, int len, struct dictentry *paren
 	const char *indent = tabs(level);
 	int i, j, version, count;
 
-	fgetc(f); // mystery data - not mentioned in v6 doc?!
+	psd_fgetc(f); // mystery data - not mentioned in v6 doc?!
 	version = get2B(f);
 	get2B(f); // mystery data
 	count = get2B(f);
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, version);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, version);
 		for(i = 0; i < count; ++i){
 			int points = get2B(f);
-			fprintf(xml, "%s<CURVE>\n", indent);
+			fprintf(psd_ctx->xml, "%s<CURVE>\n", indent);
 			for(j = 0; j < points; ++j){
 				int output = get2B(f), input = get2B(f);
-				fprintf(xml, "\t%s<POINT> <OUTPUT>%d</OUTPUT> <INPUT>%d</INPUT> </POINT>\n",
+				fprintf(psd_ctx->xml, "\t%s<POINT> <OUTPUT>%d</OUTPUT> <INPUT>%d</INPUT> </POINT>\n",
 						indent, output, input);
 			}
-			fprintf(xml, "%s</CURVE>\n", indent);
+			fprintf(psd_ctx->xml, "%s</CURVE>\n", indent);
 		}
 	}
 }
@@ -885,19 +882,19 @@ static void adj_huesat4(psd_file_t f, int level, int len, struct dictentry *pare
 	int i, j, version, mode;
 
 	version = get2B(f);
-	mode = fgetc(f);
-	fgetc(f);
+	mode = psd_fgetc(f);
+	psd_fgetc(f);
 
-	if(xml){
+	if(psd_ctx->xml){
 		int h = get2B(f), s = get2B(f), l = get2B(f);
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, version);
-		fprintf(xml, "%s<%s/>\n", indent, mode ? "COLORISE" : "HUEADJUST");
-		fprintf(xml, "%s<H>%d</H> <S>%d</S> <L>%d</L>\n", indent, h, s, l);
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, version);
+		fprintf(psd_ctx->xml, "%s<%s/>\n", indent, mode ? "COLORISE" : "HUEADJUST");
+		fprintf(psd_ctx->xml, "%s<H>%d</H> <S>%d</S> <L>%d</L>\n", indent, h, s, l);
 		for(i = 0; i < 3; ++i){
-			fprintf(xml, "%s<%s>\n", indent, hsl[i]);
+			fprintf(psd_ctx->xml, "%s<%s>\n", indent, hsl[i]);
 			for(j = 0; j < 7; ++j)
-				fprintf(xml, "\t%s<VALUE>%d</VALUE>\n", indent, get2B(f));
-			fprintf(xml, "%s</%s>\n", indent, hsl[i]);
+				fprintf(psd_ctx->xml, "\t%s<VALUE>%d</VALUE>\n", indent, get2B(f));
+			fprintf(psd_ctx->xml, "%s</%s>\n", indent, hsl[i]);
 		}
 	}
 }
@@ -908,21 +905,21 @@ static void adj_huesat5(psd_file_t f, int level, int len, struct dictentry *pare
 	int i, j, version, mode;
 
 	version = get2B(f);
-	mode = fgetc(f);
-	fgetc(f);
+	mode = psd_fgetc(f);
+	psd_fgetc(f);
 
-	if(xml){
+	if(psd_ctx->xml){
 		int h = get2B(f), s = get2B(f), l = get2B(f);
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, version);
-		fprintf(xml, "%s<%s/>\n", indent, mode ? "COLORISE" : "HUEADJUST");
-		fprintf(xml, "%s<H>%d</H> <S>%d</S> <L>%d</L>\n", indent, h, s, l);
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, version);
+		fprintf(psd_ctx->xml, "%s<%s/>\n", indent, mode ? "COLORISE" : "HUEADJUST");
+		fprintf(psd_ctx->xml, "%s<H>%d</H> <S>%d</S> <L>%d</L>\n", indent, h, s, l);
 		for(i = 0; i < 6; ++i){
-			fprintf(xml, "%s<HEXTANT>\n", indent);
+			fprintf(psd_ctx->xml, "%s<HEXTANT>\n", indent);
 			for(j = 0; j < 4; ++j)
-				fprintf(xml, "\t%s<RANGE>%d</RANGE>\n", indent, get2B(f));
+				fprintf(psd_ctx->xml, "\t%s<RANGE>%d</RANGE>\n", indent, get2B(f));
 			for(j = 0; j < 3; ++j)
-				fprintf(xml, "\t%s<SETTING>%d</SETTING>\n", indent, get2B(f));
-			fprintf(xml, "%s</HEXTANT>\n", indent);
+				fprintf(psd_ctx->xml, "\t%s<SETTING>%d</SETTING>\n", indent, get2B(f));
+			fprintf(psd_ctx->xml, "%s</HEXTANT>\n", indent);
 		}
 	}
 }
@@ -933,17 +930,17 @@ static void adj_selcol(psd_file_t f, int level, int len, struct dictentry *paren
 	int i, version = get2B(f);
 	static char *colours[] = {"RESERVED", "REDS", "YELLOWS", "GREENS", "CYANS",
 							  "BLUES", "MAGENTAS", "WHITES", "NEUTRALS", "BLACKS"};
-	fgetc(f);
+	psd_fgetc(f);
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, version);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, version);
 		for(i = 0; i < 10; ++i){
-			fprintf(xml, "%s<%s>", indent, colours[i]);
-			fprintf(xml, " <C>%d</C>", get2B(f));
-			fprintf(xml, " <M>%d</M>", get2B(f));
-			fprintf(xml, " <Y>%d</Y>", get2B(f));
-			fprintf(xml, " <K>%d</K>", get2B(f));
-			fprintf(xml, " </%s>\n", colours[i]);
+			fprintf(psd_ctx->xml, "%s<%s>", indent, colours[i]);
+			fprintf(psd_ctx->xml, " <C>%d</C>", get2B(f));
+			fprintf(psd_ctx->xml, " <M>%d</M>", get2B(f));
+			fprintf(psd_ctx->xml, " <Y>%d</Y>", get2B(f));
+			fprintf(psd_ctx->xml, " <K>%d</K>", get2B(f));
+			fprintf(psd_ctx->xml, " </%s>\n", colours[i]);
 		}
 	}
 }
@@ -951,11 +948,11 @@ static void adj_selcol(psd_file_t f, int level, int len, struct dictentry *paren
 static void adj_brightnesscontrast(psd_file_t f, int level, int len, struct dictentry *parent){
 	const char *indent = tabs(level);
 
-	if(xml){
-		fprintf(xml, "%s<BRIGHTNESS>%d</BRIGHTNESS>\n", indent, get2B(f));
-		fprintf(xml, "%s<CONTRAST>%d</CONTRAST>\n", indent, get2B(f));
-		fprintf(xml, "%s<MEAN>%d</MEAN>\n", indent, get2B(f));
-		fprintf(xml, "%s<LABCOLORONLY>%d</LABCOLORONLY>\n", indent, fgetc(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<BRIGHTNESS>%d</BRIGHTNESS>\n", indent, get2B(f));
+		fprintf(psd_ctx->xml, "%s<CONTRAST>%d</CONTRAST>\n", indent, get2B(f));
+		fprintf(psd_ctx->xml, "%s<MEAN>%d</MEAN>\n", indent, get2B(f));
+		fprintf(psd_ctx->xml, "%s<LABCOLORONLY>%d</LABCOLORONLY>\n", indent, psd_fgetc(f));
 	}
 }
 
@@ -1029,6 +1026,7 @@ void doadditional(psd_file_t f, struct psd_header *h, int level, psd_bytes_t len
 		{0, "FEid", "FILTEREFFECTSFEID", "Filter effects (FEid)", NULL}, // July 2007 doc
 		// from libpsd
 		{0, "Lr16", "LAYER16", "Layer (16)", ed_layer16},
+		{0, "Lr32", "LAYER32", "Layer (32)", ed_layer16},
 
 		// CS5 - from July 2010 doc
 		{0, "CgEd", "CONTENTGENEXTRADATA", "Content Generator Extra Data", NULL},
@@ -1038,7 +1036,7 @@ void doadditional(psd_file_t f, struct psd_header *h, int level, psd_bytes_t len
 		{0, NULL, NULL, NULL, NULL}
 	};
 
-	psd_header = h;
+	psd_ctx->h = h;
 
 	while(length >= 12){
 		psd_bytes_t block = sigkeyblock(f, h, level, length, extradict);
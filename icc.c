@@ -23,27 +23,27 @@ double s15fixed16(psd_file_t f){ return get4B(f)/65536.; }
 
 static void icc_xyz(psd_file_t f, int level, int len, struct dictentry *parent){
 	for(; len >= 12; len -= 12){
-		fprintf(xml, " <X>%g</X>",  s15fixed16(f));
-		fprintf(xml, " <Y>%g</Y>",  s15fixed16(f));
-		fprintf(xml, " <Z>%g</Z> ", s15fixed16(f));
+		fprintf(psd_ctx->xml, " <X>%g</X>",  s15fixed16(f));
+		fprintf(psd_ctx->xml, " <Y>%g</Y>",  s15fixed16(f));
+		fprintf(psd_ctx->xml, " <Z>%g</Z> ", s15fixed16(f));
 	}
 }
 
 static void icc_text(psd_file_t f, int level, int len, struct dictentry *parent){
 	--len; // exclude terminating NUL
 	while(len--)
-		fputcxml(fgetc(f), xml);
+		fputcxml(psd_fgetc(f), psd_ctx->xml);
 }
 
 static void icc_textdescription(psd_file_t f, int level, int len, struct dictentry *parent){
 	long count = get4B(f)-1; // exclude terminating NUL
 	while(count--)
-		fputcxml(fgetc(f), xml);
+		fputcxml(psd_fgetc(f), psd_ctx->xml);
 	// ignore other fields of this tag
 }
 
 static void icc_rawsignature(psd_file_t f, int level, int len, struct dictentry *parent){
-	fputsxml(getkey(f), xml);
+	fputsxml(getkey(f), psd_ctx->xml);
 }
 static void icc_signature(psd_file_t f, int level, int len, struct dictentry *parent){
 	static struct dictentry sigdict[] = {
@@ -79,7 +79,7 @@ static void icc_signature(psd_file_t f, int level, int len, struct dictentry *pa
 
 static void icc_datetime(psd_file_t f, int level, int len, struct dictentry *parent){
 	int y = get2B(f), mo = get2B(f), d = get2B(f), h = get2B(f), m = get2B(f), s = get2B(f);
-	fprintf(xml, "%04d-%02d-%02d %02d:%02d:%02d", y, mo, d, h, m, s);
+	fprintf(psd_ctx->xml, "%04d-%02d-%02d %02d:%02d:%02d", y, mo, d, h, m, s);
 }
 
 static void icc_tag(psd_file_t f, int level, int len, struct dictentry *parent){
@@ -216,50 +216,50 @@ void ir_icc34profile(psd_file_t f, int level, int len, struct dictentry *parent)
 	char sig[4];
 	off_t iccpos, pos;
 
-	if(!xml)
+	if(!psd_ctx->xml)
 		return;
 
-	iccpos = ftello(f);
+	iccpos = psd_ftello(f);
 	size = get4B(f);
-	fprintf(xml, "%s<cmmId>%s</cmmId>\n", indent, getkey(f));
-	fprintf(xml, "%s<version>%08x</version>\n", indent, get4B(f));
-	fprintf(xml, "%s<deviceClass>\n", indent);
+	fprintf(psd_ctx->xml, "%s<cmmId>%s</cmmId>\n", indent, getkey(f));
+	fprintf(psd_ctx->xml, "%s<version>%08x</version>\n", indent, get4B(f));
+	fprintf(psd_ctx->xml, "%s<deviceClass>\n", indent);
 	findbykey(f, level+1, classdict, getkey(f), 1, 1);
-	fprintf(xml, "%s</deviceClass>\n", indent);
-	fprintf(xml, "%s<colorSpace>\n", indent);
+	fprintf(psd_ctx->xml, "%s</deviceClass>\n", indent);
+	fprintf(psd_ctx->xml, "%s<colorSpace>\n", indent);
 	findbykey(f, level+1, spacedict, getkey(f), 1, 1);
-	fprintf(xml, "%s</colorSpace>\n", indent);
-	fprintf(xml, "%s<pcs>\n", indent);
+	fprintf(psd_ctx->xml, "%s</colorSpace>\n", indent);
+	fprintf(psd_ctx->xml, "%s<pcs>\n", indent);
 	findbykey(f, level+1, spacedict, getkey(f), 1, 1);
-	fprintf(xml, "%s</pcs>\n", indent);
-	fprintf(xml, "%s<date>", indent);
+	fprintf(psd_ctx->xml, "%s</pcs>\n", indent);
+	fprintf(psd_ctx->xml, "%s<date>", indent);
 	icc_datetime(f, level, 0, parent);
-	fputs("</date>\n", xml);
-	fprintf(xml, "%s<magic>%s</magic>\n", indent, getkey(f));
-	fprintf(xml, "%s<platform>\n", indent);
+	fputs("</date>\n", psd_ctx->xml);
+	fprintf(psd_ctx->xml, "%s<magic>%s</magic>\n", indent, getkey(f));
+	fprintf(psd_ctx->xml, "%s<platform>\n", indent);
 	findbykey(f, level+1, platdict, getkey(f), 1, 1);
-	fprintf(xml, "%s</platform>\n", indent);
-	fprintf(xml, "%s<flags>%08x</flags>\n", indent, get4B(f));
-	fprintf(xml, "%s<manufacturer>%s</manufacturer>\n", indent, getkey(f));
-	fprintf(xml, "%s<model>%s</model>\n", indent, getkey(f));
+	fprintf(psd_ctx->xml, "%s</platform>\n", indent);
+	fprintf(psd_ctx->xml, "%s<flags>%08x</flags>\n", indent, get4B(f));
+	fprintf(psd_ctx->xml, "%s<manufacturer>%s</manufacturer>\n", indent, getkey(f));
+	fprintf(psd_ctx->xml, "%s<model>%s</model>\n", indent, getkey(f));
 	hi = get4B(f);
 	lo = get4B(f);
-	fprintf(xml, "%s<attributes>%08x%08x</attributes>\n", indent, hi, lo);
-	fprintf(xml, "%s<renderingIntent>%08x</renderingIntent>\n", indent, get4B(f));
-	fprintf(xml, "%s<illuminant>", indent);
+	fprintf(psd_ctx->xml, "%s<attributes>%08x%08x</attributes>\n", indent, hi, lo);
+	fprintf(psd_ctx->xml, "%s<renderingIntent>%08x</renderingIntent>\n", indent, get4B(f));
+	fprintf(psd_ctx->xml, "%s<illuminant>", indent);
 	icc_xyz(f, level, 12, parent);
-	fputs("</illuminant>\n", xml);
-	fprintf(xml, "%s<creator>%s</creator>\n", indent, getkey(f));
-	fseeko(f, 44, SEEK_CUR); // skip reserved bytes
+	fputs("</illuminant>\n", psd_ctx->xml);
+	fprintf(psd_ctx->xml, "%s<creator>%s</creator>\n", indent, getkey(f));
+	psd_fseeko(f, 44, SEEK_CUR); // skip reserved bytes
 
 	count = get4B(f);
 	while(count--){
-		fread(sig, 1, 4, f);
+		psd_fread(sig, 1, 4, f);
 		offset = get4B(f);
 		tagsize = get4B(f);
-		pos = ftello(f);
-		fseeko(f, iccpos + offset, SEEK_SET);
+		pos = psd_ftello(f);
+		psd_fseeko(f, iccpos + offset, SEEK_SET);
 		findbykey(f, level, tagdict, sig, tagsize, 1);
-		fseeko(f, pos, SEEK_SET);
+		psd_fseeko(f, pos, SEEK_SET);
 	}
 }
@@ -0,0 +1,482 @@
+/*
+    This file is part of "psdparse"
+    Copyright (C) 2004-2012 Toby Thain, toby@telegraphics.com.au
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Inflate backends: decode a complete zlib stream (RFC 1950/1951)
+// from one buffer into another whose size is known up front.
+// "zlib" uses zlib's inflate(); "fast" is a one-shot decoder which
+// needs no window or state between calls, so it can keep a 64 bit
+// bit buffer and decode lengths and distances without refilling.
+// Both accept and reject exactly the same streams.
+
+#include "psdparse.h"
+
+#ifdef HAVE_ZLIB_H
+	#include "zlib.h"
+#endif
+
+#ifdef HAVE_ZLIB_H
+
+static size_t zlib_inflate(unsigned char *src, size_t srclen,
+						   unsigned char *dst, size_t dstlen, size_t *outlen)
+{
+	z_stream stream;
+	int state = Z_OK;
+
+	memset(&stream, 0, sizeof(z_stream));
+	stream.data_type = Z_BINARY;
+
+	stream.next_in = src;
+	stream.avail_in = srclen;
+	stream.next_out = dst;
+	stream.avail_out = dstlen;
+
+	if(inflateInit(&stream) == Z_OK){
+		do
+			state = inflate(&stream, Z_FINISH);
+		while(state == Z_OK && stream.avail_out > 0 && stream.avail_in > 0);
+		inflateEnd(&stream);
+	}
+	if(outlen)
+		*outlen = stream.total_out;
+	return state == Z_STREAM_END ? (size_t)(stream.next_in - src) : 0;
+}
+
+#endif
+
+// Decoding table entries (32 bits):
+//   bits 0-3   number of code bits to drop
+//   bits 4-7   kind of entry
+//   bits 8-15  number of extra bits that follow the code
+//   bits 16-31 literal value, length or distance base, or subtable offset
+
+#define E_BITS(e)  ((e) & 15)
+#define E_KIND(e)  ((e) >> 4 & 15)
+#define E_EXTRA(e) ((e) >> 8 & 255)
+#define E_VALUE(e) ((e) >> 16)
+#define ENTRY(kind, extra, value) ((kind) << 4 | (extra) << 8 | (uint32_t)(value) << 16)
+
+enum{ K_LITERAL, K_BASE, K_END, K_SUBTABLE, K_INVALID };
+
+#define LITBITS  10 // root table size for literal/length codes
+#define DISTBITS 8  // root table size for distance codes
+#define MAXBITS  15 // longest code
+
+// The root table is followed by fixed size subtables for longer codes.
+#define LITSIZE  ((1 << LITBITS)  + 288*(1 << (MAXBITS-LITBITS)))
+#define DISTSIZE ((1 << DISTBITS) + 32*(1 << (MAXBITS-DISTBITS)))
+
+struct inflate_tables{
+	uint32_t lit[LITSIZE], dist[DISTSIZE], lens[1 << 7];
+	uint32_t litsym[288], distsym[32], lensym[19];
+};
+
+static const unsigned short len_base[29] = {
+	3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const unsigned char len_extra[29] = {
+	0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const unsigned short dist_base[30] = {
+	1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,
+	1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const unsigned char dist_extra[30] = {
+	0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+static const unsigned char clen_order[19] = {
+	16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+
+// Build a decoding table for a canonical Huffman code, given the code
+// length of each symbol and the table entry for each symbol.
+// As zlib does, reject over-subscribed codes, and incomplete codes
+// other than a single code of one bit. Returns zero if the code is bad.
+
+static int buildtable(uint32_t *table, int rootbits, const unsigned char *lens,
+					  const uint32_t *sym, int n, int codelens)
+{
+	int count[MAXBITS+1], next[MAXBITS+1], i, len, max, left, code, rev, k, used;
+	int subbits = MAXBITS - rootbits;
+	uint32_t *sub;
+
+	memset(count, 0, sizeof(count));
+	for(i = 0; i < n; ++i)
+		++count[lens[i]];
+
+	for(max = MAXBITS; max && !count[max]; --max)
+		;
+	for(i = 0; i < (1 << rootbits); ++i)
+		table[i] = ENTRY(K_INVALID, 0, 0) | rootbits;
+	if(!max)
+		return !codelens; // no codes at all (allowed for distances)
+
+	for(left = 1, len = 1; len <= MAXBITS; ++len){
+		left = (left << 1) - count[len];
+		if(left < 0)
+			return 0; // over-subscribed
+	}
+	if(left > 0 && (codelens || max != 1))
+		return 0; // incomplete
+
+	for(code = 0, len = 1; len <= MAXBITS; ++len){
+		next[len] = code;
+		code = (code + count[len]) << 1;
+	}
+
+	used = 1 << rootbits;
+	for(i = 0; i < n; ++i)
+		if( (len = lens[i]) ){
+			// codes are packed starting with the most significant bit,
+			// but read from the bit buffer least significant bit first
+			code = next[len]++;
+			for(rev = 0, k = len; k--; code >>= 1)
+				rev = (rev << 1) | (code & 1);
+
+			if(len <= rootbits){
+				for(k = rev; k < (1 << rootbits); k += 1 << len)
+					table[k] = sym[i] | len;
+			}else{
+				k = rev & ((1 << rootbits) - 1);
+				if(E_KIND(table[k]) != K_SUBTABLE){
+					table[k] = ENTRY(K_SUBTABLE, 0, used) | rootbits;
+					for(sub = table + used; sub < table + used + (1 << subbits); ++sub)
+						*sub = ENTRY(K_INVALID, 0, 0) | subbits;
+					used += 1 << subbits;
+				}
+				sub = table + E_VALUE(table[k]);
+				for(k = rev >> rootbits; k < (1 << subbits); k += 1 << (len - rootbits))
+					sub[k] = sym[i] | (len - rootbits);
+			}
+		}
+	return 1;
+}
+
+// Load 8 bytes of input as a little-endian word. Where the compiler
+// tells us the byte order, this is a single (possibly swapped) load;
+// otherwise the word is put together a byte at a time.
+
+static uint64_t load64le(unsigned char *p){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t w;
+
+	memcpy(&w, p, 8);
+	return w;
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	uint64_t w;
+
+	memcpy(&w, p, 8);
+	return __builtin_bswap64(w);
+#else
+	return (uint64_t)p[0]       | (uint64_t)p[1] << 8  | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+		 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+#endif
+}
+
+// Bit buffer. Past the end of input, zero bytes are supplied
+// and counted in 'over', so that truncation can be detected.
+
+#define REFILL() \
+	if(end - in >= 8){ \
+		bitbuf |= load64le(in) << bitcount; \
+		in += (63 - bitcount) >> 3; \
+		bitcount |= 56; \
+	}else{ \
+		while(bitcount < 56){ \
+			if(in < end) \
+				bitbuf |= (uint64_t)*in++ << bitcount; \
+			else \
+				++over; \
+			bitcount += 8; \
+		} \
+	}
+#define BITS(n)  ((unsigned)(bitbuf & ((1u << (n)) - 1)))
+#define DROP(n)  (bitbuf >>= (n), bitcount -= (n))
+
+// Adler-32 of the inflated data, to compare with the stream's trailer.
+
+static uint32_t checksum(unsigned char *p, size_t n){
+#ifdef HAVE_ZLIB_H
+	return adler32(1, p, n);
+#else
+	uint32_t a = 1, b = 0;
+	size_t k;
+
+	while(n){
+		// 5552 is the most bytes that can be summed without overflow
+		k = n < 5552 ? n : 5552;
+		n -= k;
+		while(k--){
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+#endif
+}
+
+// Decode a symbol using a table built by buildtable().
+
+#define DECODE(e, table, rootbits) \
+	e = table[BITS(rootbits)]; \
+	if(E_KIND(e) == K_SUBTABLE){ \
+		DROP(rootbits); \
+		e = table[E_VALUE(e) + BITS(MAXBITS - rootbits)]; \
+	} \
+	DROP(E_BITS(e));
+
+static size_t fast_inflate(unsigned char *src, size_t srclen,
+						   unsigned char *dst, size_t dstlen, size_t *outlen)
+{
+	struct inflate_tables *t;
+	unsigned char *in = src + 2, *end = src + srclen, *out = dst, *outend = dst + dstlen,
+				  lens[288+32], *from;
+	uint64_t bitbuf = 0;
+	unsigned bitcount = 0, over = 0, final, type, nlen, ndist, nclen, i, n, len, dist, v;
+	uint32_t e;
+	size_t consumed = 0;
+
+	*outlen = 0;
+
+	// zlib header: deflate, window no larger than 32K, no preset dictionary
+	if(srclen < 2 || (src[0] & 15) != 8 || (src[0] >> 4) > 7
+	   || ((src[0] << 8) | src[1]) % 31 || (src[1] & 0x20))
+		return 0;
+
+	t = checkmalloc(sizeof(struct inflate_tables));
+	for(i = 0; i < 288; ++i)
+		t->litsym[i] = i < 256 ? ENTRY(K_LITERAL, 0, i)
+							   : (i == 256 ? ENTRY(K_END, 0, 0)
+									: (i < 286 ? ENTRY(K_BASE, len_extra[i-257], len_base[i-257])
+											   : ENTRY(K_INVALID, 0, 0)));
+	for(i = 0; i < 32; ++i)
+		t->distsym[i] = i < 30 ? ENTRY(K_BASE, dist_extra[i], dist_base[i]) : ENTRY(K_INVALID, 0, 0);
+	for(i = 0; i < 19; ++i)
+		t->lensym[i] = ENTRY(K_LITERAL, 0, i);
+
+	do{
+		REFILL();
+		final = BITS(1);
+		type = bitbuf >> 1 & 3;
+		DROP(3);
+
+		if(type == 0){
+			// stored block: realign to a byte boundary, and rewind
+			// the input to the first byte not yet used
+			DROP(bitcount & 7);
+			REFILL();
+			len = BITS(16);
+			if((bitbuf >> 16 & 0xffff) != (~len & 0xffff))
+				goto err;
+			DROP(32);
+			if((bitcount >> 3) < over)
+				goto err;
+			in -= (bitcount >> 3) - over;
+			bitbuf = bitcount = over = 0;
+			if((size_t)(end - in) < len || (size_t)(outend - out) < len)
+				goto err;
+			memcpy(out, in, len);
+			in += len;
+			out += len;
+			continue;
+		}
+		else if(type == 1){
+			// fixed Huffman codes
+			for(i = 0; i < 144; ++i) lens[i] = 8;
+			for(     ; i < 256; ++i) lens[i] = 9;
+			for(     ; i < 280; ++i) lens[i] = 7;
+			for(     ; i < 288; ++i) lens[i] = 8;
+			for(i = 0; i < 32; ++i) lens[288+i] = 5;
+			buildtable(t->lit, LITBITS, lens, t->litsym, 288, 0);
+			buildtable(t->dist, DISTBITS, lens + 288, t->distsym, 32, 0);
+		}
+		else if(type == 2){
+			// dynamic Huffman codes
+			nlen = BITS(5) + 257;
+			ndist = (bitbuf >> 5 & 31) + 1;
+			nclen = (bitbuf >> 10 & 15) + 4;
+			DROP(14);
+			if(nlen > 286 || ndist > 30)
+				goto err;
+
+			memset(lens, 0, 19);
+			for(i = 0; i < nclen; ++i){
+				REFILL();
+				lens[clen_order[i]] = BITS(3);
+				DROP(3);
+			}
+			if(!buildtable(t->lens, 7, lens, t->lensym, 19, 1))
+				goto err;
+
+			for(i = 0; i < nlen + ndist; ){
+				REFILL();
+				DECODE(e, t->lens, 7);
+				if(E_KIND(e) == K_INVALID)
+					goto err;
+				v = E_VALUE(e);
+				if(v < 16)
+					lens[i++] = v;
+				else{
+					if(v == 16){
+						if(!i)
+							goto err;
+						n = 3 + BITS(2);
+						DROP(2);
+						v = lens[i-1];
+					}else if(v == 17){
+						n = 3 + BITS(3);
+						DROP(3);
+						v = 0;
+					}else{
+						n = 11 + BITS(7);
+						DROP(7);
+						v = 0;
+					}
+					if(i + n > nlen + ndist)
+						goto err;
+					while(n--)
+						lens[i++] = v;
+				}
+			}
+			if(!lens[256]) // no end-of-block code
+				goto err;
+			if(!buildtable(t->lit, LITBITS, lens, t->litsym, nlen, 0)
+			   || !buildtable(t->dist, DISTBITS, lens + nlen, t->distsym, ndist, 0))
+				goto err;
+		}
+		else
+			goto err;
+
+		// decode literals and matches until end of block
+		for(;;){
+			REFILL();
+			if(over > 8)
+				goto err; // ran out of input
+			e = t->lit[BITS(LITBITS)];
+			if(E_KIND(e) == K_LITERAL){
+				// a literal in the root table takes at most LITBITS bits,
+				// so several can be decoded for each refill
+				n = 0;
+				do{
+					if(out == outend)
+						goto err;
+					*out++ = E_VALUE(e);
+					DROP(E_BITS(e));
+					e = t->lit[BITS(LITBITS)];
+				}while(E_KIND(e) == K_LITERAL && ++n < 56/LITBITS);
+				continue;
+			}
+			if(E_KIND(e) == K_SUBTABLE){
+				DROP(LITBITS);
+				e = t->lit[E_VALUE(e) + BITS(MAXBITS - LITBITS)];
+			}
+			DROP(E_BITS(e));
+			if(E_KIND(e) == K_LITERAL){
+				if(out == outend)
+					goto err;
+				*out++ = E_VALUE(e);
+			}else if(E_KIND(e) == K_BASE){
+				// enough bits remain for length extra, distance code and extra
+				len = E_VALUE(e) + BITS(E_EXTRA(e));
+				DROP(E_EXTRA(e));
+				DECODE(e, t->dist, DISTBITS);
+				if(E_KIND(e) != K_BASE)
+					goto err;
+				dist = E_VALUE(e) + BITS(E_EXTRA(e));
+				DROP(E_EXTRA(e));
+
+				if(dist > (size_t)(out - dst) || len > (size_t)(outend - out))
+					goto err;
+				from = out - dist;
+				if(dist >= 8 && (size_t)(outend - out) >= len + 8){
+					// copy 8 bytes at a time; may write past the match,
+					// but that will be overwritten
+					for(i = 0; i < len; i += 8)
+						memcpy(out + i, from + i, 8);
+					out += len;
+				}else if(dist == 1){
+					memset(out, *from, len);
+					out += len;
+				}else
+					while(len--)
+						*out++ = *from++;
+			}else if(E_KIND(e) == K_END)
+				break;
+			else
+				goto err;
+		}
+	}while(!final);
+
+	// Adler-32 trailer follows, after realigning to a byte boundary
+	DROP(bitcount & 7);
+	if((bitcount >> 3) < over)
+		goto err;
+	in -= (bitcount >> 3) - over;
+	if(end - in < 4)
+		goto err;
+	if(checksum(dst, out - dst) != ((uint32_t)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3]))
+		goto err;
+	consumed = in + 4 - src;
+
+err:
+	free(t);
+	*outlen = out - dst;
+	return consumed;
+}
+
+static struct psd_inflater{
+	char *name;
+	size_t (*inflate)(unsigned char *src, size_t srclen,
+					  unsigned char *dst, size_t dstlen, size_t *outlen);
+} inflaters[] = {
+	{"fast", fast_inflate}, // default
+#ifdef HAVE_ZLIB_H
+	{"zlib", zlib_inflate},
+#endif
+	{NULL, NULL}
+}, *inflater = inflaters;
+
+// Select inflate backend by name. Returns zero if not recognised.
+
+int psd_setinflater(char *name){
+	struct psd_inflater *p;
+
+	for(p = inflaters; p->name; ++p)
+		if(!strcmp(p->name, name)){
+			inflater = p;
+			return 1;
+		}
+	return 0;
+}
+
+// Non-zero if the selected backend is zlib, which callers may prefer
+// to use incrementally.
+
+int psd_inflater_is_zlib(void){
+	return !strcmp(inflater->name, "zlib");
+}
+
+// Inflate the zlib stream in src into dst, using the selected backend.
+// Returns the number of compressed bytes used if the stream ends cleanly
+// within dstlen bytes of output (*outlen is set to the output size,
+// if outlen is not NULL), otherwise zero.
+
+size_t psd_inflate(unsigned char *src, size_t srclen,
+				   unsigned char *dst, size_t dstlen, size_t *outlen)
+{
+	size_t n;
+
+	return inflater->inflate(src, srclen, dst, dstlen, outlen ? outlen : &n);
+}
@@ -0,0 +1,192 @@
+/*
+    This file is part of "psdparse"
+    Copyright (C) 2004-2012 Toby Thain, toby@telegraphics.com.au
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// The library interface (see libpsdparse.h). A document is parsed with
+// the same pipeline as the command line tool (dopsd(), processdocument()),
+// with the option globals at their defaults, so nothing is written;
+// this leaves every channel ready to be read by readunpackrow().
+// Errors that would end the command line tool (fatal()) instead
+// return to the caller, by way of the context's onfatal hook.
+
+#include <setjmp.h>
+
+#include "libpsdparse.h"
+
+struct psd_document{
+	struct psd_context ctx; // must be first (see recover())
+	jmp_buf recover;
+	psd_file_t f;
+	struct psd_header h;
+	unsigned char *rlebuf;  // scratch for readunpackrow()
+	size_t rlebufsize;
+};
+
+static void recover(struct psd_context *ctx){
+	longjmp(((struct psd_document*)ctx)->recover, 1);
+}
+
+static void freechannels(struct channel_info *chan, int channels){
+	int ch;
+
+	for(ch = 0; ch < channels; ++ch){
+		free(chan[ch].rowpos);
+		if(chan[ch].unzip)
+			psd_unzip_close(chan[ch].unzip);
+	}
+	free(chan);
+}
+
+// Parse the document, as far as knowing where all image data is.
+// Returns zero if it is not a PSD/PSB, or if fatal() was called.
+
+static int parse(struct psd_document *doc, char *path){
+	if(setjmp(doc->recover))
+		return 0;
+	if(!dopsd(&doc->ctx, doc->f, path, &doc->h))
+		return 0;
+	processdocument(&doc->ctx, doc->f, NULL, &doc->h);
+	return 1;
+}
+
+struct psd_document *psd_open(char *path){
+	struct psd_document *doc;
+	struct psd_context *save = psd_ctx;
+
+	if( !(doc = calloc(1, sizeof(struct psd_document))) )
+		return NULL;
+	if( !(doc->f = psd_fopen(path)) ){
+		free(doc);
+		return NULL;
+	}
+
+	psd_context_init(&doc->ctx);
+	doc->ctx.verbose = 0;
+	doc->ctx.quiet = 1;
+	doc->ctx.additional = 1; // for layers' Unicode names
+	doc->ctx.onfatal = recover;
+
+	if(!parse(doc, path)){
+		psd_close(doc);
+		doc = NULL;
+	}
+	psd_ctx = save;
+	return doc;
+}
+
+struct psd_header *psd_document_header(struct psd_document *doc){
+	return &doc->h;
+}
+
+struct layer_info *psd_next_layer(struct psd_document *doc, struct layer_info *li){
+	// skip any layer whose information couldn't be read
+	for(li = li ? li+1 : doc->h.linfo; li && li < doc->h.linfo + doc->h.nlayers; ++li)
+		if(li->chan)
+			return li;
+	return NULL;
+}
+
+struct channel_info *psd_layer_channel(struct layer_info *li, int id){
+	return li->chindex && id >= UMASK_CHAN_ID && id < li->channels && li->chindex[id] != -1
+		   ? li->chan + li->chindex[id] : NULL;
+}
+
+// Called by psd_channel_read_rows(), once it is ready for fatal().
+
+static void readrows(struct psd_document *doc, struct channel_info *chan,
+					 psd_pixels_t first, psd_pixels_t count, unsigned char *buf)
+{
+	psd_pixels_t row;
+	size_t n = rlebufsize(chan);
+
+	if(doc->rlebufsize < n){
+		free(doc->rlebuf);
+		doc->rlebuf = NULL; // in case of fatal()
+		doc->rlebufsize = 0;
+		doc->rlebuf = checkmalloc(n);
+		doc->rlebufsize = n;
+	}
+
+	for(row = first; row < first + count; ++row){
+		readunpackrow(doc->f, chan, row, buf, doc->rlebuf);
+		buf += chan->rowbytes;
+	}
+}
+
+long psd_channel_read_rows(struct psd_document *doc, struct channel_info *chan,
+						   psd_pixels_t first, psd_pixels_t count, unsigned char *buf)
+{
+	struct psd_context *save = psd_ctx;
+
+	if(first >= chan->rows)
+		return 0;
+	if(count > chan->rows - first)
+		count = chan->rows - first;
+
+	psd_ctx = &doc->ctx;
+	doc->ctx.nwarns = 0;
+	if(setjmp(doc->recover)){
+		psd_ctx = save;
+		return -1;
+	}
+	readrows(doc, chan, first, count, buf);
+
+	psd_ctx = save;
+	return count;
+}
+
+long psd_channel_read_window(struct psd_document *doc, struct channel_info *chan,
+							 psd_pixels_t left, psd_pixels_t top,
+							 psd_pixels_t cols, psd_pixels_t rows,
+							 unsigned char *buf, struct channel_info *win)
+{
+	struct channel_info w = *chan;
+	long n = 0;
+
+	if(setwindow(&w, left, top, cols, rows)){
+		n = psd_channel_read_rows(doc, &w, 0, w.rows, buf);
+		chan->unzip = w.unzip; // any inflate state carries on
+	}
+	if(win)
+		*win = w;
+	return n;
+}
+
+void psd_close(struct psd_document *doc){
+	struct layer_info *li;
+	int i;
+
+	for(i = 0; i < doc->h.nlayers; ++i){
+		li = doc->h.linfo + i;
+		if(li->chan)
+			freechannels(li->chan, li->channels);
+		if(li->chindex)
+			free(li->chindex - 3);
+		free(li->name);
+		free(li->nameno);
+		free(li->unicode_name);
+	}
+	free(doc->h.linfo);
+	if(doc->h.merged_chans)
+		freechannels(doc->h.merged_chans, doc->h.channels);
+
+	free(doc->rlebuf);
+	psd_context_free(&doc->ctx);
+	psd_fclose(doc->f);
+	free(doc);
+}
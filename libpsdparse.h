@@ -0,0 +1,97 @@
+/*
+    This file is part of "psdparse"
+    Copyright (C) 2004-2012 Toby Thain, toby@telegraphics.com.au
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _LIBPSDPARSE_H_
+#define _LIBPSDPARSE_H_
+
+// psdparse as a library: open a PSD/PSB, walk its layers, and pull
+// decoded rows from any channel. No files are written, and only
+// warnings about damaged documents are printed (to stderr).
+//
+// Programs using it must be compiled with the same PSBSUPPORT and
+// HAVE_* settings as the library itself, since the layer and channel
+// structs (see psdparse.h) depend on them.
+//
+// A document should only be used by one thread at a time, but separate
+// documents may be used by different threads at once.
+//
+// example.c shows typical use:
+//
+//     struct psd_document *doc = psd_open(path);
+//     struct layer_info *li = NULL;
+//     while( (li = psd_next_layer(doc, li)) )
+//         for(ch = 0; ch < li->channels; ++ch)
+//             psd_channel_read_rows(doc, li->chan + ch, 0, li->chan[ch].rows, buf);
+//     psd_close(doc);
+
+#include "psdparse.h"
+
+struct psd_document;
+
+// Open and parse a document: the header, layer information, and
+// the positions of all channel data (including the merged image).
+// Returns NULL if the file can't be opened or isn't a PSD/PSB,
+// or if it is too damaged to parse.
+struct psd_document *psd_open(char *path);
+
+// The document's header. Besides the fields from the file (rows, cols,
+// channels, depth, mode), nlayers and linfo[] describe the layers, and
+// merged_chans[] (h->channels of them) the merged composite image.
+struct psd_header *psd_document_header(struct psd_document *doc);
+
+// Step through the layers, bottom to top: pass NULL for the first,
+// then the previous layer. Returns NULL after the last.
+// Layers whose information is unreadable are skipped.
+// Of struct layer_info, the most useful members are
+//   top, left, bottom, right - layer bounds (may lie outside the document)
+//   channels, chan[]         - the layer's channels
+//   name, unicode_name       - layer name (unicode_name is UTF-8, or NULL)
+//   blend, mask              - blending and layer mask information
+struct layer_info *psd_next_layer(struct psd_document *doc, struct layer_info *li);
+
+// Look up a layer's channel by id: 0.. for colour channels,
+// TRANS_CHAN_ID for transparency, LMASK_CHAN_ID/UMASK_CHAN_ID for masks.
+// Returns NULL if the layer has no such channel.
+struct channel_info *psd_layer_channel(struct layer_info *li, int id);
+
+// Decode 'count' rows of a channel, starting at row 'first', into buf
+// (count*chan->rowbytes bytes; samples are big-endian at 16 and 32 bits).
+// Rows past the end of the channel are not read. Returns the number
+// of rows decoded, or -1 if the document turned out to be too damaged.
+// Any row may be read at any time, but ZIP compressed channels
+// are quickest to read in order, from first row to last.
+long psd_channel_read_rows(struct psd_document *doc, struct channel_info *chan,
+						   psd_pixels_t first, psd_pixels_t count, unsigned char *buf);
+
+// Decode a window of a channel: 'rows' rows of 'cols' pixels, from column
+// 'left' of row 'top', into buf (rows*rowbytes, where rowbytes is
+// (cols*depth + 7)/8), clipped to the channel's bounds. Only rows in the
+// window are read, and RLE data is decoded only as far as its right edge.
+// Bitmap (1 bit) windows are widened to whole bytes. If 'win' is not
+// NULL, it receives the window actually read (its rows, cols, rowbytes).
+// Returns the number of rows decoded, or -1 as above.
+long psd_channel_read_window(struct psd_document *doc, struct channel_info *chan,
+							 psd_pixels_t left, psd_pixels_t top,
+							 psd_pixels_t cols, psd_pixels_t rows,
+							 unsigned char *buf, struct channel_info *win);
+
+// Release everything belonging to the document, and close its file.
+void psd_close(struct psd_document *doc);
+
+#endif
@@ -29,24 +29,9 @@
 	#include "zlib.h"
 #endif
 
-extern int nwarns;
-extern char indir[];
-
-char *pngdir = indir;
-int verbose = DEFAULT_VERBOSE, quiet = 0, rsrc = 0, print_rsrc = 0, resdump = 0, extra = 0,
-	scavenge = 0, scavenge_psb = 0, scavenge_depth = 8, scavenge_mode = -1,
-	scavenge_rows = 0, scavenge_cols = 0, scavenge_chan = 3, scavenge_rle = 0,
-	makedirs = 0, numbered = 0, help = 0, split = 0, xmlout = 0,
-	unicode_filenames = 0, rebuild = 0, rebuild_v1 = 0, merged_only = 0;
-uint32_t hres, vres; // we don't use these, but they're set within doresources()
-
-#ifdef ALWAYS_WRITE_PNG
-	// for the Windows console app, we want to be able to drag and drop a PSD
-	// giving us no way to specify a destination directory, so use a default
-	int writepng = 1, writelist = 1, writexml = 1;
-#else
-	int writepng = 0, writelist = 0, writexml = 0;
-#endif
+extern int scavenge, scavenge_psb, scavenge_depth, scavenge_mode,
+	scavenge_rows, scavenge_cols, scavenge_chan, scavenge_rle,
+	batch_workers, memlimit, inventory_fmt;
 
 void usage(char *prog, int status){
 	fprintf(stderr, "usage: %s [options] psdfile...\n\
@@ -68,8 +53,28 @@ void usage(char *prog, int status){
       --xmlout       direct XML to standard output (implies --xml and --quiet)\n\
   -s, --split        write each composite channel to individual (grey scale) PNG\n\
       --mergedonly   process merged composite image only (if available)\n\
-      --rebuild      write a new PSD/PSB with extracted image layers only\n\
-        --rebuildpsd    try to rebuild in PSD (v1) format, never PSB (v2)\n"
+      --crop x,y,w,h write only this window of the merged image, reading\n\
+                     no more of it than needed (implies --mergedonly)\n\
+      --preview N    write images at 1/N size (e.g. 2, 4 or 8), decoding only\n\
+                     every Nth row (implies --writepng)\n\
+      --thumbnail    only write the JPEG thumbnail kept in the image resources\n\
+      --jobs N       write layer images using N parallel threads\n\
+      --pngprofile P PNG compression: fastest, balanced, smallest (default)\n\
+      --inflate B    ZIP decoder: fast (default), zlib\n\
+      --batch N      process files on N worker processes, reading the list\n\
+                     of files from stdin if none are given; with --memlimit,\n\
+                     the limit is shared between the workers\n\
+      --inventory F  print one line per file (F: csv or json) of header facts\n\
+                     and layer count only, reading names from stdin if none\n\
+                     are given; --jobs N reads N files at once\n\
+      --rebuild      write a new PSD/PSB with extracted image layers and\n\
+                     image resources only\n\
+        --rebuildpsd    try to rebuild in PSD (v1) format, never PSB (v2)\n\
+        --rebuildzip    also try ZIP and ZIP with prediction for layer channels,\n\
+                        keeping the smallest of each; --jobs N runs the trials\n\
+                        in parallel\n\
+        --droprsrc N,.. leave these image resource IDs out of the rebuilt\n\
+                        file (e.g. 1036 for the thumbnail)\n"
 #ifdef CAN_MMAP
 "      --scavenge     ignore file header, search entire file for image layers\n\
          --psb           for scavenge, assume PSB (default PSD)\n\
@@ -90,6 +95,122 @@ void usage(char *prog, int status){
 	exit(status);
 }
 
+// Process one PSD file, according to the options.
+// Returns zero if the file couldn't be opened.
+
+static int dofile(char *name){
+	psd_file_t f;
+	int j;
+	struct psd_header h;
+	char *base;
+	char temp_str[PATH_MAX];
+	struct psd_context ctx;
+
+	if( (f = psd_fopen(name)) ){
+		psd_context_init(&ctx);
+
+		if(!quiet && !xmlout)
+			printf("Processing \"%s\"\n", name);
+
+		base = strrchr(name, DIRSEP);
+
+		h.version = h.nlayers = 0;
+		h.layerdatapos = 0;
+		h.colormodepos = h.resourcepos = 0; // not known when scavenging
+
+#ifdef CAN_MMAP
+		// scavenging routines need the memory mapped file
+		if((scavenge || scavenge_psb || scavenge_rle) && !f->addr)
+			alwayswarn("# \"%s\": could not memory map file, can't scavenge\n", name);
+
+		if((scavenge || scavenge_psb) && f->addr)
+		{
+			h.version = 1 + scavenge_psb;
+			h.channels = scavenge_chan;
+			h.rows = scavenge_rows;
+			h.cols = scavenge_cols;
+			h.depth = scavenge_depth;
+			h.mode = scavenge_mode;
+			scavenge_psd(f->addr, f->size, &h);
+
+			openfiles(&ctx, name, &h);
+
+			if(ctx.xml){
+				fputs("<PSD FILE='", ctx.xml);
+				fputsxml(name, ctx.xml);
+				fputs("'>\n", ctx.xml);
+			}
+
+			for(j = 0; j < h.nlayers; ++j){
+				psd_fseeko(f, h.linfo[j].filepos, SEEK_SET);
+				readlayerinfo(f, &h, j);
+			}
+
+			h.layerdatapos = psd_ftello(f);
+
+			// Layer content starts immediately after the last layer's 'metadata'.
+			// If we did not correctly locate the *last* layer, we are not going to
+			// succeed in extracting data for any layer.
+			processlayers(&ctx, f, &h);
+
+			// if no layers found, try to locate merged data
+			if(!h.nlayers && h.rows && h.cols && h.lmistart){
+				// position file after 'layer & mask info'
+				psd_fseeko(f, h.lmistart + h.lmilen, SEEK_SET);
+				// process merged (composite) image data
+				doimage(&ctx, f, NULL, base ? base+1 : name, &h);
+			}
+		}
+		else
+#endif
+
+		if(thumbnail)
+			writethumbnail(&ctx, f, name, base ? base+1 : name);
+		else if(dopsd(&ctx, f, name, &h))
+			processdocument(&ctx, f, base ? base+1 : name, &h);
+
+#ifdef CAN_MMAP
+		if(scavenge_rle && h.nlayers && f->addr){
+			scan_channels(f->addr, f->size, &h);
+
+			// process scavenged layer channel data
+			for(j = 0; j < h.nlayers; ++j)
+				if(h.linfo[j].chpos){
+					UNQUIET("layer %d: using scavenged pos @ %lu\n", j, (unsigned long)h.linfo[j].chpos);
+
+					strcpy(temp_str, numbered ? h.linfo[j].nameno : h.linfo[j].name);
+					strcat(temp_str, ".scavenged");
+					psd_fseeko(f, h.linfo[j].chpos, SEEK_SET);
+					doimage(&ctx, f, &h.linfo[j], temp_str, &h);
+				}
+		}
+#endif
+
+		writequeued(&ctx);
+
+		if(ctx.listfile){
+			fputs("}\n", ctx.listfile);
+			fclose(ctx.listfile);
+		}
+		if(ctx.xml){
+			fputs("</PSD>\n", ctx.xml);
+			fclose(ctx.xml);
+		}
+		UNQUIET("  done.\n\n");
+
+		if(ctx.rebuilt_psd)
+			rebuild_psd(&ctx, f, rebuild_v1 ? 1 : h.version, &h);
+		if(ctx.rebuilt_psd)
+			fclose(ctx.rebuilt_psd);
+
+		psd_context_free(&ctx);
+		psd_fclose(f);
+		return 1;
+	}
+	alwayswarn("# \"%s\": couldn't open\n", name);
+	return 0;
+}
+
 int main(int argc, char *argv[]){
 	static struct option longopts[] = {
 		{"help",       no_argument, &help, 1},
@@ -110,7 +231,17 @@ int main(int argc, char *argv[]){
 		{"split",      no_argument, &split, 1},
 		{"rebuild",    no_argument, &rebuild, 1},
 		{"rebuildpsd", no_argument, &rebuild_v1, 1},
+		{"rebuildzip", no_argument, &rebuild_zip, 1},
+		{"droprsrc",   required_argument, NULL, 'G'},
 		{"mergedonly", no_argument, &merged_only, 1},
+		{"crop",       required_argument, NULL, 'W'},
+		{"preview",    required_argument, NULL, 'S'},
+		{"thumbnail",  no_argument, &thumbnail, 1},
+		{"jobs",       required_argument, NULL, 'J'},
+		{"pngprofile", required_argument, NULL, 'P'},
+		{"inflate",    required_argument, NULL, 'I'},
+		{"batch",      required_argument, NULL, 'B'},
+		{"inventory",  required_argument, NULL, 'L'},
 		// special purpose options
 		{"memlimit",   required_argument, NULL, 'X'},
 		{"cpulimit",   required_argument, NULL, 'Y'},
@@ -126,18 +257,16 @@ int main(int argc, char *argv[]){
 #endif
 		{NULL,0,NULL,0}
 	};
-	FILE *f;
-	int i, j, indexptr, opt, fd, map_flag;
-	struct psd_header h;
-	psd_bytes_t k;
-	char *base;
-	void *addr = NULL;
-	char temp_str[PATH_MAX];
+	int i, n, indexptr, opt;
+	char **names;
 #ifdef HAVE_SETRLIMIT
 	struct rlimit rlp;
 #endif
-#ifdef CAN_MMAP
-	struct stat sb;
+
+#ifdef ALWAYS_WRITE_PNG
+	// for the Windows console app, we want to be able to drag and drop a PSD
+	// giving us no way to specify a destination directory, so use a default
+	writepng = writelist = writexml = 1;
 #endif
 
 	while( (opt = getopt_long(argc, argv, "hVvqrewnd:mlxs", longopts, &indexptr)) != -1 )
@@ -164,6 +293,43 @@ int main(int argc, char *argv[]){
 		case 'l': writelist = 1; break;
 		case 'x': writexml = 1; break;
 		case 's': split = 1; break;
+		case 'J': jobs = atoi(optarg); break;
+		case 'W':
+			if(sscanf(optarg, "%u,%u,%u,%u", &crop_left, &crop_top, &crop_cols, &crop_rows) != 4
+			   || !crop_cols || !crop_rows)
+				usage(argv[0], EXIT_FAILURE);
+			crop = merged_only = 1;
+			break;
+		case 'S':
+			if((preview = atoi(optarg)) < 2)
+				usage(argv[0], EXIT_FAILURE);
+			writepng = 1;
+			break;
+		case 'P':
+			if(!pngsetprofile(optarg))
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'I':
+			if(!psd_setinflater(optarg))
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'B':
+			if((batch_workers = atoi(optarg)) < 1)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'L':
+			if(!strcmp(optarg, "csv"))
+				inventory_fmt = 1;
+			else if(!strcmp(optarg, "json"))
+				inventory_fmt = 2;
+			else
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'G':
+			if(!*optarg || strspn(optarg, "0123456789,") != strlen(optarg))
+				usage(argv[0], EXIT_FAILURE);
+			drop_rsrc = optarg;
+			break;
 		case 'D': scavenge_depth = atoi(optarg); break;
 		case 'M': scavenge_mode  = atoi(optarg); break;
 		case 'R': scavenge_rows  = atoi(optarg); break;
@@ -173,9 +339,7 @@ int main(int argc, char *argv[]){
 		// Note that these are generally not enforced on OS X!
 		// see: http://lists.apple.com/archives/unix-porting/2005/Jun/msg00115.html
 		case 'X': // set limit on size of memory (megabytes)
-			rlp.rlim_cur = rlp.rlim_max = atoi(optarg) << 20;
-			if(setrlimit(RLIMIT_AS, &rlp) != 0)
-				fatal("# failed to set memory limit\n");
+			memlimit = atoi(optarg);
 			break;
 		case 'Y': // set limit on cpu (seconds)
 			rlp.rlim_cur = rlp.rlim_max = atoi(optarg);
@@ -186,151 +350,56 @@ int main(int argc, char *argv[]){
 		default:  usage(argv[0], EXIT_FAILURE);
 		}
 
-	if(optind >= argc)
+	if(optind >= argc && !batch_workers && !inventory_fmt)
 		usage(argv[0], EXIT_FAILURE);
 	else if(help)
 		usage(argv[0], EXIT_SUCCESS);
 
-	for(i = optind; i < argc; ++i){
-		if( (f = fopen(argv[i], "rb")) ){
-			nwarns = 0;
-
-			if(!quiet && !xmlout)
-				printf("Processing \"%s\"\n", argv[i]);
-
-			base = strrchr(argv[i], DIRSEP);
-
-			h.version = h.nlayers = 0;
-			h.layerdatapos = 0;
-
-#ifdef CAN_MMAP
-			// need to memory map the file, for scavenging routines?
-			fd = fileno(f);
-			map_flag = (scavenge || scavenge_psb || scavenge_rle)
-					   && fstat(fd, &sb) == 0
-					   && (sb.st_mode & S_IFMT) == S_IFREG;
-			if(map_flag && !(addr = map_file(fd, sb.st_size)))
-				fprintf(stderr, "mmap() failed: %d\n", errno);
-
-			if((scavenge || scavenge_psb) && addr)
-			{
-				h.version = 1 + scavenge_psb;
-				h.channels = scavenge_chan;
-				h.rows = scavenge_rows;
-				h.cols = scavenge_cols;
-				h.depth = scavenge_depth;
-				h.mode = scavenge_mode;
-				scavenge_psd(addr, sb.st_size, &h);
-
-				openfiles(argv[i], &h);
-
-				if(xml){
-					fputs("<PSD FILE='", xml);
-					fputsxml(argv[i], xml);
-					fputs("'>\n", xml);
-				}
-
-				for(j = 0; j < h.nlayers; ++j){
-					fseeko(f, h.linfo[j].filepos, SEEK_SET);
-					readlayerinfo(f, &h, j);
-				}
-
-				h.layerdatapos = ftello(f);
-
-				// Layer content starts immediately after the last layer's 'metadata'.
-				// If we did not correctly locate the *last* layer, we are not going to
-				// succeed in extracting data for any layer.
-				processlayers(f, &h);
-
-				// if no layers found, try to locate merged data
-				if(!h.nlayers && h.rows && h.cols && h.lmistart){
-					// position file after 'layer & mask info'
-					fseeko(f, h.lmistart + h.lmilen, SEEK_SET);
-					// process merged (composite) image data
-					doimage(f, NULL, base ? base+1 : argv[i], &h);
-				}
-			}
-			else
+	if(rebuild_zip){
+#ifdef HAVE_ZLIB_H
+		rebuild = 1;
+#else
+		fputs("--rebuildzip needs zlib, which this build lacks\n", stderr);
+		usage(argv[0], EXIT_FAILURE);
 #endif
+	}
 
-			if(dopsd(f, argv[i], &h)){
-				psd_bytes_t n;
-
-				VERBOSE("## layer image data begins @ " LL_L("%lld","%ld") "\n", h.layerdatapos);
-
-				// process the layers in 'image data' section,
-				// creating PNG/raw files if requested
-
-				processlayers(f, &h);
-
-				// skip 1 byte of padding if we are not at an even position
-				if(ftello(f) & 1)
-					fgetc(f);
-
-				n = globallayermaskinfo(f, &h);
-
-				// global 'additional info' (not really documented)
-				// this is found immediately after the 'image data' section
-
-				k = h.lmistart + h.lmilen - ftello(f);
-				if((extra || h.depth > 8) && ftello(f) < (h.lmistart + h.lmilen)){
-					VERBOSE("## global additional info @ %ld (%ld bytes)\n",
-							(long)ftello(f), (long)k);
-
-					if(xml)
-						fputs("\t<GLOBALINFO>\n", xml);
-					
-					doadditional(f, &h, 2, k); // write description to XML
-
-					if(xml)
-						fputs("\t</GLOBALINFO>\n", xml);
-				}
-
-				// position file after 'layer & mask info'
-				fseeko(f, h.lmistart + h.lmilen, SEEK_SET);
-				// process merged (composite) image data
-				doimage(f, NULL, base ? base+1 : argv[i], &h);
-			}
+	if((crop || preview || thumbnail) && (rebuild || rebuild_v1)){
+		fputs("--crop, --preview and --thumbnail can't be used with --rebuild\n", stderr);
+		usage(argv[0], EXIT_FAILURE);
+	}
 
-#ifdef CAN_MMAP
-			if(scavenge_rle && h.nlayers && addr){
-				scan_channels(addr, sb.st_size, &h);
-
-				// process scavenged layer channel data
-				for(j = 0; j < h.nlayers; ++j)
-					if(h.linfo[j].chpos){
-						UNQUIET("layer %d: using scavenged pos @ %lu\n", j, (unsigned long)h.linfo[j].chpos);
-
-						strcpy(temp_str, numbered ? h.linfo[j].nameno : h.linfo[j].name);
-						strcat(temp_str, ".scavenged");
-						fseeko(f, h.linfo[j].chpos, SEEK_SET);
-						doimage(f, &h.linfo[j], temp_str, &h);
-					}
-			}
+	if(xmlout){
+		// nothing but the XML may go to standard output
+		quiet = writexml = 1;
+		verbose = 0;
+	}
 
-			if(map_flag)
-				unmap_file(addr, sb.st_size); // needed for Windows cleanup, even if mmap() failed
+#ifdef HAVE_SETRLIMIT
+	if(memlimit){
+		// in batch mode, each worker process inherits an equal share
+		rlp.rlim_cur = rlp.rlim_max = (rlim_t)memlimit << 20;
+		if(batch_workers)
+			rlp.rlim_cur = rlp.rlim_max /= batch_workers;
+		if(setrlimit(RLIMIT_AS, &rlp) != 0)
+			fatal("# failed to set memory limit\n");
+	}
 #endif
 
-			if(listfile){
-				fputs("}\n", listfile);
-				fclose(listfile);
-			}
-			if(xml){
-				fputs("</PSD>\n", xml);
-				fclose(xml);
-			}
-			UNQUIET("  done.\n\n");
-
-			if(rebuild || rebuild_v1)
-				rebuild_psd(f, rebuild_v1 ? 1 : h.version, &h);
-
-#ifdef HAVE_ICONV_H
-			if(ic != (iconv_t)-1) iconv_close(ic);
-#endif
-			fclose(f);
+	if(batch_workers || inventory_fmt){
+		// take file names from the command line, or else from stdin
+		if(optind < argc){
+			names = argv + optind;
+			n = argc - optind;
 		}else
-			alwayswarn("# \"%s\": couldn't open\n", argv[i]);
+			n = readmanifest(stdin, &names);
+		if(inventory_fmt)
+			return inventory(jobs, names, n, inventory_fmt == 2) ? EXIT_FAILURE : EXIT_SUCCESS;
+		return batch(batch_workers, names, n, dofile) ? EXIT_FAILURE : EXIT_SUCCESS;
 	}
+
+	for(i = optind; i < argc; ++i)
+		dofile(argv[i]);
+
 	return EXIT_SUCCESS;
 }
@@ -22,16 +22,22 @@
 
 #include "psdparse.h"
 
-static HANDLE fmh = NULL;
+// The view keeps the mapping object alive, so its handle can be closed
+// straight away (and several files can be mapped at once).
 
 void *map_file(int fd, size_t len)
 {
-	fmh = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
-	return fmh ? MapViewOfFile(fmh, FILE_MAP_READ, 0, 0, 0) : NULL;
+	HANDLE fmh;
+	void *addr = NULL;
+
+	if( (fmh = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL)) ){
+		addr = MapViewOfFile(fmh, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(fmh);
+	}
+	return addr;
 }
 
 void unmap_file(void *addr, size_t len)
 {
 	if(addr) UnmapViewOfFile(addr);
-	if(fmh) CloseHandle(fmh);
 }
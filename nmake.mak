@@ -76,15 +76,16 @@ PNGOBJ = $(LIBPNG)\png.obj $(LIBPNG)\pngerror.obj $(LIBPNG)\pngget.obj \
 
 OBJ = main.obj writepng.obj writeraw.obj unpackbits.obj write.obj \
       resources.obj icc.obj extra.obj constants.obj util.obj descriptor.obj \
-      channel.obj psd.obj scavenge.obj pdf.obj psd_zip.obj mmap_win.obj \
-      packbits.obj duotone.obj rebuild.obj \
+      channel.obj psd.obj scavenge.obj pdf.obj psd_zip.obj inflate.obj mmap_win.obj \
+      packbits.obj duotone.obj rebuild.obj parallel.obj batch.obj options.obj \
       getopt.obj getopt1.obj \
       version.res \
       $(ZLIBOBJ) $(PNGOBJ)
 
 PSD2XCF_OBJ = psd2xcf.obj xcf.obj \
 	  unpackbits.obj resources.obj icc.obj extra.obj constants.obj \
-	  util.obj descriptor.obj channel.obj psd.obj pdf.obj psd_zip.obj \
+	  util.obj descriptor.obj channel.obj psd.obj pdf.obj psd_zip.obj inflate.obj \
+	  mmap_win.obj \
       getopt.obj getopt1.obj \
       version.res
 
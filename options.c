@@ -0,0 +1,36 @@
+/*
+    This file is part of "psdparse"
+    Copyright (C) 2004-2012 Toby Thain, toby@telegraphics.com.au
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Settings from the command line, shared by all documents processed.
+// A program embedding psdparse as a library (libpsdparse.c) gets
+// these defaults, which write nothing.
+
+#include "psdparse.h"
+
+char *pngdir = NULL; // default is a directory named after the input file
+char *drop_rsrc = NULL; // resource IDs left out of a rebuilt file (--droprsrc)
+int verbose = DEFAULT_VERBOSE, quiet = 0, rsrc = 0, print_rsrc = 0, resdump = 0, extra = 0,
+	scavenge = 0, scavenge_psb = 0, scavenge_depth = 8, scavenge_mode = -1,
+	scavenge_rows = 0, scavenge_cols = 0, scavenge_chan = 3, scavenge_rle = 0,
+	makedirs = 0, numbered = 0, help = 0, split = 0, xmlout = 0,
+	unicode_filenames = 0, rebuild = 0, rebuild_v1 = 0, rebuild_zip = 0, merged_only = 0, jobs = 1,
+	batch_workers = 0, memlimit = 0, inventory_fmt = 0,
+	writepng = 0, writelist = 0, writexml = 0, crop = 0, preview = 0,
+	thumbnail = 0;
+psd_pixels_t crop_left, crop_top, crop_cols, crop_rows;
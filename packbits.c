@@ -21,6 +21,117 @@
 
 #include "psdparse.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define PACK_SIMD
+	#include <immintrin.h>
+#endif
+
+#ifdef PACK_SIMD
+
+// Scanning primitives for long runs and literals in the encoder:
+// skiprun()  returns the first pointer in [p,end) whose byte is not c,
+//            or end if there is none;
+// findrun()  returns the first pointer in [p,end) that begins three
+//            equal bytes (all before dataend), or end if there is none.
+// The C versions finish off what the vector versions leave.
+
+static unsigned char *skiprun_c(unsigned char *p, unsigned char *end, int c){
+	while(p < end && *p == c)
+		++p;
+	return p;
+}
+
+static unsigned char *findrun_c(unsigned char *p, unsigned char *end, unsigned char *dataend){
+	for(; p < end; ++p)
+		if(p + 2 < dataend && p[1] == p[0] && p[2] == p[0])
+			break;
+	return p;
+}
+
+// Vector versions compare a block of bytes at once (against the run value,
+// or against the same block shifted by one and two bytes), then locate
+// the first hit in the comparison bitmask.
+
+__attribute__((target("sse2")))
+static unsigned char *skiprun_sse2(unsigned char *p, unsigned char *end, int c){
+	__m128i v = _mm_set1_epi8(c);
+	unsigned m;
+
+	for(; end - p >= 16; p += 16)
+		if( (m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)p), v)) & 0xffff) )
+			return p + __builtin_ctz(m);
+	return skiprun_c(p, end, c);
+}
+
+__attribute__((target("sse2")))
+static unsigned char *findrun_sse2(unsigned char *p, unsigned char *end, unsigned char *dataend){
+	__m128i a;
+	unsigned m;
+
+	for(; end - p >= 16 && dataend - p >= 18; p += 16){
+		a = _mm_loadu_si128((__m128i*)p);
+		m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, _mm_loadu_si128((__m128i*)(p+1))),
+											_mm_cmpeq_epi8(a, _mm_loadu_si128((__m128i*)(p+2)))));
+		if(m)
+			return p + __builtin_ctz(m);
+	}
+	return findrun_c(p, end, dataend);
+}
+
+__attribute__((target("avx2")))
+static unsigned char *skiprun_avx2(unsigned char *p, unsigned char *end, int c){
+	__m256i v = _mm256_set1_epi8(c);
+	unsigned m;
+
+	for(; end - p >= 32; p += 32)
+		if( (m = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)p), v))) )
+			return p + __builtin_ctz(m);
+	return skiprun_c(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static unsigned char *findrun_avx2(unsigned char *p, unsigned char *end, unsigned char *dataend){
+	__m256i a;
+	unsigned m;
+
+	for(; end - p >= 32 && dataend - p >= 34; p += 32){
+		a = _mm256_loadu_si256((__m256i*)p);
+		m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, _mm256_loadu_si256((__m256i*)(p+1))),
+												  _mm256_cmpeq_epi8(a, _mm256_loadu_si256((__m256i*)(p+2)))));
+		if(m)
+			return p + __builtin_ctz(m);
+	}
+	return findrun_c(p, end, dataend);
+}
+
+struct packscan{
+	unsigned char *(*skiprun)(unsigned char *p, unsigned char *end, int c);
+	unsigned char *(*findrun)(unsigned char *p, unsigned char *end, unsigned char *dataend);
+};
+
+static const struct packscan scan_sse2 = {skiprun_sse2, findrun_sse2},
+							 scan_avx2 = {skiprun_avx2, findrun_avx2},
+							 *scan = NULL; // none: the byte loops do it all
+
+// Most runs and literals in image data are short, and are found faster
+// byte by byte than by setting up a vector scan; only past this many
+// bytes is the rest of one handed to the scan.
+
+#define SCAN_MIN 64
+
+// Choose the best versions the CPU supports, once at load time
+// (see unpackbits.c).
+
+__attribute__((constructor)) static void pack_select(void){
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		scan = &scan_avx2;
+	else if(__builtin_cpu_supports("sse2"))
+		scan = &scan_sse2;
+}
+
+#endif // PACK_SIMD
+
 // Assuming compressor logic is maximally efficient,
 // worst case input with no duplicate runs of 3 or more bytes
 // will be compressed into a series of verbatim runs no longer
@@ -30,18 +141,30 @@
 
 psd_pixels_t packbits(unsigned char *src, unsigned char *dst, psd_pixels_t n){
 	unsigned char *p, *q, *run, *dataend;
+	psd_pixels_t bytemax = 128;
 	int count, maxrun;
+#ifdef PACK_SIMD
+	const struct packscan *s = scan; // the stores below could alias it
+
+	if(s)
+		bytemax = SCAN_MIN;
+#endif
 
 	dataend = src + n;
 	for( run = src, q = dst; n > 0; run = p, n -= count ){
-		// A run cannot be longer than 128 bytes.
-		maxrun = n < 128 ? n : 128;
+		// A run cannot be longer than 128 bytes; with a vector scan,
+		// the byte loops look at no more than SCAN_MIN of them.
+		maxrun = n < bytemax ? n : bytemax;
 		if(run <= (dataend-3) && run[1] == run[0] && run[2] == run[0]){
 			// 'run' points to at least three duplicated values.
 			// Step forward until run length limit, end of input,
 			// or a non matching byte:
 			for( p = run+3; p < (run+maxrun) && *p == run[0]; )
 				++p;
+#ifdef PACK_SIMD
+			if(p == run+maxrun && maxrun < 128 && p < dataend)
+				p = s->skiprun(p, run + (n < 128 ? n : 128), run[0]);
+#endif
 			count = p - run;
 			// replace this run in output with two bytes:
 			*q++ = 1+256-count; /* flag byte, which encodes count (129..254) */
@@ -55,6 +178,10 @@ psd_pixels_t packbits(unsigned char *src, unsigned char *dst, psd_pixels_t n){
 					break; // 3 bytes repeated end verbatim run
 				else
 					++p;
+#ifdef PACK_SIMD
+			if(p == run+maxrun && maxrun < 128 && p < dataend)
+				p = s->findrun(p, run + (n < 128 ? n : 128), dataend);
+#endif
 			count = p - run;
 			*q++ = count-1;        /* flag byte, which encodes count (0..127) */
 			memcpy(q, run, count); /* followed by the bytes in the run */
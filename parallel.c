@@ -0,0 +1,109 @@
+/*
+    This file is part of "psdparse"
+    Copyright (C) 2004-2012 Toby Thain, toby@telegraphics.com.au
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "psdparse.h"
+
+#ifdef HAVE_PTHREAD_H
+	#include <pthread.h>
+
+struct pfor{
+	void (*fn)(void *arg, long i);
+	void *arg;
+	long n, next;
+	pthread_mutex_t lock;
+	struct psd_context *ctx; // snapshot of the caller's context, or NULL
+};
+
+static void pfor_run(struct pfor *pf){
+	long i;
+
+	for(;;){
+		pthread_mutex_lock(&pf->lock);
+		i = pf->next++;
+		pthread_mutex_unlock(&pf->lock);
+		if(i >= pf->n)
+			break;
+		pf->fn(pf->arg, i);
+	}
+}
+
+// A started thread works in a copy of the caller's context,
+// so that it keeps its own count of warnings.
+
+static void *pfor_thread(void *p){
+	struct pfor *pf = p;
+	struct psd_context ctx;
+
+	if(pf->ctx){
+		ctx = *pf->ctx;
+		ctx.onfatal = NULL; // only the caller's thread can recover
+		psd_ctx = &ctx;
+	}
+	pfor_run(pf);
+	return NULL;
+}
+#endif
+
+// Call fn(arg, i) for each i in 0..n-1, using up to 'threads' threads
+// (including the calling thread). Items are handed out in order, but may
+// complete in any order; returns when all are done.
+// fn() runs with (a copy of) the caller's current context, psd_ctx.
+// Without pthreads, this simply loops.
+
+void parallel_for(int threads, long n, void (*fn)(void *arg, long i), void *arg){
+	long i;
+#ifdef HAVE_PTHREAD_H
+	struct pfor pf;
+	struct psd_context snapshot;
+	pthread_t *tid;
+	int started;
+
+	if(threads > n)
+		threads = n;
+	if(threads > 1){
+		pf.fn = fn;
+		pf.arg = arg;
+		pf.n = n;
+		pf.next = 0;
+		pf.ctx = NULL;
+		if(psd_ctx){
+			snapshot = *psd_ctx;
+			pf.ctx = &snapshot;
+		}
+		pthread_mutex_init(&pf.lock, NULL);
+
+		tid = checkmalloc(sizeof(pthread_t)*(threads-1));
+		for(started = 0; started < threads-1; ++started)
+			if(pthread_create(tid + started, NULL, pfor_thread, &pf)){
+				alwayswarn("# could only start %d threads\n", started+1);
+				break;
+			}
+
+		pfor_run(&pf); // calling thread does its share too
+
+		while(started--)
+			pthread_join(tid[started], NULL);
+		free(tid);
+		pthread_mutex_destroy(&pf.lock);
+		return;
+	}
+#endif
+	for(i = 0; i < n; ++i)
+		fn(arg, i);
+}
@@ -171,8 +171,9 @@ size_t pdf_name(char **p, char *outbuf, size_t n){
 	return cnt;
 }
 
-static char *name_stack[MAX_NAMES];
-static unsigned name_tos, in_array;
+// thread local, so that documents can be parsed concurrently
+static THREAD_LOCAL char *name_stack[MAX_NAMES];
+static THREAD_LOCAL unsigned name_tos, in_array;
 
 void push_name(char *tag){
 	if(name_tos == MAX_NAMES)
@@ -213,7 +214,7 @@ void stringxml(char *strbuf, size_t cnt){
 		size_t inb, outb;
 		char *inbuf, *outbuf, *utf8;
 
-		iconv(ic, NULL, &inb, NULL, &outb); // reset iconv state
+		iconv(psd_ctx->ic, NULL, &inb, NULL, &outb); // reset iconv state
 
 		outb = 6*(cnt/2); // sloppy overestimate of buffer (FIXME)
 		if( (utf8 = checkmalloc(outb)) ){
@@ -221,9 +222,9 @@ void stringxml(char *strbuf, size_t cnt){
 			inbuf = strbuf + 2;
 			inb = cnt - 2;
 			outbuf = utf8;
-			if(ic != (iconv_t)-1){
-				if(iconv(ic, &inbuf, &inb, &outbuf, &outb) != (size_t)-1)
-					fwritexml(utf8, outbuf-utf8, xml);
+			if(psd_ctx->ic != (iconv_t)-1){
+				if(iconv(psd_ctx->ic, &inbuf, &inb, &outbuf, &outb) != (size_t)-1)
+					fwritexml(utf8, outbuf-utf8, psd_ctx->xml);
 				else
 					alwayswarn("stringxml(): iconv() failed, errno=%u\n", errno);
 			}
@@ -232,22 +233,22 @@ void stringxml(char *strbuf, size_t cnt){
 #endif
 	}
 	else
-		fputsxml((char*)strbuf, xml); // not UTF; should be PDFDocEncoded
+		fputsxml((char*)strbuf, psd_ctx->xml); // not UTF; should be PDFDocEncoded
 }
 
 void begin_element(const char *indent){
 	if(in_array)
-		fprintf(xml, "%s<e>", indent);
+		fprintf(psd_ctx->xml, "%s<e>", indent);
 	else if(name_tos)
-		fprintf(xml, "%s<%s>", indent, name_stack[name_tos-1]);
+		fprintf(psd_ctx->xml, "%s<%s>", indent, name_stack[name_tos-1]);
 }
 
 void end_element(const char *indent){
 	if(in_array){
-		fprintf(xml, "%s</e>\n", indent);
+		fprintf(psd_ctx->xml, "%s</e>\n", indent);
 	}
 	else if(name_tos){
-		fprintf(xml, "%s</%s>\n", indent, name_stack[name_tos-1]);
+		fprintf(psd_ctx->xml, "%s</%s>\n", indent, name_stack[name_tos-1]);
 		pop_name();
 	}
 }
@@ -299,7 +300,7 @@ static void pdf_data(char *buf, size_t n, int level){
 		case '[':
 				begin_element(tabs(level));
 				if(name_tos){
-					fputc('\n', xml);
+					fputc('\n', psd_ctx->xml);
 					++level;
 				}
 
@@ -395,7 +396,7 @@ static void pdf_data(char *buf, size_t n, int level){
 				// should not be created. (7.3.7)
 				if(in_array || strcmp(q, "null")){
 					begin_element(tabs(level));
-					fputs(q, xml);
+					fputs(q, psd_ctx->xml);
 					end_element("");
 				}
 				*p = c;
@@ -416,7 +417,7 @@ void desc_pdf(psd_file_t f, int level, int printxml, struct dictentry *parent){
 	char *buf = checkmalloc(count);
 
 	if(buf){
-		pdf_data(buf, fread(buf, 1, count, f), level);
+		pdf_data(buf, psd_fread(buf, 1, count, f), level);
 
 		free(buf);
 	}
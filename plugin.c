@@ -99,17 +99,18 @@ void pl_fatal(char *s){
 
 // stubs to keep linker happy.
 
-void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header *h)
+void doimage(struct psd_context *ctx, psd_file_t f, struct layer_info *li, char *name, struct psd_header *h)
 {
 }
 
-FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, 
+FILE* pngsetupwrite(struct psd_context *ctx, psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, 
 					int channels, int color_type, struct layer_info *li, struct psd_header *h)
 {
 	return NULL;
 }
 
 void pngwriteimage(
+		struct psd_context *ctx,
 		FILE *png,
 		psd_file_t psd,
 		struct layer_info *li,
@@ -119,13 +120,14 @@ void pngwriteimage(
 {
 }
 
-FILE* rawsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, 
+FILE* rawsetupwrite(struct psd_context *ctx, psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, 
 					int channels, int color_type, struct layer_info *li, struct psd_header *h)
 {
 	return NULL;
 }
 
 void rawwriteimage(
+		struct psd_context *ctx,
 		FILE *png,
 		psd_file_t psd,
 		struct layer_info *li,
@@ -20,18 +20,17 @@
 #include "psdparse.h"
 
 char dirsep[] = {DIRSEP,0};
-FILE *listfile = NULL, *xml = NULL;
 
 void skipblock(psd_file_t f, char *desc){
 	extern void ir_dump(psd_file_t f, int level, int len, struct dictentry *parent);
 	psd_bytes_t n = get4B(f);
 	if(n){
-		if(verbose > 1){
+		if(psd_ctx->verbose > 1){
 			VERBOSE("%s:\n", desc);
 			ir_dump(f, 0, n, NULL);
 		}
 		else{
-			fseeko(f, n, SEEK_CUR);
+			psd_fseeko(f, n, SEEK_CUR);
 			VERBOSE("  ...skipped %s (" LL_L("%lld","%ld") " bytes)\n", desc, n);
 		}
 	}else
@@ -67,10 +66,10 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 			li->bottom-li->top, li->right-li->left);
 
 	if( li->bottom < li->top || li->right < li->left
-	 || li->channels > 64 ) // sanity check
+	 || li->channels < 0 || li->channels > 64 ) // sanity check
 	{
 		alwayswarn("### something's not right about that, trying to skip layer.\n");
-		fseeko(f, 6*li->channels+12, SEEK_CUR);
+		psd_fseeko(f, 6*li->channels+12, SEEK_CUR);
 		skipblock(f, "layer info: extra data");
 		li->chan = NULL;
 		li->chindex = NULL;
@@ -79,6 +78,7 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 	else
 	{
 		li->chan = checkmalloc(li->channels*sizeof(struct channel_info));
+		memset(li->chan, 0, li->channels*sizeof(struct channel_info));
 		li->chindex = checkmalloc((li->channels+3)*sizeof(int));
 		li->chindex += 3; // so we can index array from [-3] (hackish)
 
@@ -92,7 +92,8 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 			li->chan[j].length = GETPSDBYTES(f);
 			li->chan[j].rawpos = 0;
 			li->chan[j].rowpos = NULL;
-			li->chan[j].unzipdata = NULL;
+			li->chan[j].zippos = 0;
+			li->chan[j].unzip = NULL;
 
 			if(chid >= -3 && chid < li->channels)
 				li->chindex[chid] = j;
@@ -104,7 +105,7 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 			case LMASK_CHAN_ID: chidstr = " (layer mask)"; break;
 			case TRANS_CHAN_ID: chidstr = " (transparency mask)"; break;
 			default:
-				if(h->mode != SCAVENGE_MODE && chid < (int)strlen(channelsuffixes[h->mode]))
+				if(h->mode >= 0 && h->mode < 16 && chid >= 0 && chid < (int)strlen(channelsuffixes[h->mode]))
 					sprintf(chidstr = tmp, " (%c)", channelsuffixes[h->mode][chid]); // it's a mode-ish channel
 				else
 					chidstr = ""; // don't know
@@ -113,17 +114,17 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 					j, li->chan[j].length, chid, chidstr);
 		}
 
-		fread(li->blend.sig, 1, 4, f);
-		fread(li->blend.key, 1, 4, f);
-		li->blend.opacity = fgetc(f);
-		li->blend.clipping = fgetc(f);
-		li->blend.flags = fgetc(f);
-		fgetc(f); // padding
+		psd_fread(li->blend.sig, 1, 4, f);
+		psd_fread(li->blend.key, 1, 4, f);
+		li->blend.opacity = psd_fgetc(f);
+		li->blend.clipping = psd_fgetc(f);
+		li->blend.flags = psd_fgetc(f);
+		psd_fgetc(f); // padding
 
 		// process layer's 'extra data' section
 
 		extralen = get4B(f);
-		extrastart = ftello(f);
+		extrastart = psd_ftello(f);
 		VERBOSE("  (extra data: " LL_L("%lld","%ld") " bytes @ "
 				LL_L("%lld","%ld") ")\n", extralen, extrastart);
 
@@ -136,20 +137,20 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 			li->mask.left = get4B(f);
 			li->mask.bottom = get4B(f);
 			li->mask.right = get4B(f);
-			li->mask.default_colour = fgetc(f);
-			li->mask.flags = fgetc(f);
+			li->mask.default_colour = psd_fgetc(f);
+			li->mask.flags = psd_fgetc(f);
 			skip -= 18;
 			if(li->mask.size >= 36){
 				VERBOSE("  (has user layer mask)\n");
-				li->mask.real_flags = fgetc(f);
-				li->mask.real_default_colour = fgetc(f);
+				li->mask.real_flags = psd_fgetc(f);
+				li->mask.real_default_colour = psd_fgetc(f);
 				li->mask.real_top = get4B(f);
 				li->mask.real_left = get4B(f);
 				li->mask.real_bottom = get4B(f);
 				li->mask.real_right = get4B(f);
 				skip -= 18;
 			}
-			fseeko(f, skip, SEEK_CUR); // skip remainder
+			psd_fseeko(f, skip, SEEK_CUR); // skip remainder
 		}else
 			VERBOSE("  (no layer mask)\n");
 
@@ -158,20 +159,20 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 		// layer name
 		li->nameno = checkmalloc(16);
 		sprintf(li->nameno, "layer%d", i+1);
-		namelen = fgetc(f);
+		namelen = psd_fgetc(f);
 		li->name = checkmalloc(PAD4(namelen+1));
-		fread(li->name, 1, PAD4(namelen+1)-1, f);
+		psd_fread(li->name, 1, PAD4(namelen+1)-1, f);
 		li->name[namelen] = 0;
 		if(namelen)
 			UNQUIET("    name: \"%s\"\n", li->name);
 
 		// process layer's 'additional info'
 
-		li->additionalpos = ftello(f);
+		li->additionalpos = psd_ftello(f);
 		li->additionallen = extrastart + extralen - li->additionalpos;
 
 		// leave file positioned after extra data
-		fseeko(f, extrastart + extralen, SEEK_SET);
+		psd_fseeko(f, extrastart + extralen, SEEK_SET);
 	}
 }
 
@@ -193,6 +194,8 @@ void dolayerinfo(psd_file_t f, struct psd_header *h){
 	//}
 
 	h->linfo = checkmalloc(h->nlayers*sizeof(struct layer_info));
+	// zeroed, so a partly read array can still be freed (psd_close())
+	memset(h->linfo, 0, h->nlayers*sizeof(struct layer_info));
 
 	// load linfo[] array with each layer's info
 
@@ -205,7 +208,7 @@ void dolayermaskinfo(psd_file_t f, struct psd_header *h){
 
 	h->nlayers = 0;
 	h->lmilen = GETPSDBYTES(f);
-	h->lmistart = ftello(f);
+	h->lmistart = psd_ftello(f);
 	if(h->lmilen){
 		// process layer info section
 		layerlen = GETPSDBYTES(f);
@@ -216,34 +219,34 @@ void dolayermaskinfo(psd_file_t f, struct psd_header *h){
 	}else VERBOSE("  (layer & mask info section is empty)\n");
 }
 
-psd_bytes_t globallayermaskinfo(psd_file_t f, struct psd_header *h){
+psd_bytes_t globallayermaskinfo(struct psd_context *ctx, psd_file_t f, struct psd_header *h){
 	psd_bytes_t n;
 	int kind;
 
-	h->global_lmi_pos = ftello(f);
+	h->global_lmi_pos = psd_ftello(f);
 	n = h->global_lmi_len = get4B(f);
 	if(n){
 		VERBOSE("  (global layer mask info section: %u bytes)\n", (unsigned)n);
-		if(xml){
+		if(ctx->xml){
 			if(n >= 13){
-				fputs("\t<GLOBALLAYERMASK>\n", xml);
+				fputs("\t<GLOBALLAYERMASK>\n", ctx->xml);
 				ed_colorspace(f, 2, 0, NULL);
-				fprintf(xml, "\t\t<OPACITY>%d</OPACITY>\n", get2B(f));
-				kind = fgetc(f);
+				fprintf(ctx->xml, "\t\t<OPACITY>%d</OPACITY>\n", get2B(f));
+				kind = psd_fgetc(f);
 				switch(kind){
-				case 0:   fputs("\t\t<COLORSELECTED/>\n", xml); break;
-				case 1:   fputs("\t\t<COLORPROTECTED/>\n", xml); break;
-				case 128: fputs("\t\t<PERLAYER/>\n", xml); break;
-				default:  fprintf(xml, "\t\t<KIND>%d</KIND>\n", kind);
+				case 0:   fputs("\t\t<COLORSELECTED/>\n", ctx->xml); break;
+				case 1:   fputs("\t\t<COLORPROTECTED/>\n", ctx->xml); break;
+				case 128: fputs("\t\t<PERLAYER/>\n", ctx->xml); break;
+				default:  fprintf(ctx->xml, "\t\t<KIND>%d</KIND>\n", kind);
 				}
-				fputs("\t</GLOBALLAYERMASK>\n", xml);
+				fputs("\t</GLOBALLAYERMASK>\n", ctx->xml);
 				n -= 13;
 			}
 			else{
 				alwayswarn("# global layer mask info only %d bytes, expected at least 13\n", n);
 			}
 		}
-		fseeko(f, n, SEEK_CUR);
+		psd_fseeko(f, n, SEEK_CUR);
 	}else VERBOSE("  (global layer mask info section is empty)\n");
 
 	return n;
@@ -255,13 +258,14 @@ psd_bytes_t globallayermaskinfo(psd_file_t f, struct psd_header *h){
  * doimage() to process its image data.
  */
 
-void processlayers(psd_file_t f, struct psd_header *h)
+void processlayers(struct psd_context *ctx, psd_file_t f, struct psd_header *h)
 {
 	int i;
 	psd_bytes_t savepos;
-	extern char *last_layer_name;
 
-	if(listfile) fputs("assetlist = {\n", listfile);
+	psd_ctx = ctx;
+
+	if(ctx->listfile) fputs("assetlist = {\n", ctx->listfile);
 
 	for(i = 0; i < h->nlayers; ++i){
 		struct layer_info *li = &h->linfo[i];
@@ -269,44 +273,89 @@ void processlayers(psd_file_t f, struct psd_header *h)
 
 		VERBOSE("\n  layer %d (\"%s\"):\n", i, li->name);
 
-		if(listfile && cols && rows){
+		if(ctx->listfile && cols && rows){
 			if(numbered)
-				fprintf(listfile, "\t\"%s\" = { pos={%4d,%4d}, size={%4u,%4u} }, -- %s\n",
+				fprintf(ctx->listfile, "\t\"%s\" = { pos={%4d,%4d}, size={%4u,%4u} }, -- %s\n",
 						li->nameno, li->left, li->top, cols, rows, li->name);
 			else
-				fprintf(listfile, "\t\"%s\" = { pos={%4d,%4d}, size={%4u,%4u} },\n",
+				fprintf(ctx->listfile, "\t\"%s\" = { pos={%4d,%4d}, size={%4u,%4u} },\n",
 						li->name, li->left, li->top, cols, rows);
 		}
-		if(xml){
-			fputs("\t<LAYER NAME='", xml);
-			fputsxml(li->name, xml); // FIXME: what encoding is this in? maybe PDF Latin?
-			fprintf(xml, "' TOP='%d' LEFT='%d' BOTTOM='%d' RIGHT='%d' WIDTH='%u' HEIGHT='%u'>\n",
+		if(ctx->xml){
+			fputs("\t<LAYER NAME='", ctx->xml);
+			fputsxml(li->name, ctx->xml); // FIXME: what encoding is this in? maybe PDF Latin?
+			fprintf(ctx->xml, "' TOP='%d' LEFT='%d' BOTTOM='%d' RIGHT='%d' WIDTH='%u' HEIGHT='%u'>\n",
 					li->top, li->left, li->bottom, li->right, cols, rows);
 		}
 
 		layerblendmode(f, 2, 1, &li->blend);
 
-		last_layer_name = NULL;
-		if(extra || unicode_filenames){
+		ctx->last_layer_name = NULL;
+		if(ctx->additional){
 			// Process 'additional data' (non-image layer data,
 			// such as adjustments, effects, type tool).
 
-			savepos = ftello(f);
-			fseeko(f, li->additionalpos, SEEK_SET);
+			savepos = psd_ftello(f);
+			psd_fseeko(f, li->additionalpos, SEEK_SET);
 
 			UNQUIET("Layer %d additional data:\n", i);
 			doadditional(f, h, 2, li->additionallen);
 
-			fseeko(f, savepos, SEEK_SET); // restore file position
+			psd_fseeko(f, savepos, SEEK_SET); // restore file position
 		}
-		li->unicode_name = last_layer_name;
+		li->unicode_name = ctx->last_layer_name;
+
+		doimage(ctx, f, li, unicode_filenames && ctx->last_layer_name ? ctx->last_layer_name : (numbered ? li->nameno : li->name), h);
+
+		if(ctx->xml) fputs("\t</LAYER>\n\n", ctx->xml);
+	}
+
+	VERBOSE("## end of layer image data @ %ld\n", (long)psd_ftello(f));
+}
+
+// After dopsd(), process the rest of the document: the layers' image data,
+// the global layer mask and additional info (which in 16 and 32 bit
+// documents holds the layers), and lastly the merged image.
+// 'name' is used for the merged image's output files.
+
+void processdocument(struct psd_context *ctx, psd_file_t f, char *name, struct psd_header *h)
+{
+	psd_bytes_t k;
 
-		doimage(f, li, unicode_filenames && last_layer_name ? last_layer_name : (numbered ? li->nameno : li->name), h);
+	VERBOSE("## layer image data begins @ " LL_L("%lld","%ld") "\n", h->layerdatapos);
 
-		if(xml) fputs("\t</LAYER>\n\n", xml);
+	// process the layers in 'image data' section,
+	// creating PNG/raw files if requested
+
+	processlayers(ctx, f, h);
+
+	// skip 1 byte of padding if we are not at an even position
+	if(psd_ftello(f) & 1)
+		psd_fgetc(f);
+
+	globallayermaskinfo(ctx, f, h);
+
+	// global 'additional info' (not really documented)
+	// this is found immediately after the 'image data' section
+
+	k = h->lmistart + h->lmilen - psd_ftello(f);
+	if((extra || h->depth > 8) && psd_ftello(f) < (h->lmistart + h->lmilen)){
+		VERBOSE("## global additional info @ %ld (%ld bytes)\n",
+				(long)psd_ftello(f), (long)k);
+
+		if(ctx->xml)
+			fputs("\t<GLOBALINFO>\n", ctx->xml);
+
+		doadditional(f, h, 2, k); // write description to XML
+
+		if(ctx->xml)
+			fputs("\t</GLOBALINFO>\n", ctx->xml);
 	}
 
-	VERBOSE("## end of layer image data @ %ld\n", (long)ftello(f));
+	// position file after 'layer & mask info'
+	psd_fseeko(f, h->lmistart + h->lmilen, SEEK_SET);
+	// process merged (composite) image data
+	doimage(ctx, f, NULL, name, h);
 }
 
 /**
@@ -319,11 +368,14 @@ void processlayers(psd_file_t f, struct psd_header *h)
  * process image data, resulting in further output (to XML).
  */
 
-int dopsd(psd_file_t f, char *psdpath, struct psd_header *h){
+int dopsd(struct psd_context *ctx, psd_file_t f, char *psdpath, struct psd_header *h){
 	int result = 0;
 
+	psd_ctx = ctx;
+	ctx->h = h;
+
 	// file header
-	fread(h->sig, 1, 4, f);
+	psd_fread(h->sig, 1, 4, f);
 	h->version = get2Bu(f);
 	get4B(f); get2B(f); // reserved[6];
 	h->channels = get2Bu(f);
@@ -332,41 +384,41 @@ int dopsd(psd_file_t f, char *psdpath, struct psd_header *h){
 	h->depth = get2Bu(f);
 	h->mode = get2Bu(f);
 
-	if(!feof(f) && KEYMATCH(h->sig, "8BPS")){
+	if(!psd_feof(f) && KEYMATCH(h->sig, "8BPS")){
 		if(h->version == 1
 #ifdef PSBSUPPORT
 		   || h->version == 2
 #endif
 		){
-			openfiles(psdpath, h);
+			openfiles(ctx, psdpath, h);
 
-			if(listfile) fprintf(listfile, "-- PSD file: %s\n", psdpath);
-			if(xml){
-				fputs("<PSD FILE='", xml);
-				fputsxml(psdpath, xml);
-				fprintf(xml, "' VERSION='%u' CHANNELS='%u' ROWS='%u' COLUMNS='%u' DEPTH='%u' MODE='%u'",
+			if(ctx->listfile) fprintf(ctx->listfile, "-- PSD file: %s\n", psdpath);
+			if(ctx->xml){
+				fputs("<PSD FILE='", ctx->xml);
+				fputsxml(psdpath, ctx->xml);
+				fprintf(ctx->xml, "' VERSION='%u' CHANNELS='%u' ROWS='%u' COLUMNS='%u' DEPTH='%u' MODE='%u'",
 						h->version, h->channels, h->rows, h->cols, h->depth, h->mode);
 				if(h->mode >= 0 && h->mode < 16)
-					fprintf(xml, " MODENAME='%s'", mode_names[h->mode]);
-				fputs(">\n", xml);
+					fprintf(ctx->xml, " MODENAME='%s'", mode_names[h->mode]);
+				fputs(">\n", ctx->xml);
 			}
 			UNQUIET("  PS%c (version %u), %u channels, %u rows x %u cols, %u bit %s\n",
 					h->version == 1 ? 'D' : 'B', h->version, h->channels, h->rows, h->cols, h->depth,
 					h->mode >= 0 && h->mode < 16 ? mode_names[h->mode] : "???");
 
 			if(h->channels <= 0 || h->channels > 64 || h->rows <= 0
-			   || h->cols <= 0 || h->depth <= 0 || h->depth > 32 || h->mode < 0)
+			   || h->cols <= 0 || h->depth <= 0 || h->depth > 32 || h->mode < 0 || h->mode > ModeDuotone16)
 			{
 				alwayswarn("### something isn't right about that header, giving up now.\n");
 			}
 			else{
-				h->colormodepos = ftello(f);
+				h->colormodepos = psd_ftello(f);
 				if(h->mode == ModeDuotone)
 					duotone_data(f, 1);
 				else
 					skipblock(f, "color mode data");
 
-				h->resourcepos = ftello(f);
+				h->resourcepos = psd_ftello(f);
 				if(rsrc || resdump)
 					doimageresources(f);
 				else
@@ -374,7 +426,7 @@ int dopsd(psd_file_t f, char *psdpath, struct psd_header *h){
 
 				dolayermaskinfo(f, h);
 
-				h->layerdatapos = ftello(f);
+				h->layerdatapos = psd_ftello(f);
 				VERBOSE("## layer data begins @ " LL_L("%lld","%ld") "\n", h->layerdatapos);
 
 				result = 1;
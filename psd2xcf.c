@@ -36,8 +36,7 @@
 int verbose = 0, quiet = 0, rsrc = 1, print_rsrc = 0, resdump = 0, extra = 0,
 	makedirs = 0, numbered = 0, help = 0, split = 0, xmlout = 0,
 	writepng = 0, writelist = 0, writexml = 0, unicode_filenames = 1,
-	use_merged = 0, merged_only = 0, extra_chan, rebuild = 0;
-long hres, vres; // set by doresources()
+	use_merged = 0, merged_only = 0, extra_chan, rebuild = 0, rebuild_v1 = 0;
 char *pngdir;
 off_t xcf_merged_pos, *xcf_chan_pos; // updated by doimage() if merged image is processed
 
@@ -70,8 +69,9 @@ int main(int argc, char *argv[]){
 		{"merged-only",no_argument, &merged_only, 1},
 		{NULL,0,NULL,0}
 	};
-	FILE *f;
+	psd_file_t f;
 	struct psd_header h;
+	struct psd_context ctx;
 	int arg, i, indexptr, opt;
 	off_t xcf_layers_pos, xcf_channels_pos;
 
@@ -97,11 +97,13 @@ int main(int argc, char *argv[]){
 		usage(argv[0], EXIT_SUCCESS);
 
 	for(arg = optind; arg < argc; ++arg){
-		if( (f = fopen(argv[arg], "rb")) ){
+		if( (f = psd_fopen(argv[arg])) ){
 			h.version = h.nlayers = h.mergedalpha = 0;
 			h.layerdatapos = 0;
 
-			if(dopsd(f, argv[arg], &h)){
+			psd_context_init(&ctx);
+
+			if(dopsd(&ctx, f, argv[arg], &h)){
 				if(h.depth != 8){
 					alwayswarn("# input file must be 8 bits/channel; skipping %s\n", argv[arg]);
 					continue;
@@ -125,7 +127,7 @@ int main(int argc, char *argv[]){
 					// -------------- Image properties --------------
 					xcf_prop_compression(xcf, xcf_compr);
 					// image resolution in pixels per cm
-					xcf_prop_resolution(xcf, FIXEDPT(hres)/2.54, FIXEDPT(vres)/2.54);
+					xcf_prop_resolution(xcf, FIXEDPT(ctx.hres)/2.54, FIXEDPT(ctx.vres)/2.54);
 					if(h.mode == ModeIndexedColor) // copy palette from psd to xcf
 						xcf_prop_colormap(xcf, f, &h);
 					xcf_prop_end(xcf); // end image properties
@@ -168,19 +170,19 @@ int main(int argc, char *argv[]){
 					if(!merged_only){
 						// process the layers in 'image data' section.
 						// this will, in turn, call doimage() for each layer.
-						fseeko(f, h.layerdatapos, SEEK_SET);
-						processlayers(f, &h);
+						psd_fseeko(f, h.layerdatapos, SEEK_SET);
+						processlayers(&ctx, f, &h);
 					}
 
 					// -------------- Merged image --------------
 					if(use_merged || merged_only){
 						// position file after 'layer & mask info', i.e. at the
 						// beginning of the merged image data.
-						fseeko(f, h.lmistart + h.lmilen, SEEK_SET);
+						psd_fseeko(f, h.lmistart + h.lmilen, SEEK_SET);
 
 						// process merged (composite) image data
 						xcf_merged_pos = 0;
-						doimage(f, NULL, NULL, &h);
+						doimage(&ctx, f, NULL, NULL, &h);
 					}
 
 					// -------------- Fixup layer pointers --------------
@@ -229,7 +231,8 @@ int main(int argc, char *argv[]){
 				fprintf(stderr, "Not a PSD or PSB file.\n");
 			}
 
-			fclose(f);
+			psd_context_free(&ctx);
+			psd_fclose(f);
 		}else{
 			fprintf(stderr, "Could not open: %s\n", argv[arg]);
 		}
@@ -243,7 +246,7 @@ int main(int argc, char *argv[]){
  * for the layer, or merged (flattened) image data, whichever is being
  * processed. */
 
-void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header *h)
+void doimage(struct psd_context *ctx, psd_file_t f, struct layer_info *li, char *name, struct psd_header *h)
 {
 	int ch, i;
 	psd_bytes_t image_data_end;
@@ -264,7 +267,7 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 				    (long)li->chan[ch].length);
 		}
 
-		image_data_end = ftello(f);
+		image_data_end = psd_ftello(f);
 
 		// xcf_layer() does alter the input PSD file position!
 		li->xcf_pos = li->right > li->left && li->bottom > li->top
@@ -272,7 +275,7 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 							: 0;
 
 		// caller may be assuming this position
-		fseeko(f, image_data_end, SEEK_SET);
+		psd_fseeko(f, image_data_end, SEEK_SET);
 	}
 	else{
 		// The merged image has the size, mode, depth, and channel count
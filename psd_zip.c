@@ -32,12 +32,27 @@
 	#include "zlib.h"
 #endif
 
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+// amount of data to inflate before undoing prediction on it (rounded to whole rows)
+#define PREDICT_SLAB 65536
+
 psd_status psd_unzip_without_prediction(psd_uchar *src_buf, psd_int src_len, 
 	psd_uchar *dst_buf, psd_int dst_len)
 {
 #ifdef HAVE_ZLIB_H
 	z_stream stream;
 	psd_int state;
+#endif
+
+	// a whole-buffer backend is quickest, if the stream ends cleanly;
+	// if not, let zlib decide how much of the output is usable
+	if(!psd_inflater_is_zlib() && psd_inflate(src_buf, src_len, dst_buf, dst_len, NULL))
+		return 1;
+
+#ifdef HAVE_ZLIB_H
 
 	memset(&stream, 0, sizeof(z_stream));
 	stream.data_type = Z_BINARY;
@@ -66,46 +81,416 @@ psd_status psd_unzip_without_prediction(psd_uchar *src_buf, psd_int src_len,
 	return 0;
 }
 
+// Undo horizontal delta prediction on one row of 8 bit values, in place.
+// The SSE2 version computes a prefix sum 16 bytes at a time: log2 steps
+// of shift-and-add within the vector, plus the total carried from the last.
+
+static void undelta8(psd_uchar *p, psd_int n){
+	psd_int i = 1;
+#ifdef __SSE2__
+	__m128i x, carry = _mm_setzero_si128();
+
+	for(i = 0; i + 16 <= n; i += 16){
+		x = _mm_loadu_si128((__m128i*)(p + i));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+		x = _mm_add_epi8(x, carry);
+		_mm_storeu_si128((__m128i*)(p + i), x);
+		carry = _mm_set1_epi8(p[i + 15]);
+	}
+	if(!i)
+		i = 1;
+#endif
+	for(; i < n; ++i)
+		p[i] += p[i-1];
+}
+
+// As above, for a row of n big-endian 16 bit values.
+// The SSE2 version swaps bytes to add native 16 bit lanes.
+
+static void undelta16(psd_uchar *p, psd_int n){
+	psd_int i = 1;
+	unsigned v;
+#ifdef __SSE2__
+	__m128i x, carry = _mm_setzero_si128();
+
+	for(i = 0; i + 8 <= n; i += 8){
+		x = _mm_loadu_si128((__m128i*)(p + 2*i));
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+		x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+		x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+		x = _mm_add_epi16(x, carry);
+		carry = _mm_set1_epi16(_mm_extract_epi16(x, 7));
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		_mm_storeu_si128((__m128i*)(p + 2*i), x);
+	}
+	if(!i)
+		i = 1;
+#endif
+	for(; i < n; ++i){
+		v = ((p[2*i-2] << 8) | p[2*i-1]) + ((p[2*i] << 8) | p[2*i+1]);
+		p[2*i]   = v >> 8;
+		p[2*i+1] = v;
+	}
+}
+
+// 32 bit (floating point) rows are stored as four planes: the first
+// byte of every value, then all the second bytes, and so on; the delta
+// runs across the whole row of planes. After undoing the delta, put
+// the bytes of each value back together (big-endian, as in raw data).
+// The SSE2 version interleaves 16 values at a time.
+
+static void undelta32(psd_uchar *p, psd_int n, psd_uchar *tmp){
+	psd_uchar *p0 = p, *p1 = p + n, *p2 = p + 2*n, *p3 = p + 3*n, *q = tmp;
+	psd_int i = 0;
+#ifdef __SSE2__
+	__m128i b0, b1, b2, b3, lo, hi;
+#endif
+
+	undelta8(p, 4*n);
+
+#ifdef __SSE2__
+	for(; i + 16 <= n; i += 16, q += 64){
+		b0 = _mm_loadu_si128((__m128i*)(p0 + i));
+		b1 = _mm_loadu_si128((__m128i*)(p1 + i));
+		b2 = _mm_loadu_si128((__m128i*)(p2 + i));
+		b3 = _mm_loadu_si128((__m128i*)(p3 + i));
+		lo = _mm_unpacklo_epi8(b0, b1); // byte pairs 0,1 of values 0-7
+		hi = _mm_unpacklo_epi8(b2, b3); // byte pairs 2,3 of values 0-7
+		_mm_storeu_si128((__m128i*)q,        _mm_unpacklo_epi16(lo, hi));
+		_mm_storeu_si128((__m128i*)(q + 16), _mm_unpackhi_epi16(lo, hi));
+		lo = _mm_unpackhi_epi8(b0, b1); // values 8-15
+		hi = _mm_unpackhi_epi8(b2, b3);
+		_mm_storeu_si128((__m128i*)(q + 32), _mm_unpacklo_epi16(lo, hi));
+		_mm_storeu_si128((__m128i*)(q + 48), _mm_unpackhi_epi16(lo, hi));
+	}
+#endif
+	for(; i < n; ++i){
+		*q++ = p0[i];
+		*q++ = p1[i];
+		*q++ = p2[i];
+		*q++ = p3[i];
+	}
+	memcpy(p, tmp, 4*n);
+}
+
+// Undo prediction on count consecutive rows starting at p.
+
+static void undelta_rows(psd_uchar *p, psd_int count, psd_int rowbytes, psd_int depth, psd_uchar *tmp){
+	for(; count-- > 0; p += rowbytes)
+		if(depth == 32)
+			undelta32(p, rowbytes/4, tmp);
+		else if(depth == 16)
+			undelta16(p, rowbytes/2);
+		else
+			undelta8(p, rowbytes);
+}
+
+// Apply prediction to one row in place, for compression: the reverse of
+// undelta_rows(). Values are replaced by their difference from the one
+// before, working from the end of the row; 32 bit rows are first split
+// into planes (using tmp, rowbytes in size).
+
+void psd_predict_row(psd_uchar *p, psd_int rowbytes, psd_int depth, psd_uchar *tmp){
+	psd_int i, n;
+	unsigned v;
+
+	if(depth == 32){
+		n = rowbytes/4;
+		for(i = 0; i < n; ++i){
+			tmp[i]       = p[4*i];
+			tmp[i + n]   = p[4*i+1];
+			tmp[i + 2*n] = p[4*i+2];
+			tmp[i + 3*n] = p[4*i+3];
+		}
+		memcpy(p, tmp, 4*n);
+		depth = 8;
+	}
+	if(depth == 16){
+		for(i = rowbytes/2 - 1; i > 0; --i){
+			v = ((p[2*i] << 8) | p[2*i+1]) - ((p[2*i-2] << 8) | p[2*i-1]);
+			p[2*i]   = v >> 8;
+			p[2*i+1] = v;
+		}
+	}else{
+		for(i = rowbytes - 1; i > 0; --i)
+			p[i] -= p[i-1];
+	}
+}
+
+// Inflate, undoing prediction as we go: each slab of rows is
+// processed straight after it is inflated, while it is still in cache.
+
 psd_status psd_unzip_with_prediction(psd_uchar *src_buf, psd_int src_len, 
 	psd_uchar *dst_buf, psd_int dst_len, 
 	psd_int row_size, psd_int color_depth)
 {
 #ifdef HAVE_ZLIB_H
-	psd_status status;
-	int len;
-	psd_uchar * buf;
+	z_stream stream;
+	psd_int state, slab, done;
+	psd_uchar *row, *dst_end = dst_buf + dst_len;
+#endif
+	psd_int rowbytes;
+	psd_uchar *tmp = NULL;
+	size_t outlen;
 
-	status = psd_unzip_without_prediction(src_buf, src_len, dst_buf, dst_len);
-	if(!status)
-		return status;
-	
-	buf = dst_buf;
+	rowbytes = row_size*color_depth/8;
+	if(rowbytes <= 0)
+		return 0;
+
+	if(!psd_inflater_is_zlib() && psd_inflate(src_buf, src_len, dst_buf, dst_len, &outlen)){
+		if(color_depth == 32)
+			tmp = checkmalloc(rowbytes);
+		undelta_rows(dst_buf, outlen/rowbytes, rowbytes, color_depth, tmp);
+		free(tmp);
+		return 1;
+	}
+
+#ifdef HAVE_ZLIB_H
+	slab = PREDICT_SLAB < rowbytes ? rowbytes : PREDICT_SLAB - PREDICT_SLAB % rowbytes;
+
+	memset(&stream, 0, sizeof(z_stream));
+	stream.data_type = Z_BINARY;
+
+	stream.next_in = (Bytef *)src_buf;
+	stream.avail_in = src_len;
+	stream.next_out = (Bytef *)dst_buf;
+
+	if(inflateInit(&stream) != Z_OK)
+		return 0;
+
+	if(color_depth == 32)
+		tmp = checkmalloc(rowbytes);
+
+	row = dst_buf;
 	do {
-		len = row_size;
-		if (color_depth == 16)
-		{
-			while(--len)
-			{
-				buf[2] += buf[0] + ((buf[1] + buf[3]) >> 8);
-				buf[3] += buf[1];
-				buf += 2;
-			}
-			buf += 2;
-			dst_len -= row_size * 2;
+		stream.avail_out = dst_end - stream.next_out < slab ? dst_end - stream.next_out : slab;
+		state = inflate(&stream, Z_PARTIAL_FLUSH);
+
+		// undo prediction on the rows now complete
+		done = (stream.next_out - row)/rowbytes;
+		undelta_rows(row, done, rowbytes, color_depth, tmp);
+		row += done*rowbytes;
+	} while(state == Z_OK && stream.next_out < dst_end);
+
+	inflateEnd(&stream);
+	free(tmp);
+
+	return state == Z_STREAM_END || state == Z_OK;
+#endif
+	return 0;
+}
+
+// Streaming inflate of a channel, for readunpackrow().
+// Rows are inflated into a small ring buffer, and prediction is undone
+// on each row as it is produced, so memory use is a few rows regardless
+// of image size. Reading rows in order is cheapest; asking for a row
+// that has already left the ring restarts the stream from the top.
+// Unless zlib is the selected backend, a channel of modest size is
+// instead inflated all at once, which is quicker.
+
+#define UNZIP_RING  65536     // ring buffer size (rounded to whole rows)
+#define UNZIP_CHUNK 65536     // compressed data read at a time, if not mapped
+#define UNZIP_WHOLE (1 << 23) // largest channel to inflate all at once
+
+struct psd_unzip{
+#ifdef HAVE_ZLIB_H
+	z_stream stream;
+#endif
+	psd_file_t f;
+	psd_bytes_t pos, len, fed;  // compressed data extent, and how much was given to zlib
+	unsigned char *mapped, *inbuf;
+	int predict, depth, err;
+	psd_pixels_t rows, rowbytes;
+	psd_pixels_t nrows, next;   // ring size (rows), index of next row to inflate
+	unsigned char *ring, *tmp;
+};
+
+void psd_unzip_close(struct psd_unzip *zs){
+	if(zs){
+#ifdef HAVE_ZLIB_H
+		inflateEnd(&zs->stream);
+#endif
+		free(zs->inbuf);
+		free(zs->ring);
+		free(zs->tmp);
+		free(zs);
+	}
+}
+
+// Inflate the whole channel with the selected backend, making
+// the ring big enough for every row. Returns zero if the data did
+// not inflate cleanly to the expected size, or if memory is short
+// (e.g. under --memlimit), leaving the caller to stream it instead.
+
+static int unzip_whole(struct psd_unzip *zs){
+	size_t size = (size_t)zs->rows*zs->rowbytes, outlen = 0, used;
+	unsigned char *src = zs->mapped;
+
+	if(zs->len < 2)
+		return 0;
+	if(!src){
+		if(!(src = malloc(zs->len)))
+			return 0;
+		if(psd_pread(zs->f, src, zs->len, zs->pos) != zs->len){
+			free(src);
+			return 0;
 		}
-		else
-		{
-			while(--len)
-			{
-				*(buf + 1) += *buf;
-				buf ++;
+	}
+	if(!(zs->ring = malloc(size))){
+		if(!zs->mapped)
+			free(src);
+		return 0;
+	}
+	used = psd_inflate(src, zs->len, zs->ring, size, &outlen);
+	if(!zs->mapped)
+		free(src);
+
+	if(!used || outlen != size){
+		free(zs->ring);
+		zs->ring = NULL;
+		return 0;
+	}
+	zs->nrows = zs->next = zs->rows;
+	if(zs->predict)
+		undelta_rows(zs->ring, zs->rows, zs->rowbytes, zs->depth, zs->tmp);
+	return 1;
+}
+
+// Prepare to inflate the channel whose compressed data occupies
+// len bytes at file offset pos.
+
+struct psd_unzip *psd_unzip_open(psd_file_t f, psd_bytes_t pos, psd_bytes_t len,
+								 int predict, int depth,
+								 psd_pixels_t rows, psd_pixels_t rowbytes)
+{
+	struct psd_unzip *zs = checkmalloc(sizeof(struct psd_unzip));
+
+	memset(zs, 0, sizeof(struct psd_unzip));
+	zs->f = f;
+	zs->pos = pos;
+	zs->len = len;
+	zs->predict = predict;
+	zs->depth = depth;
+	zs->rows = rows;
+	zs->rowbytes = rowbytes;
+
+	if(predict && depth == 32)
+		zs->tmp = checkmalloc(rowbytes);
+	zs->mapped = psd_mapped(f, pos, len);
+
+#ifdef HAVE_ZLIB_H
+	if(!psd_inflater_is_zlib() && (psd_bytes_t)rows*rowbytes <= UNZIP_WHOLE && unzip_whole(zs))
+		return zs;
+
+	zs->nrows = UNZIP_RING/rowbytes;
+	if(zs->nrows < 2)
+		zs->nrows = 2;
+	if(zs->nrows > rows)
+		zs->nrows = rows;
+	zs->ring = checkmalloc(zs->nrows*rowbytes);
+
+	if(!zs->mapped)
+		zs->inbuf = checkmalloc(len < UNZIP_CHUNK ? len : UNZIP_CHUNK);
+
+	if(inflateInit(&zs->stream) != Z_OK){
+		alwayswarn("## inflateInit() failed\n");
+		psd_unzip_close(zs);
+		return NULL;
+	}
+#else
+	// without zlib, the whole-buffer backend is all we have
+	if(!unzip_whole(zs)){
+		alwayswarn("## ZIP data corrupt or short\n");
+		psd_unzip_close(zs);
+		return NULL;
+	}
+#endif
+	return zs;
+}
+
+#ifdef HAVE_ZLIB_H
+
+// Inflate rows from zs->next, as far as the end of the ring buffer.
+
+static void unzip_fill(struct psd_unzip *zs){
+	z_stream *z = &zs->stream;
+	psd_pixels_t slot = zs->next % zs->nrows, count, got;
+	psd_bytes_t n;
+	unsigned char *row;
+	int state = Z_OK;
+
+	count = zs->nrows - slot;
+	if(count > zs->rows - zs->next)
+		count = zs->rows - zs->next;
+
+	z->next_out = row = zs->ring + slot*zs->rowbytes;
+	z->avail_out = count*zs->rowbytes;
+	while(z->avail_out){
+		if(!z->avail_in && zs->fed < zs->len){
+			// feed more compressed data
+			n = zs->len - zs->fed;
+			if(zs->mapped){
+				if(n > (1u << 30))
+					n = 1u << 30;
+				z->next_in = zs->mapped + zs->fed;
+			}else{
+				if(n > UNZIP_CHUNK)
+					n = UNZIP_CHUNK;
+				n = psd_pread(zs->f, zs->inbuf, n, zs->pos + zs->fed);
+				z->next_in = zs->inbuf;
 			}
-			buf ++;
-			dst_len -= row_size;
+			z->avail_in = n;
+			zs->fed += n;
 		}
-	} while(dst_len > 0);
+		state = inflate(z, Z_NO_FLUSH);
+		if(state != Z_OK)
+			break;
+	}
+
+	got = (count*zs->rowbytes - z->avail_out)/zs->rowbytes;
+	if(got < count){
+		alwayswarn("## ZIP data %s after %u of %u rows\n",
+				   state == Z_DATA_ERROR ? "corrupt" : "short", zs->next + got, zs->rows);
+		zs->err = 1;
+	}
+	zs->next += got;
+
+	// undo prediction on the new rows
+	if(zs->predict)
+		undelta_rows(row, got, zs->rowbytes, zs->depth, zs->tmp);
+}
 
-	return 1;
 #endif
-	return 0;
+
+// Copy bytes skip..skip+n-1 of one row of the channel to dst
+// (the whole row, if skip is zero and n is rowbytes).
+// Returns the number of bytes copied: n, or zero if the row
+// couldn't be inflated.
+
+psd_pixels_t psd_unzip_row(struct psd_unzip *zs, psd_pixels_t row,
+						   psd_pixels_t skip, psd_pixels_t n, unsigned char *dst){
+	if(row >= zs->rows)
+		return 0;
+
+#ifdef HAVE_ZLIB_H
+	if(row + zs->nrows < zs->next){
+		// row has left the ring buffer, start again
+		inflateReset(&zs->stream);
+		zs->stream.avail_in = 0;
+		zs->fed = zs->next = 0;
+		zs->err = 0;
+	}
+
+	while(row >= zs->next && !zs->err)
+		unzip_fill(zs);
+#endif
+	if(row >= zs->next)
+		return 0;
+
+	memcpy(dst, zs->ring + (row % zs->nrows)*zs->rowbytes + skip, n);
+	return n;
 }
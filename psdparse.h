@@ -67,10 +67,17 @@
 	#include <unistd.h>
 #endif
 
+// storage class for per-thread state
+#if defined(_MSC_VER)
+	#define THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+	#define THREAD_LOCAL __thread
+#else
+	#define THREAD_LOCAL
+#endif
+
 #ifdef HAVE_ICONV_H
 	#include <iconv.h>
-
-	extern iconv_t ic;
 #endif
 
 #ifdef PSBSUPPORT
@@ -110,12 +117,11 @@ typedef uint16_t psd_ushort;
 
 	typedef FILEREF psd_file_t; // appropriate file handle type for platform
 
-	#define fgetc pl_fgetc
-	#define fread pl_fread
-	#define fseeko pl_fseeko
-	#define ftello pl_ftello
-	#undef feof // it's a macro in Metrowerks stdio
-	#define feof pl_feof
+	#define psd_fgetc pl_fgetc
+	#define psd_fread pl_fread
+	#define psd_fseeko pl_fseeko
+	#define psd_ftello pl_ftello
+	#define psd_feof pl_feof
 
 	int pl_fgetc(psd_file_t f);
 	int pl_feof(psd_file_t f);
@@ -146,7 +152,18 @@ typedef uint16_t psd_ushort;
 		#define MKDIR mkdir
 	#endif
 
-	typedef FILE *psd_file_t;
+	// Input file handle. If the file could be memory-mapped, reads are
+	// served directly from the mapped region; otherwise they fall back
+	// to the stdio stream.
+	struct psd_file{
+		FILE *fp;            // stdio stream, always open
+		unsigned char *addr; // start of mapped file, or NULL if not mapped
+		psd_bytes_t size;    // length of mapped region
+		psd_bytes_t pos;     // read cursor, when mapped
+		int eof;             // a read ran past end of mapped region
+	};
+	typedef struct psd_file *psd_file_t;
+
 	#ifdef _MSC_VER
 		#define fseeko _fseeki64
 		#define ftello _ftelli64
@@ -189,8 +206,8 @@ enum{RAWDATA,RLECOMP,ZIPNOPREDICT,ZIPPREDICT}; // ZIP types from CS doc
 #define PAD4(x) (((x)+3) & -4) // same or next multiple of 4
 #define PAD_BYTE 0
 
-#define VERBOSE if(verbose) printf
-#define UNQUIET if(!quiet) printf
+#define VERBOSE if(psd_ctx->verbose) printf
+#define UNQUIET if(!psd_ctx->quiet) printf
 
 #define FIXEDPT(x) ((x)/65536.)
 
@@ -262,7 +279,21 @@ struct channel_info{
 	// how to find image data, depending on compression type:
 	psd_bytes_t rawpos;       // file offset of RAW channel data (AFTER compression type)
 	psd_bytes_t *rowpos;      // row data file positions (RLE ONLY)
-	unsigned char *unzipdata; // uncompressed data (ZIP ONLY)
+	psd_bytes_t zippos;       // file offset of compressed data (ZIP ONLY)
+	int depth;                // bits per sample, for undoing ZIP prediction
+	struct psd_unzip *unzip;  // inflate state, while being read (ZIP ONLY)
+
+	// Only a window of the image may be wanted (see setwindow()); then
+	// rows, cols and rowbytes describe the window, which starts win_top rows
+	// down and win_skip bytes into each row of the whole channel
+	// (full_rows x full_rowbytes). dochannel() sets the whole channel.
+	psd_pixels_t win_top, win_skip, full_rows, full_rowbytes;
+
+	// A reduced-resolution view (see setscale()): rows, cols and rowbytes
+	// are then 1/scale of the window's src_rows x src_cols (src_rowbytes).
+	// Columns are averaged if box is set, otherwise sampled.
+	int scale, box;
+	psd_pixels_t src_rows, src_cols, src_rowbytes;
 };
 
 struct layer_info{
@@ -308,12 +339,48 @@ extern const int mode_channel_count[];
 extern const int mode_colour_space[];
 
 extern char dirsep[], *pngdir;
+extern char *drop_rsrc; // resource IDs left out of a rebuilt file (--droprsrc)
 extern int verbose, quiet, rsrc, print_rsrc, resdump, extra, makedirs,
-		   numbered, help, split, nwarns, writepng, writelist,
+		   numbered, help, split, writepng, writelist,
 		   writexml, xmlout, unicode_filenames,
-		   rebuild, rebuild_v1, merged_only;
+		   rebuild, rebuild_v1, rebuild_zip, merged_only, jobs;
+extern int crop; // write only a window of the merged image (--crop)
+extern psd_pixels_t crop_left, crop_top, crop_cols, crop_rows;
+extern int preview; // write images at 1/preview of their size (--preview)
+extern int thumbnail; // write only the embedded JPEG thumbnail (--thumbnail)
+
+// Parser state for one document. Nothing about a document being parsed
+// is kept in globals, so several documents may be parsed at once in one
+// process (one thread each), and layer images written concurrently.
+// The pipeline (dopsd(), processlayers(), doimage(), the writers) is
+// passed its context explicitly; it also becomes the calling thread's
+// current context (psd_ctx), which is what the metadata printers
+// (resources, descriptors, etc) and the VERBOSE/UNQUIET macros use.
+
+struct psd_context{
+	int verbose, quiet; // from the options, but may be overridden
+	int split;          // write channels separately (--split, or forced by mode)
+	int additional;     // process layers' additional data (--extra, --unicode)
+	int nwarns;         // warnings given for the current image
+	char indir[PATH_MAX], *pngdir; // output directory
+	FILE *xml, *listfile, *rebuilt_psd;
+	struct psd_header *h;  // document being parsed
+	uint32_t hres, vres;   // resolution (fixed point), from image resources
+	char *last_layer_name; // Unicode name from layer's additional data
+#ifdef HAVE_ICONV_H
+	iconv_t ic;
+#endif
+	struct image_job *queue; // layer images waiting to be written (--jobs)
+	long queued, queuesize;
+	// if set, fatal() calls this instead of exiting the process;
+	// it must not return (the library uses it to longjmp back to its caller)
+	void (*onfatal)(struct psd_context *ctx);
+};
 
-extern FILE *xml, *listfile, *rebuilt_psd;
+extern THREAD_LOCAL struct psd_context *psd_ctx;
+
+void psd_context_init(struct psd_context *ctx);
+void psd_context_free(struct psd_context *ctx);
 
 void fatal(char *s);
 void warn_msg(char *fmt, ...);
@@ -325,6 +392,20 @@ void fputcxml(char c, FILE *f);
 void fputsxml(char *str, FILE *f);
 void fwritexml(char *buf, size_t count, FILE *f);
 
+size_t psd_pread(psd_file_t f, void *buf, size_t n, psd_bytes_t pos);
+#ifndef PSDPARSE_PLUGIN
+psd_file_t psd_fopen(char *path);
+void psd_fclose(psd_file_t f);
+int psd_fgetc(psd_file_t f);
+size_t psd_fread(void *ptr, size_t s, size_t n, psd_file_t f);
+int psd_fseeko(psd_file_t f, off_t pos, int wh);
+off_t psd_ftello(psd_file_t f);
+int psd_feof(psd_file_t f);
+unsigned char *psd_mapped(psd_file_t f, psd_bytes_t pos, psd_bytes_t n);
+#else
+	#define psd_mapped(f, pos, n) NULL
+#endif
+
 char *getpstr(psd_file_t f);
 char *getpstr2(psd_file_t f);
 char *getkey(psd_file_t f);
@@ -334,10 +415,10 @@ int64_t get8B(psd_file_t f);
 int get2B(psd_file_t f);
 unsigned get2Bu(psd_file_t f);
 
-unsigned put4B(psd_file_t f, int32_t);
-unsigned put8B(psd_file_t f, int64_t);
-unsigned putpsdbytes(psd_file_t f, int version, uint64_t value);
-unsigned put2B(psd_file_t f, int);
+unsigned put4B(FILE *f, int32_t);
+unsigned put8B(FILE *f, int64_t);
+unsigned putpsdbytes(FILE *f, int version, uint64_t value);
+unsigned put2B(FILE *f, int);
 
 int32_t peek4B(unsigned char *p);
 int64_t peek8B(unsigned char *p);
@@ -346,15 +427,18 @@ unsigned peek2Bu(unsigned char *p);
 
 const char *tabs(int n);
 int hexdigit(unsigned char c);
-void openfiles(char *psdpath, struct psd_header *h);
+void setoutdir(struct psd_context *ctx, char *psdpath, char *dirsuffix);
+void openfiles(struct psd_context *ctx, char *psdpath, struct psd_header *h);
 
-int dopsd(psd_file_t f, char *fname, struct psd_header *h);
-void processlayers(psd_file_t f, struct psd_header *h);
+int dopsd(struct psd_context *ctx, psd_file_t f, char *fname, struct psd_header *h);
+void processlayers(struct psd_context *ctx, psd_file_t f, struct psd_header *h);
+void processdocument(struct psd_context *ctx, psd_file_t f, char *name, struct psd_header *h);
 void dolayerinfo(psd_file_t f, struct psd_header *h);
 
 void entertag(psd_file_t f, int level, int len, struct dictentry *parent, struct dictentry *d, int resetpos);
 struct dictentry *findbykey(psd_file_t f, int level, struct dictentry *dict, char *key, int len, int resetpos);
 void doadditional(psd_file_t f, struct psd_header *h, int level, psd_bytes_t length);
+int widelengthkey(char *key);
 void layerblendmode(psd_file_t f, int level, int len, struct blend_mode_info *bm);
 void colorspace(int level, int space, unsigned char data[]);
 void ed_colorspace(psd_file_t f, int level, int len, struct dictentry *parent);
@@ -383,19 +467,26 @@ void dochannel(psd_file_t f,
 		  struct channel_info *chan, // array of channel info
 		  int channels, // how many channels are to be processed (>1 only for merged data)
 		  struct psd_header *h);
-void doimage(psd_file_t f,struct layer_info *li,char *name,struct psd_header *h);
+size_t rlebufsize(struct channel_info *chan);
+void setscale(struct channel_info *chan, int scale, int box);
+int setwindow(struct channel_info *chan, psd_pixels_t left, psd_pixels_t top,
+			  psd_pixels_t cols, psd_pixels_t rows);
+void doimage(struct psd_context *ctx, psd_file_t f, struct layer_info *li, char *name, struct psd_header *h);
 void readlayerinfo(psd_file_t f, struct psd_header *h, int i);
 void dolayermaskinfo(psd_file_t f,struct psd_header *h);
-psd_bytes_t globallayermaskinfo(psd_file_t f, struct psd_header *h);
+psd_bytes_t globallayermaskinfo(struct psd_context *ctx, psd_file_t f, struct psd_header *h);
 void doimageresources(psd_file_t f);
+psd_bytes_t findresource(psd_file_t f, int id, long *size);
+int writethumbnail(struct psd_context *ctx, psd_file_t f, char *psdpath, char *name);
 
 unsigned scavenge_psd(void *addr, size_t st_size, struct psd_header *h);
 void scan_channels(unsigned char *addr, size_t len, struct psd_header *h);
 
 void setupfile(char *dstname,char *dir,char *name,char *suffix);
-FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height,
+FILE* pngsetupwrite(struct psd_context *ctx, psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height,
 					int channels, int color_type, struct layer_info *li, struct psd_header *h);
 void pngwriteimage(
+		struct psd_context *ctx,
 		FILE *png,
 		psd_file_t psd,
 		struct layer_info *li,
@@ -403,9 +494,10 @@ void pngwriteimage(
 		int chancount,
 		struct psd_header *h);
 
-FILE* rawsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height,
+FILE* rawsetupwrite(struct psd_context *ctx, psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height,
 					int channels, int color_type, struct layer_info *li, struct psd_header *h);
 void rawwriteimage(
+		struct psd_context *ctx,
 		FILE *png,
 		psd_file_t psd,
 		struct layer_info *li,
@@ -413,12 +505,26 @@ void rawwriteimage(
 		int chancount,
 		struct psd_header *h);
 
+int pngdeferwrite(struct psd_context *ctx, char *dir, char *name, psd_pixels_t width, psd_pixels_t height,
+				  int channels, int color_type, int chindex, struct psd_header *h);
+int rawdeferwrite(struct psd_context *ctx, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, int channels);
+void writequeued(struct psd_context *ctx);
+int pngsetprofile(char *name);
+
+void parallel_for(int threads, long n, void (*fn)(void *arg, long i), void *arg);
+
+int readmanifest(FILE *in, char ***names);
+int batch(int workers, char **names, int n, int (*dofile)(char *name));
+int inventory(int threads, char **names, int n, int json);
+
 // worst case PackBits performance for n bytes:
 #define PACKBITSWORST(n) (129*((n)/128) + 1 + ((n) % 128))
 psd_pixels_t packbits(unsigned char *src, unsigned char *dst, psd_pixels_t n);
 
 psd_pixels_t unpackbits(unsigned char *outp, unsigned char *inp,
 						psd_pixels_t rowbytes, psd_pixels_t inlen);
+psd_pixels_t unpackbits_window(unsigned char *outp, unsigned char *inp, psd_pixels_t rowbytes,
+							   psd_pixels_t skip, psd_pixels_t n, psd_pixels_t inlen);
 
 void *map_file(int fd, size_t len);
 void unmap_file(void *addr, size_t len);
@@ -433,9 +539,21 @@ psd_status psd_unzip_without_prediction(psd_uchar *src_buf, psd_int src_len,
 psd_status psd_unzip_with_prediction(psd_uchar *src_buf, psd_int src_len,
 	psd_uchar *dst_buf, psd_int dst_len,
 	psd_int row_size, psd_int color_depth);
+struct psd_unzip *psd_unzip_open(psd_file_t f, psd_bytes_t pos, psd_bytes_t len,
+								 int predict, int depth,
+								 psd_pixels_t rows, psd_pixels_t rowbytes);
+psd_pixels_t psd_unzip_row(struct psd_unzip *zs, psd_pixels_t row,
+						   psd_pixels_t skip, psd_pixels_t n, unsigned char *dst);
+void psd_unzip_close(struct psd_unzip *zs);
+void psd_predict_row(psd_uchar *p, psd_int rowbytes, psd_int depth, psd_uchar *tmp);
+
+int psd_setinflater(char *name);
+int psd_inflater_is_zlib(void);
+size_t psd_inflate(unsigned char *src, size_t srclen,
+				   unsigned char *dst, size_t dstlen, size_t *outlen);
 
 void duotone_data(psd_file_t f, int level);
 
-void rebuild_psd(psd_file_t psd, int version, struct psd_header *h);
+void rebuild_psd(struct psd_context *ctx, psd_file_t psd, int version, struct psd_header *h);
 
 #endif
@@ -17,14 +17,28 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#if defined(HAVE_COPY_FILE_RANGE) && !defined(_GNU_SOURCE)
+	#define _GNU_SOURCE // for copy_file_range()
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "psdparse.h"
 
-extern FILE *rebuilt_psd;
+#ifdef HAVE_ZLIB_H
+	#include "zlib.h"
+#endif
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SYS_SENDFILE_H)
+	#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+	#include <sys/sendfile.h>
+#endif
 
-void writeheader(psd_file_t out_psd, int version, struct psd_header *h){
+void writeheader(FILE *out_psd, int version, struct psd_header *h){
 	fwrite("8BPS", 1, 4, out_psd);
 	put2B(out_psd, version);
 	put4B(out_psd, PAD_BYTE);
@@ -36,6 +50,97 @@ void writeheader(psd_file_t out_psd, int version, struct psd_header *h){
 	put2B(out_psd, h->mode);
 }
 
+// Compressed rows are held in memory up to this many bytes (or a store's
+// own budget, if set), and beyond that in a temporary file.
+
+#ifndef REBUILD_BUDGET
+	#define REBUILD_BUDGET (64 << 20)
+#endif
+
+struct spill{
+	unsigned char *mem;
+	size_t size, used, pos; // allocated and used bytes of mem; read cursor
+	size_t budget;          // limit on size, or zero for REBUILD_BUDGET
+	FILE *file;             // the overflow, once mem is full
+};
+
+// Append n bytes; each append goes wholly to memory or wholly to the file.
+// Returns zero if they couldn't be stored.
+
+static int spill_put(struct spill *s, unsigned char *p, size_t n){
+	size_t size, budget = s->budget ? s->budget : REBUILD_BUDGET;
+
+	if(!s->file && s->used + n > s->size){
+		for(size = s->size ? s->size : 0x10000; size < s->used + n; )
+			size *= 2;
+		if(size > budget)
+			size = budget;
+		if(size >= s->used + n){
+			if( !(s->mem = realloc(s->mem, size)) )
+				fatal("# can't allocate buffer for compressed channel data\n");
+			s->size = size;
+		}else if( !(s->file = tmpfile()) ){
+			alwayswarn("# can't create temporary file for compressed channel data\n");
+			return 0;
+		}else
+			VERBOSE("# (compressed data exceeds %d MB, continuing in a temporary file)\n",
+					(int)(budget >> 20));
+	}
+	if(s->file)
+		return fwrite(p, 1, n, s->file) == n;
+	memcpy(s->mem + s->used, p, n);
+	s->used += n;
+	return 1;
+}
+
+// Read back the next n bytes, in the order they were appended
+// (n must be the size of an append).
+
+static int spill_get(struct spill *s, unsigned char *p, size_t n){
+	if(s->pos < s->used){
+		memcpy(p, s->mem + s->pos, n);
+		s->pos += n;
+		return 1;
+	}
+	if(s->pos == s->used && s->file){
+		// first read from the file
+		rewind(s->file);
+		++s->pos;
+	}
+	return s->file && fread(p, 1, n, s->file) == n;
+}
+
+// Copy everything appended to the output file.
+
+static int spill_copy(struct spill *s, FILE *out){
+	unsigned char buf[0x10000];
+	size_t n;
+
+	if(fwrite(s->mem, 1, s->used, out) != s->used)
+		return 0;
+	if(s->file){
+		rewind(s->file);
+		while( (n = fread(buf, 1, sizeof(buf), s->file)) )
+			if(fwrite(buf, 1, n, out) != n)
+				return 0;
+	}
+	return 1;
+}
+
+static void spill_free(struct spill *s){
+	free(s->mem);
+	if(s->file)
+		fclose(s->file);
+	memset(s, 0, sizeof(struct spill));
+}
+
+// Write image data for one layer channel, or for all the merged channels.
+// Each row is decoded once, and RLE compressed as it goes. The data is
+// written RLE compressed if that is a saving (once the running total
+// shows it can't be, the rows so far are written out uncompressed, and
+// the rest follow as they are decoded).
+// Returns the size written, or zero on error.
+
 psd_bytes_t writepsdchannels(
 		FILE *out_psd,
 		int version,
@@ -45,38 +150,58 @@ psd_bytes_t writepsdchannels(
 		int chancount,
 		struct psd_header *h)
 {
-	psd_pixels_t j, k, total_rows = chancount * ch->rows;
-	psd_bytes_t *rowcounts;
-	unsigned char *compbuf, *inrow, *rlebuf, *p;
-	int i, comp;
-	psd_bytes_t chansize, compsize;
+	psd_pixels_t j, k, m, r, total_rows = chancount * ch->rows;
+	psd_bytes_t *rowcounts, chansize = 0, compsize = 0,
+				rawsize = (psd_bytes_t)total_rows*ch->rowbytes;
+	unsigned char *inrow, *rlebuf, *packed;
+	int i, n, comp = RLECOMP;
+	struct spill store;
 	extern const char *comptype[];
 
-	rlebuf    = checkmalloc(ch->rowbytes*2);
+	rlebuf    = checkmalloc(rlebufsize(ch));
 	inrow     = checkmalloc(ch->rowbytes);
-
-	// compress channel(s) to decide if RLE is a saving
-
-	compbuf   = checkmalloc(PACKBITSWORST(ch->rowbytes)*total_rows);
+	packed    = checkmalloc(PACKBITSWORST(ch->rowbytes));
 	rowcounts = checkmalloc(sizeof(psd_bytes_t)*total_rows);
+	memset(&store, 0, sizeof(store));
 
-	p = compbuf;
-	compsize = 0;
 	for(i = k = 0; i < chancount; ++i){
 		for(j = 0; j < ch[i].rows; ++j, ++k){
 			readunpackrow(psd, ch+i, j, inrow, rlebuf);
-			rowcounts[k] = packbits(inrow, p, ch[i].rowbytes);
-			compsize += rowcounts[k];
-			p += rowcounts[k];
+
+			if(comp == RLECOMP){
+				rowcounts[k] = packbits(inrow, packed, ch[i].rowbytes);
+				compsize += rowcounts[k];
+				// (allowing for row counts)
+				if((total_rows << version) + compsize < rawsize){
+					if(!spill_put(&store, packed, rowcounts[k]))
+						goto err;
+					continue;
+				}
+
+				// RLE can't be a saving now, so don't compress;
+				// unpack and write the rows so far (rlebuf is free to use).
+				put2B(out_psd, comp = RAWDATA);
+				for(n = 0, m = 0; m < k; ++n)
+					for(r = 0; r < ch[n].rows && m < k; ++r, ++m){
+						if(!spill_get(&store, packed, rowcounts[m]))
+							goto err;
+						unpackbits(rlebuf, packed, ch[n].rowbytes, rowcounts[m]);
+						if((psd_pixels_t)fwrite(rlebuf, 1, ch[n].rowbytes, out_psd) != ch[n].rowbytes)
+							goto err;
+					}
+				spill_free(&store);
+			}
+
+			/* write an uncompressed row */
+			if((psd_pixels_t)fwrite(inrow, 1, ch[i].rowbytes, out_psd) != ch[i].rowbytes)
+				goto err;
 		}
 	}
-	// allow for row counts:
-	chansize = (total_rows << version) + compsize;
 
-	if(chansize < total_rows*ch->rowbytes){
+	if(comp == RLECOMP && total_rows){
 		// RLE was shorter, so use compressed data.
 
-		put2B(out_psd, comp = RLECOMP);
+		put2B(out_psd, RLECOMP);
 		for(j = 0; j < total_rows; ++j){
 			if(version == 1){
 				if(rowcounts[j] > UINT16_MAX)
@@ -86,47 +211,561 @@ psd_bytes_t writepsdchannels(
 				put4B(out_psd, rowcounts[j]);
 			}
 		}
+		if(!spill_copy(&store, out_psd))
+			goto err;
+		chansize = (total_rows << version) + compsize;
+	}else{
+		if(!total_rows)
+			put2B(out_psd, comp = RAWDATA);
+		chansize = rawsize;
+	}
+
+	chansize += 2; // allow for compression type field
+
+	if(chancount > 1){
+		VERBOSE("#   %d channels: %6u bytes (%s)\n", chancount, (unsigned)chansize, comptype[comp]);
+	}else{
+		VERBOSE("#   channel %d: %6u bytes (%s)\n", chindex, (unsigned)chansize, comptype[comp]);
+	}
+
+	goto done;
+
+err:
+	alwayswarn("# error writing psd channel (%s), aborting\n", comptype[comp]);
+	chansize = 0;
+done:
+	spill_free(&store);
+	free(rowcounts);
+	free(packed);
+	free(rlebuf);
+	free(inrow);
+
+	return chansize;
+}
+
+// Copy n bytes at pos in the source file to the output, in the kernel
+// where the system allows, otherwise through a buffer.
+// Returns zero on error.
+
+static int copy_range(psd_file_t psd, FILE *out_psd, psd_bytes_t pos, psd_bytes_t n){
+	unsigned char buf[0x10000];
+	psd_bytes_t done = 0, start;
+	size_t cnt;
+
+	fflush(out_psd);
+	start = ftello(out_psd);
+#ifdef HAVE_COPY_FILE_RANGE
+	{
+		loff_t in = pos, outpos = start;
+		ssize_t r;
+
+		while(done < n){
+			if( (r = copy_file_range(fileno(psd->fp), &in, fileno(out_psd), &outpos, n - done, 0)) > 0 )
+				done += r;
+			else if(r == -1 && errno == EINTR)
+				continue;
+			else
+				break; // e.g. not supported between these files; carry on below
+		}
+	}
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+	{
+		off_t in = pos + done;
+		ssize_t r;
+
+		if(done < n && fseeko(out_psd, start + done, SEEK_SET) == 0){
+			fflush(out_psd);
+			while(done < n){
+				if( (r = sendfile(fileno(out_psd), fileno(psd->fp), &in, n - done)) > 0 )
+					done += r;
+				else if(r == -1 && errno == EINTR)
+					continue;
+				else
+					break;
+			}
+		}
+	}
+#endif
+	// re-sync the stream with what was written underneath it
+	if(fseeko(out_psd, start + done, SEEK_SET) == -1)
+		return 0;
 
-		if((psd_pixels_t)fwrite(compbuf, 1, compsize, out_psd) != compsize){
-			alwayswarn("# error writing psd channel (RLE), aborting\n");
+	for(; done < n; done += cnt){
+		cnt = n - done < sizeof(buf) ? n - done : sizeof(buf);
+		if(psd_pread(psd, buf, cnt, pos + done) != cnt || fwrite(buf, 1, cnt, out_psd) != cnt)
 			return 0;
+	}
+	return 1;
+}
+
+// Size of the source file, or zero if it can't be found.
+
+static psd_bytes_t sourcesize(psd_file_t psd){
+	struct stat sb;
+
+	if(psd->addr)
+		return psd->size;
+	return fstat(fileno(psd->fp), &sb) ? 0 : sb.st_size;
+}
+
+// Intact compressed channel data, to be copied as it stands (see below).
+
+struct intact{
+	int comp;
+	psd_bytes_t pos, end;  // extent of the compressed data (RLE: excluding row counts)
+	psd_bytes_t table;     // RLE: position of the row counts
+	unsigned char *counts; // RLE: the row counts as read
+};
+
+// Check whether the compressed data of one layer channel, or of all the
+// merged channels, can be copied as it stands. It must look intact: ZIP
+// data must lie within the file and start with a zlib header; RLE row
+// counts must all be plausible (dochannel() has not had to guess any of
+// them), agree with the layer's channel length if known, and lead to data
+// within the file; and RLE must be smaller than the raw data.
+// Returns zero if not, otherwise fills in *ic for writeintact().
+
+static int intactchannels(
+		int version,
+		psd_file_t psd,
+		struct channel_info *ch,
+		int chancount,
+		struct psd_header *h,
+		psd_bytes_t length, // layer channel's length, or zero if not known
+		struct intact *ic)
+{
+	psd_pixels_t j, k, total_rows = chancount * ch->rows;
+	psd_bytes_t filesize, tablesize, count;
+	unsigned char zhdr[2];
+	int i, ok;
+
+	if(!total_rows || ch->scale != 1 || ch->rows != ch->full_rows || ch->rowbytes != ch->full_rowbytes)
+		return 0;
+
+	if(!(filesize = sourcesize(psd)))
+		return 0;
+
+	ic->comp = ch->comptype;
+	ic->counts = NULL;
+	if(ic->comp == ZIPNOPREDICT || ic->comp == ZIPPREDICT){
+		ic->pos = ch->zippos;
+		ic->end = ic->pos + length - 2;
+		return chancount == 1 && length >= 4 && ic->end <= filesize
+			   && psd_pread(psd, zhdr, 2, ic->pos) == 2
+			   && (zhdr[0] & 0x0f) == 8 && ((zhdr[0] << 8) | zhdr[1]) % 31 == 0;
+	}
+	if(ic->comp != RLECOMP)
+		return 0;
+
+	tablesize = (psd_bytes_t)total_rows << h->version;
+	ic->pos = ch->rowpos[0];
+	ic->table = ic->pos - tablesize;
+	ic->end = ch[chancount-1].rowpos[ch->rows];
+	if(ic->end > filesize || (length && 2 + ic->end - ic->table != length)
+	   || ((psd_bytes_t)total_rows << version) + ic->end - ic->pos >= (psd_bytes_t)total_rows*ch->rowbytes)
+		return 0; // (or it would be better written uncompressed)
+
+	ic->counts = checkmalloc(tablesize);
+	ok = psd_pread(psd, ic->counts, tablesize, ic->table) == tablesize;
+	for(i = k = 0; ok && i < chancount; ++i){
+		// each channel's data must follow the last
+		ok = !i || ch[i].rowpos[0] == ch[i-1].rowpos[ch->rows];
+		for(j = 0; ok && j < ch->rows; ++j, ++k){
+			count = h->version == 1 ? peek2Bu(ic->counts + 2*k) : (uint32_t)peek4B(ic->counts + 4*k);
+			ok = count >= 2 && count <= 2*ch->rowbytes
+				 && count == ch[i].rowpos[j+1] - ch[i].rowpos[j]
+				 && (version != 1 || count <= UINT16_MAX);
 		}
+	}
+	if(!ok){
+		free(ic->counts);
+		ic->counts = NULL;
+	}
+	return ok;
+}
+
+// Write channel data found intact by intactchannels(), copying the
+// compressed bytes. RLE counts are rewritten if the output format
+// differs (PSD vs PSB). Returns the size written, or zero on error.
 
-		free(compbuf);
-		free(rowcounts);
+static psd_bytes_t writeintact(
+		FILE *out_psd,
+		int version,
+		psd_file_t psd,
+		int chindex,
+		struct channel_info *ch,
+		int chancount,
+		struct psd_header *h,
+		struct intact *ic)
+{
+	psd_pixels_t k, total_rows = chancount * ch->rows;
+	psd_bytes_t pos = ic->pos, size, count;
+	extern const char *comptype[];
+
+	put2B(out_psd, ic->comp);
+	size = 2 + ic->end - ic->pos;
+	if(ic->counts){
+		if(version == h->version)
+			pos = ic->table; // copy the counts along with the data
+		else
+			for(k = 0; k < total_rows; ++k){
+				count = h->version == 1 ? peek2Bu(ic->counts + 2*k) : (uint32_t)peek4B(ic->counts + 4*k);
+				if(version == 1)
+					put2B(out_psd, count);
+				else
+					put4B(out_psd, count);
+			}
+		size += (psd_bytes_t)total_rows << version;
+		free(ic->counts);
+		ic->counts = NULL;
+	}
+
+	if(!copy_range(psd, out_psd, pos, ic->end - pos)){
+		alwayswarn("# error copying psd channel (%s), aborting\n", comptype[ic->comp]);
+		return 0;
+	}
+	if(chancount > 1){
+		VERBOSE("#   %d channels: %6u bytes (%s, copied)\n", chancount, (unsigned)size, comptype[ic->comp]);
 	}else{
-		// There was no saving using RLE, so don't compress.
-
-		put2B(out_psd, comp = RAWDATA);
-		chansize = total_rows*ch->rowbytes;
-		for(i = 0; i < chancount; ++i){
-			for(j = 0; j < ch[i].rows; ++j){
-				/* get row data */
-				readunpackrow(psd, ch+i, j, inrow, rlebuf);
-
-				/* write an uncompressed row */
-				if((psd_pixels_t)fwrite(inrow, 1, ch[i].rowbytes, out_psd) != ch[i].rowbytes){
-					alwayswarn("# error writing psd channel (raw), aborting\n");
-					return 0;
-				}
+		VERBOSE("#   channel %d: %6u bytes (%s, copied)\n", chindex, (unsigned)size, comptype[ic->comp]);
+	}
+	return size;
+}
+
+#ifdef HAVE_ZLIB_H
+
+// With --rebuildzip, a layer channel is compressed every way at once:
+// RLE, ZIP, and ZIP with prediction (for depth 8, 16 and 32). Rows are
+// decoded a block at a time, and each block is given to the trials in
+// parallel (on 'threads' threads); the smallest result is written, or the
+// raw data if none is smaller. A trial is dropped as soon as it can't be.
+
+#define TRIAL_BLOCK (1 << 20) // bytes decoded at a time (rounded to whole rows)
+
+enum{ TRIAL_RLE, TRIAL_ZIP, TRIAL_ZIPPREDICT, TRIALS };
+
+struct trial{
+	int comp, live;
+	psd_bytes_t size;       // compressed so far (for RLE, not counting row counts)
+	struct spill store;
+	psd_bytes_t *rowcounts; // RLE only
+	unsigned char *buf;     // RLE: one packed row; ZIP with prediction: predicted block
+	unsigned char *tmp;     // ZIP with prediction: one row, to split 32 bit planes
+	z_stream z;
+};
+
+struct trials{
+	struct trial t[TRIALS];
+	unsigned char *block;
+	psd_pixels_t row, nrows, rows, rowbytes; // block's first row and count; channel size
+	psd_bytes_t rawsize;
+	int version, depth, last;
+};
+
+// Deflate n bytes into the trial's store (finishing the stream if flush
+// is Z_FINISH). Returns zero on error.
+
+static int trial_deflate(struct trial *t, unsigned char *p, size_t n, int flush){
+	unsigned char out[0x10000];
+	size_t cnt;
+
+	t->z.next_in = p;
+	t->z.avail_in = n;
+	do{
+		t->z.next_out = out;
+		t->z.avail_out = sizeof(out);
+		if(deflate(&t->z, flush) == Z_STREAM_ERROR)
+			return 0;
+		if( (cnt = sizeof(out) - t->z.avail_out) && !spill_put(&t->store, out, cnt) )
+			return 0;
+		t->size += cnt;
+	}while(!t->z.avail_out);
+	return 1;
+}
+
+// Give the current block to one trial.
+
+static void trial_block(void *arg, long i){
+	struct trials *tr = arg;
+	struct trial *t = tr->t + i;
+	psd_pixels_t j, n;
+	psd_bytes_t overhead = 0;
+	int ok = 1;
+
+	if(!t->live)
+		return;
+
+	switch(i){
+	case TRIAL_RLE:
+		overhead = (psd_bytes_t)tr->rows << tr->version;
+		for(j = 0; ok && j < tr->nrows; ++j){
+			n = packbits(tr->block + j*tr->rowbytes, t->buf, tr->rowbytes);
+			t->rowcounts[tr->row + j] = n;
+			t->size += n;
+			ok = (tr->version != 1 || n <= UINT16_MAX) && spill_put(&t->store, t->buf, n);
+		}
+		break;
+	case TRIAL_ZIP:
+		ok = trial_deflate(t, tr->block, tr->nrows*tr->rowbytes, tr->last ? Z_FINISH : Z_NO_FLUSH);
+		break;
+	case TRIAL_ZIPPREDICT:
+		memcpy(t->buf, tr->block, tr->nrows*tr->rowbytes);
+		for(j = 0; j < tr->nrows; ++j)
+			psd_predict_row(t->buf + j*tr->rowbytes, tr->rowbytes, tr->depth, t->tmp);
+		ok = trial_deflate(t, t->buf, tr->nrows*tr->rowbytes, tr->last ? Z_FINISH : Z_NO_FLUSH);
+		break;
+	}
+
+	if(!ok || overhead + t->size >= tr->rawsize){
+		t->live = 0;
+		spill_free(&t->store);
+	}
+}
+
+static psd_bytes_t writezipchannel(
+		FILE *out_psd,
+		int version,
+		psd_file_t psd,
+		int chindex,
+		struct channel_info *ch,
+		struct psd_header *h,
+		int threads)
+{
+	struct trials tr;
+	struct trial *t, *best = NULL;
+	psd_pixels_t j, blockrows;
+	psd_bytes_t chansize;
+	unsigned char *rlebuf;
+	int i, comp = RAWDATA;
+	extern const char *comptype[];
+
+	if(!ch->rows)
+		return writepsdchannels(out_psd, version, psd, chindex, ch, 1, h);
+
+	memset(&tr, 0, sizeof(tr));
+	tr.rows = ch->rows;
+	tr.rowbytes = ch->rowbytes;
+	tr.rawsize = (psd_bytes_t)ch->rows*ch->rowbytes;
+	tr.version = version;
+	tr.depth = ch->depth;
+
+	blockrows = TRIAL_BLOCK / ch->rowbytes;
+	if(!blockrows)
+		blockrows = 1;
+	if(blockrows > ch->rows)
+		blockrows = ch->rows;
+	tr.block = checkmalloc(blockrows*ch->rowbytes);
+	rlebuf = checkmalloc(rlebufsize(ch));
+
+	for(i = 0; i < TRIALS; ++i){
+		t = tr.t + i;
+		t->store.budget = REBUILD_BUDGET / TRIALS;
+		switch(i){
+		case TRIAL_RLE:
+			t->comp = RLECOMP;
+			t->rowcounts = checkmalloc(sizeof(psd_bytes_t)*ch->rows);
+			t->buf = checkmalloc(PACKBITSWORST(ch->rowbytes));
+			t->live = 1;
+			break;
+		case TRIAL_ZIP:
+			t->comp = ZIPNOPREDICT;
+			t->live = deflateInit(&t->z, Z_DEFAULT_COMPRESSION) == Z_OK;
+			break;
+		case TRIAL_ZIPPREDICT:
+			t->comp = ZIPPREDICT;
+			if(ch->depth == 8 || ch->depth == 16 || ch->depth == 32){
+				t->buf = checkmalloc(blockrows*ch->rowbytes);
+				t->tmp = checkmalloc(ch->rowbytes);
+				t->live = deflateInit(&t->z, Z_DEFAULT_COMPRESSION) == Z_OK;
 			}
+			break;
 		}
 	}
 
-	chansize += 2; // allow for compression type field
+	for(tr.row = 0; tr.row < ch->rows; tr.row += tr.nrows){
+		tr.nrows = ch->rows - tr.row < blockrows ? ch->rows - tr.row : blockrows;
+		tr.last = tr.row + tr.nrows == ch->rows;
+		for(j = 0; j < tr.nrows; ++j)
+			readunpackrow(psd, ch, tr.row + j, tr.block + j*ch->rowbytes, rlebuf);
+		parallel_for(threads, TRIALS, trial_block, &tr);
+	}
 
-	if(chancount > 1){
-		VERBOSE("#   %d channels: %6u bytes (%s)\n", chancount, (unsigned)chansize, comptype[comp]);
+	// pick the smallest; raw data unless something is smaller
+	chansize = tr.rawsize;
+	for(i = 0; i < TRIALS; ++i){
+		t = tr.t + i;
+		if(t->live && t->size + (i == TRIAL_RLE ? (psd_bytes_t)ch->rows << version : 0) < chansize){
+			best = t;
+			comp = t->comp;
+			chansize = t->size + (i == TRIAL_RLE ? (psd_bytes_t)ch->rows << version : 0);
+		}
+	}
+
+	put2B(out_psd, comp);
+	if(comp == RLECOMP)
+		for(j = 0; j < ch->rows; ++j){
+			if(version == 1)
+				put2B(out_psd, best->rowcounts[j]);
+			else
+				put4B(out_psd, best->rowcounts[j]);
+		}
+	if(best){
+		if(!spill_copy(&best->store, out_psd))
+			goto err;
 	}else{
-		VERBOSE("#   channel %d: %6u bytes (%s)\n", chindex, (unsigned)chansize, comptype[comp]);
+		// nothing was smaller: decode again, writing the rows as they are
+		for(j = 0; j < ch->rows; ++j){
+			readunpackrow(psd, ch, j, tr.block, rlebuf);
+			if((psd_pixels_t)fwrite(tr.block, 1, ch->rowbytes, out_psd) != ch->rowbytes)
+				goto err;
+		}
 	}
 
+	chansize += 2; // allow for compression type field
+	VERBOSE("#   channel %d: %6u bytes (%s)\n", chindex, (unsigned)chansize, comptype[comp]);
+	goto done;
+
+err:
+	alwayswarn("# error writing psd channel (%s), aborting\n", comptype[comp]);
+	chansize = 0;
+done:
+	for(i = 0; i < TRIALS; ++i){
+		t = tr.t + i;
+		if(i != TRIAL_RLE)
+			deflateEnd(&t->z); // (harmless if never initialised)
+		spill_free(&t->store);
+		free(t->rowcounts);
+		free(t->buf);
+		free(t->tmp);
+	}
+	free(tr.block);
 	free(rlebuf);
-	free(inrow);
 
 	return chansize;
 }
 
+#endif
+
+// Recompress one layer channel.
+
+static psd_bytes_t compresschannel(
+		FILE *out_psd,
+		int version,
+		psd_file_t psd,
+		int chindex,
+		struct channel_info *ch,
+		struct psd_header *h,
+		int threads)
+{
+#ifdef HAVE_ZLIB_H
+	if(rebuild_zip)
+		return writezipchannel(out_psd, version, psd, chindex, ch, h, threads);
+#endif
+	return writepsdchannels(out_psd, version, psd, chindex, ch, 1, h);
+}
+
+// Layer channels are written a batch at a time. With --jobs, the channels
+// of a batch that need recompressing are compressed in parallel, each into
+// a temporary file; then a single writer puts the batch into the output in
+// order, copying intact channels itself. Each channel's length_rebuild is
+// set as it is done. (Without --jobs, everything is written directly.)
+
+#define REBUILD_BATCH 4 // channels per thread in a batch
+
+struct layerchan{
+	int layer, chindex, copy;
+	struct channel_info *ch;
+	struct intact ic;
+	FILE *tmp; // compressed data, if compressed in parallel
+};
+
+struct layerbatch{
+	struct layerchan *lc;
+	psd_file_t psd;
+	struct psd_header *h;
+	int version;
+};
+
+static void compressbatch(void *arg, long i){
+	struct layerbatch *b = arg;
+	struct layerchan *lc = b->lc + i;
+
+	if(!lc->copy && (lc->tmp = tmpfile()))
+		lc->ch->length_rebuild = compresschannel(lc->tmp, b->version, b->psd, lc->chindex, lc->ch, b->h, 1);
+}
+
+// Returns the total size written.
+
+static psd_bytes_t writelayerchannels(FILE *out_psd, int version, psd_file_t psd,
+									  struct psd_header *h, int copy)
+{
+	struct layerchan *lc, *p;
+	struct layerbatch b;
+	struct layer_info *li;
+	struct psd_file tmpf;
+	psd_bytes_t total = 0;
+	int i, j, n, k, count, batch, next = 0;
+
+	for(i = n = 0, li = h->linfo; i < h->nlayers; ++i, ++li)
+		if(li->chan)
+			n += li->channels;
+	lc = checkmalloc(n*sizeof(struct layerchan) + 1);
+	for(i = n = 0, li = h->linfo; i < h->nlayers; ++i, ++li)
+		for(j = 0; li->chan && j < li->channels; ++j, ++n){
+			lc[n].layer = i;
+			lc[n].chindex = j;
+			lc[n].ch = li->chan + j;
+			lc[n].tmp = NULL;
+		}
+
+	b.lc = lc;
+	b.psd = psd;
+	b.h = h;
+	b.version = version;
+	batch = jobs > 1 ? jobs*REBUILD_BATCH : 1;
+	for(k = 0; k < n; k += count){
+		count = n - k < batch ? n - k : batch;
+
+		// intact compressed data is copied, but with --rebuildzip, only ZIP data
+		for(p = lc + k; p < lc + k + count; ++p)
+			p->copy = copy && (!rebuild_zip || p->ch->comptype == ZIPNOPREDICT || p->ch->comptype == ZIPPREDICT)
+					  && intactchannels(version, psd, p->ch, 1, h, p->ch->length, &p->ic);
+
+		if(jobs > 1){
+			b.lc = lc + k;
+			parallel_for(jobs, count, compressbatch, &b);
+		}
+
+		for(p = lc + k; p < lc + k + count; ++p){
+			for(; next <= p->layer; ++next)
+				if(h->linfo[next].chan)
+					UNQUIET("# rebuilding layer %d: %s\n", next, h->linfo[next].name);
+
+			if(p->copy)
+				p->ch->length_rebuild = writeintact(out_psd, version, psd, p->chindex, p->ch, 1, h, &p->ic);
+			else if(p->tmp){
+				fflush(p->tmp);
+				memset(&tmpf, 0, sizeof(tmpf));
+				tmpf.fp = p->tmp;
+				if(!copy_range(&tmpf, out_psd, 0, p->ch->length_rebuild)){
+					alwayswarn("# error writing psd channel, aborting\n");
+					p->ch->length_rebuild = 0;
+				}
+				fclose(p->tmp);
+			}else
+				p->ch->length_rebuild = compresschannel(out_psd, version, psd, p->chindex, p->ch, h, jobs);
+			total += p->ch->length_rebuild;
+		}
+	}
+	for(; next < h->nlayers; ++next)
+		if(h->linfo[next].chan)
+			UNQUIET("# rebuilding layer %d: %s\n", next, h->linfo[next].name);
+
+	free(lc);
+	return total;
+}
+
 psd_bytes_t writedummymerged(
 		FILE *out_psd,
 		int version,
@@ -152,36 +791,27 @@ psd_bytes_t writedummymerged(
 	return 2 + h->channels * h->rows * rowbytes;
 }
 
-static int32_t bounds_top, bounds_left, bounds_bottom, bounds_right;
-
-psd_bytes_t writelayerinfo(psd_file_t psd, psd_file_t out_psd,
+psd_bytes_t writelayerinfo(psd_file_t psd, FILE *out_psd,
 						   int version, struct psd_header *h,
 						   psd_pixels_t h_offset, psd_pixels_t v_offset)
 {
-	int i, j, namelen, mask_size, extralen;
+	int i, j, nchan, namelen, mask_size, extralen;
 	psd_bytes_t size;
 	struct layer_info *li;
+	char *name;
 
 	put2B(out_psd, h->mergedalpha ? -h->nlayers : h->nlayers);
 	size = 2;
 	for(i = 0, li = h->linfo; i < h->nlayers; ++i, ++li){
-		// accumulate this layer's bounding rectangle into global bounds
-		if(bounds_top > li->top)
-			bounds_top = li->top;
-		if(bounds_left > li->left)
-			bounds_left = li->left;
-		if(bounds_bottom < li->bottom)
-			bounds_bottom = li->bottom;
-		if(bounds_right < li->right)
-			bounds_right = li->right;
-
 		put4B(out_psd, li->top + v_offset);
 		put4B(out_psd, li->left + h_offset);
 		put4B(out_psd, li->bottom + v_offset);
 		put4B(out_psd, li->right + h_offset);
-		put2B(out_psd, li->channels);
+		// a layer whose record couldn't be read is kept, without channels
+		nchan = li->chan ? li->channels : 0;
+		put2B(out_psd, nchan);
 		size += 18;
-		for(j = 0; j < li->channels; ++j){
+		for(j = 0; j < nchan; ++j){
 			put2B(out_psd, li->chan[j].id);
 			putpsdbytes(out_psd, version, li->chan[j].length_rebuild);
 			size += 2 + PSDBSIZE(version);
@@ -197,7 +827,8 @@ psd_bytes_t writelayerinfo(psd_file_t psd, psd_file_t out_psd,
 		// layer's 'extra data' section ================================
 
 		// TODO: Flag damaged layers in the name and optionally hide them automatically
-		namelen = strlen(li->name);
+		name = li->name ? li->name : "\0\0\0"; // (padded)
+		namelen = strlen(name);
 		mask_size = li->mask.size >= 36 ? 36 : (li->mask.size >= 20 ? 20 : 0);
 
 		extralen = 4 + mask_size + 4 + PAD4(namelen+1);
@@ -232,7 +863,7 @@ psd_bytes_t writelayerinfo(psd_file_t psd, psd_file_t out_psd,
 
 		// layer name --------------------------------------------------
 		fputc(namelen, out_psd);
-		fwrite(li->name, 1, PAD4(namelen+1)-1, out_psd);
+		fwrite(name, 1, PAD4(namelen+1)-1, out_psd);
 
 		// additional layer information --------------------------------
 		// currently empty, but if non-empty, is accounted for in size
@@ -243,78 +874,164 @@ psd_bytes_t writelayerinfo(psd_file_t psd, psd_file_t out_psd,
 	return size;
 }
 
-psd_bytes_t copy_block(psd_file_t psd, psd_file_t out_psd, psd_bytes_t pos){
-	char *tempbuf;
-	psd_bytes_t n, cnt;
+// Copy the length-prefixed block at pos (color mode data), through
+// copy_range() so no memory is needed however large it is. If pos isn't
+// known, or the block runs past the end of file, write an empty block.
+// Returns the count of bytes written.
+
+psd_bytes_t copy_block(psd_file_t psd, FILE *out_psd, psd_bytes_t pos){
+	unsigned char buf[4];
+	psd_bytes_t n;
 
-	fseeko(psd, pos, SEEK_SET);
-	n = get4B(psd); // TODO: sanity check this byte count
-	tempbuf = malloc(n);
-	fread(tempbuf, 1, n, psd);
+	if(!pos || psd_pread(psd, buf, 4, pos) != 4)
+		n = 0;
+	else if(pos + 4 + (n = (uint32_t)peek4B(buf)) > sourcesize(psd)){
+		alwayswarn("# copy_block(): block of %lld bytes runs past end of file, not copied\n", (long long)n);
+		n = 0;
+	}
 	put4B(out_psd, n);
-	cnt = fwrite(tempbuf, 1, n, out_psd);
-	free(tempbuf);
-	if(cnt != n)
-		alwayswarn("# copy_block(): only wrote %d of %d bytes\n", cnt, n);
-	return 4 + cnt;
+	if(n && !copy_range(psd, out_psd, pos + 4, n)){
+		alwayswarn("# copy_block(): couldn't copy %lld bytes\n", (long long)n);
+		return 0;
+	}
+	return 4 + n;
+}
+
+// Is resource id listed in --droprsrc?
+
+static int droppedresource(int id){
+	char *p, *q;
+
+	for(p = drop_rsrc; p && *p; p = *q ? q + 1 : q)
+		if(strtol(p, &q, 10) == id)
+			return 1;
+	return 0;
+}
+
+// Walk the image resource blocks between pos and end, checking each one
+// lies within the section, and stopping at the first that doesn't.
+// Blocks are not read, only their headers; runs of blocks to be kept
+// are copied with copy_range(), if out_psd is not NULL.
+// Returns the count of bytes kept (or copied).
+
+static psd_bytes_t walkresources(psd_file_t psd, FILE *out_psd, psd_bytes_t pos, psd_bytes_t end){
+	unsigned char buf[4+2+256+4]; // signature, id, longest name, size
+	psd_bytes_t run = pos, kept = 0, namelen, size, blocklen;
+	int id;
+
+	for(; pos < end; pos += blocklen){
+		if(end - pos < 4+2+2+4 || psd_pread(psd, buf, 4+2+1, pos) != 4+2+1
+		   || !(KEYMATCH(buf, "8BIM") || KEYMATCH(buf, "MeSa") || KEYMATCH(buf, "PHUT")
+				|| KEYMATCH(buf, "AgHg") || KEYMATCH(buf, "DCSR")))
+			break;
+		id = peek2Bu(buf+4);
+		namelen = PAD2(1+buf[6]);
+		if(4+2+namelen+4 > end - pos
+		   || psd_pread(psd, buf, 4, pos+4+2+namelen) != 4
+		   || (size = (uint32_t)peek4B(buf)) > end - pos - (4+2+namelen+4)
+		   || PAD2(size) > end - pos - (4+2+namelen+4))
+			break;
+		blocklen = 4+2+namelen+4 + PAD2(size);
+
+		if(droppedresource(id)){
+			if(out_psd){
+				VERBOSE("# dropping resource %d (%lld bytes)\n", id, (long long)size);
+				if(pos > run && !copy_range(psd, out_psd, run, pos - run))
+					alwayswarn("# couldn't copy image resources\n");
+			}
+			kept += pos - run;
+			run = pos + blocklen;
+		}
+	}
+	if(pos < end && !out_psd)
+		alwayswarn("# bad image resource block @ %lld, dropping the rest\n", (long long)pos);
+	if(out_psd && pos > run && !copy_range(psd, out_psd, run, pos - run))
+		alwayswarn("# couldn't copy image resources\n");
+	return kept + (pos > run ? pos - run : 0);
+}
+
+// Copy the image resources section (ICC profile, guides, slices, etc),
+// leaving out any resources listed in --droprsrc, and any damaged blocks.
+// Returns the count of bytes written.
+
+static psd_bytes_t copy_resources(psd_file_t psd, FILE *out_psd, struct psd_header *h){
+	unsigned char buf[4];
+	psd_bytes_t pos, end, filesize, len = 0;
+
+	if(h->resourcepos && psd_pread(psd, buf, 4, h->resourcepos) == 4){
+		pos = h->resourcepos + 4;
+		end = pos + (uint32_t)peek4B(buf);
+		if(end > (filesize = sourcesize(psd)))
+			end = filesize; // keep whatever blocks are complete
+		len = walkresources(psd, NULL, pos, end);
+		put4B(out_psd, len);
+		walkresources(psd, out_psd, pos, end);
+		VERBOSE("# copied %lld bytes of image resources\n", (long long)len);
+	}else
+		put4B(out_psd, 0);
+	return 4 + len;
 }
 
-void rebuild_psd(psd_file_t psd, int version, struct psd_header *h){
+void rebuild_psd(struct psd_context *ctx, psd_file_t psd, int version, struct psd_header *h){
 	psd_bytes_t lmipos, lmilen, layerlen, checklen;
 	int32_t h_offset = 0, v_offset = 0;
-	int i, j;
+	int i, copy;
 	struct layer_info *li;
+	struct intact ic;
+	extern int scavenge, scavenge_psb, scavenge_rle;
+
+	psd_ctx = ctx;
 
 	if(merged_only)
 		h->nlayers = 0;
 
 	// File header =====================================================
-	writeheader(rebuilt_psd, version, h);
+	writeheader(ctx->rebuilt_psd, version, h);
 
 	// copy color mode data --------------------------------------------
-	copy_block(psd, rebuilt_psd, h->colormodepos);
+	copy_block(psd, ctx->rebuilt_psd, h->colormodepos);
+
+	// copy image resources -------------------------------------------
+	copy_resources(psd, ctx->rebuilt_psd, h);
 
-	// TODO: image resources -------------------------------------------
-	put4B(rebuilt_psd, 0); // empty for now
+	// Intact compressed data is copied as it stands, but scavenged
+	// channels are always recompressed.
+	copy = !scavenge && !scavenge_psb && !scavenge_rle;
 
 	// Layer and mask information ======================================
-	lmipos = ftello(rebuilt_psd);
-	putpsdbytes(rebuilt_psd, version, 0); // dummy lmi length
+	lmipos = ftello(ctx->rebuilt_psd);
+	putpsdbytes(ctx->rebuilt_psd, version, 0); // dummy lmi length
 	lmilen = 0;
 
 	if(h->nlayers){
 		// Layer info --------------------------------------------------
-		putpsdbytes(rebuilt_psd, version, 0); // dummy layer info length
+		putpsdbytes(ctx->rebuilt_psd, version, 0); // dummy layer info length
 		lmilen += PSDBSIZE(version); // account for layer info length field
-		bounds_top = bounds_left = bounds_bottom = bounds_right = 0;
-		layerlen = checklen = writelayerinfo(psd, rebuilt_psd, version, h, 0, 0);
+		layerlen = checklen = writelayerinfo(psd, ctx->rebuilt_psd, version, h, 0, 0);
 
 		VERBOSE("# rebuilt layer info: %u bytes\n", (unsigned)layerlen);
 
 		// Image data --------------------------------------------------
-		for(i = 0, li = h->linfo; i < h->nlayers; ++i, ++li){
-			UNQUIET("# rebuilding layer %d: %s\n", i, li->name);
-
-			for(j = 0; j < li->channels; ++j)
-				layerlen += li->chan[j].length_rebuild =
-						writepsdchannels(rebuilt_psd, version, psd, j, li->chan + j, 1, h);
-		}
+		layerlen += writelayerchannels(ctx->rebuilt_psd, version, psd, h, copy);
 
 		// Even alignment ----------------------------------------------
 		if(layerlen & 1){
 			++layerlen;
-			fputc(PAD_BYTE, rebuilt_psd);
+			fputc(PAD_BYTE, ctx->rebuilt_psd);
 		}
 
 		// Global layer mask info --------------------------------------
-		put4B(rebuilt_psd, 0); // empty for now
+		put4B(ctx->rebuilt_psd, 0); // empty for now
 		layerlen += 4;
 	}
 
 	// Merged image data ===============================================
 	if(h->merged_chans){
 		UNQUIET("# rebuilding merged image\n");
-		writepsdchannels(rebuilt_psd, version, psd, 0, h->merged_chans, h->channels, h);
+		if(copy && intactchannels(version, psd, h->merged_chans, h->channels, h, 0, &ic))
+			writeintact(ctx->rebuilt_psd, version, psd, 0, h->merged_chans, h->channels, h, &ic);
+		else
+			writepsdchannels(ctx->rebuilt_psd, version, psd, 0, h->merged_chans, h->channels, h);
 	}else{
 		// For some reason, we have no information about the merged image,
 		// (scavenging?) so write a dummy image.
@@ -325,10 +1042,22 @@ void rebuild_psd(psd_file_t psd, int version, struct psd_header *h){
 			// If we are scavenging, and the size of the (merged) document
 			// wasn't given, then fake the dimensions based on combined bounds
 			// of all layers. Then shift all layers into this area.
-			h->rows = bounds_bottom - bounds_top;
-			v_offset = -bounds_top;
-			h->cols = bounds_right - bounds_left;
-			h_offset = -bounds_left;
+			int32_t top = 0, left = 0, bottom = 0, right = 0;
+
+			for(i = 0, li = h->linfo; i < h->nlayers; ++i, ++li){
+				if(top > li->top)
+					top = li->top;
+				if(left > li->left)
+					left = li->left;
+				if(bottom < li->bottom)
+					bottom = li->bottom;
+				if(right < li->right)
+					right = li->right;
+			}
+			h->rows = bottom - top;
+			v_offset = -top;
+			h->cols = right - left;
+			h_offset = -left;
 			UNQUIET("# sized document to %d rows x %d columns to fit all layers\n", h->rows, h->cols);
 		}
 
@@ -346,11 +1075,11 @@ void rebuild_psd(psd_file_t psd, int version, struct psd_header *h){
 					mode_names[h->mode]);
 		}
 
-		writedummymerged(rebuilt_psd, version, h);
+		writedummymerged(ctx->rebuilt_psd, version, h);
 
 		// fixup header
-		fseeko(rebuilt_psd, 0, SEEK_SET);
-		writeheader(rebuilt_psd, version, h);
+		fseeko(ctx->rebuilt_psd, 0, SEEK_SET);
+		writeheader(ctx->rebuilt_psd, version, h);
 	}
 
 	// File complete ===================================================
@@ -359,10 +1088,10 @@ void rebuild_psd(psd_file_t psd, int version, struct psd_header *h){
 
 	if(h->nlayers){
 		// overwrite layer & mask information with fixed-up sizes
-		fseeko(rebuilt_psd, lmipos, SEEK_SET);
-		putpsdbytes(rebuilt_psd, version, lmilen + layerlen); // do fixup
-		putpsdbytes(rebuilt_psd, version, layerlen); // do fixup
-		if(writelayerinfo(psd, rebuilt_psd, version, h, h_offset, v_offset) != checklen)
+		fseeko(ctx->rebuilt_psd, lmipos, SEEK_SET);
+		putpsdbytes(ctx->rebuilt_psd, version, lmilen + layerlen); // do fixup
+		putpsdbytes(ctx->rebuilt_psd, version, layerlen); // do fixup
+		if(writelayerinfo(psd, ctx->rebuilt_psd, version, h, h_offset, v_offset) != checklen)
 			fatal("# oops! rewritten layer info different size from first pass");
 	}
 
@@ -21,13 +21,12 @@
 
 static void ir_resolution(psd_file_t f, int level, int len, struct dictentry *parent){
 	double hresd, vresd;
-	extern uint32_t hres, vres; // fixed point values
 
-	hresd = FIXEDPT(hres = get4B(f));
+	hresd = FIXEDPT(psd_ctx->hres = get4B(f));
 	get2B(f);
 	get2B(f);
-	vresd = FIXEDPT(vres = get4B(f));
-	if(xml) fprintf(xml, " <H>%g</H> <V>%g</V> ", hresd, vresd);
+	vresd = FIXEDPT(psd_ctx->vres = get4B(f));
+	if(psd_ctx->xml) fprintf(psd_ctx->xml, " <H>%g</H> <V>%g</V> ", hresd, vresd);
 	UNQUIET("    Resolution %g x %g pixels per inch\n", hresd, vresd);
 }
 
@@ -54,36 +53,36 @@ void ir_dump(psd_file_t f, int level, int len, struct dictentry *parent){
 	unsigned char row[BYTESPERLINE];
 	int n;
 
-	if(verbose)
+	if(psd_ctx->verbose)
 		for(; len; len -= n){
 			n = len < BYTESPERLINE ? len : BYTESPERLINE;
-			fread(row, 1, n, f);
+			psd_fread(row, 1, n, f);
 			dumphex(row, n);
 		}
 	else
-		fseeko(f, len, SEEK_CUR);
+		psd_fseeko(f, len, SEEK_CUR);
 }
 
 void ir_string(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml)
+	if(psd_ctx->xml)
 		while(len--)
-			fputcxml(fgetc(f), xml);
+			fputcxml(psd_fgetc(f), psd_ctx->xml);
 }
 
 // this should be used if the content is known to be valid XML.
 // (does not check for invalid characters)
 void ir_cdata(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml){
-		fputs("<![CDATA[", xml);
+	if(psd_ctx->xml){
+		fputs("<![CDATA[", psd_ctx->xml);
 		while(len--)
-			fputc(fgetc(f), xml);
-		fputs("]]>\n", xml);
+			fputc(psd_fgetc(f), psd_ctx->xml);
+		fputs("]]>\n", psd_ctx->xml);
 	}
 }
 
 static void ir_pstring(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml)
-		fputsxml(getpstr(f), xml);
+	if(psd_ctx->xml)
+		fputsxml(getpstr(f), psd_ctx->xml);
 }
 
 static void ir_pstrings(psd_file_t f, int level, int len, struct dictentry *parent){
@@ -93,61 +92,61 @@ static void ir_pstrings(psd_file_t f, int level, int len, struct dictentry *pare
 		// this loop will do the wrong thing
 		// if any string contains NUL byte
 		s = getpstr(f);
-		if(xml){
-			fprintf(xml, "%s<NAME>", tabs(level));
-			fputsxml(s, xml);
-			fputs("</NAME>\n", xml);
+		if(psd_ctx->xml){
+			fprintf(psd_ctx->xml, "%s<NAME>", tabs(level));
+			fputsxml(s, psd_ctx->xml);
+			fputs("</NAME>\n", psd_ctx->xml);
 		}
 		VERBOSE("    %s\n", s);
 	}
 }
 
 static void ir_1byte(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml) fprintf(xml, "%d", fgetc(f));
+	if(psd_ctx->xml) fprintf(psd_ctx->xml, "%d", psd_fgetc(f));
 }
 
 static void ir_2byte(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml) fprintf(xml, "%d", get2B(f));
+	if(psd_ctx->xml) fprintf(psd_ctx->xml, "%d", get2B(f));
 }
 
 static void ir_4byte(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml) fprintf(xml, "%d", get4B(f));
+	if(psd_ctx->xml) fprintf(psd_ctx->xml, "%d", get4B(f));
 }
 
 static void ir_alphaids(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml){
-		fprintf(xml, "%s<LENGTH>%d</LENGTH>\n", tabs(level), get4B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<LENGTH>%d</LENGTH>\n", tabs(level), get4B(f));
 		len -= 4;
 		for(; len >= 4; len -= 4)
-			fprintf(xml, "%s<ID>%d</ID>\n", tabs(level), get4B(f));
+			fprintf(psd_ctx->xml, "%s<ID>%d</ID>\n", tabs(level), get4B(f));
 	}
 }
 
 static void ir_digest(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml)
+	if(psd_ctx->xml)
 		while(len--)
-			fprintf(xml, "%02x", fgetc(f));
+			fprintf(psd_ctx->xml, "%02x", psd_fgetc(f));
 }
 
 static void ir_pixelaspect(psd_file_t f, int level, int len, struct dictentry *parent){
 	int v = get4B(f);
 	double ratio = getdoubleB(f);
-	if(xml) fprintf(xml, " <VERSION>%d</VERSION> <RATIO>%g</RATIO> ", v, ratio);
+	if(psd_ctx->xml) fprintf(psd_ctx->xml, " <VERSION>%d</VERSION> <RATIO>%g</RATIO> ", v, ratio);
 	UNQUIET("    (Version = %d, Ratio = %g)\n", v, ratio);
 }
 
 static void ir_unicodestr(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml) xml_unicodestr(f, get4B(f));
+	if(psd_ctx->xml) xml_unicodestr(f, get4B(f));
 }
 
 static void ir_unicodestrings(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml){
+	if(psd_ctx->xml){
 		int count;
 		for(; len >= 4; len -= 4 + 2*count){
 			count = get4B(f);
-			fprintf(xml, "%s<NAME>", tabs(level));
+			fprintf(psd_ctx->xml, "%s<NAME>", tabs(level));
 			xml_unicodestr(f, count);
-			fputs("</NAME>\n", xml);
+			fputs("</NAME>\n", psd_ctx->xml);
 		}
 	}
 }
@@ -156,34 +155,34 @@ static void ir_gridguides(psd_file_t f, int level, int len, struct dictentry *pa
 	const char *indent = tabs(level);
 	long v = get4B(f), gv = get4B(f), gh = get4B(f), i, n = get4B(f);
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%ld</VERSION>\n", indent, v);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%ld</VERSION>\n", indent, v);
 		// Note that these quantities are "document coordinates".
 		// This is not documented, but appears to mean fixed point with 5 fraction bits,
 		// so we divide by 32 to obtain pixel position.
-		fprintf(xml, "%s<GRIDCYCLE> <V>%g</V> <H>%g</H> </GRIDCYCLE>\n",
+		fprintf(psd_ctx->xml, "%s<GRIDCYCLE> <V>%g</V> <H>%g</H> </GRIDCYCLE>\n",
 				indent, gv/32., gh/32.);
-		fprintf(xml, "%s<GUIDES>\n", indent);
+		fprintf(psd_ctx->xml, "%s<GUIDES>\n", indent);
 		for(i = n; i--;){
 			long ord = get4B(f);
-			char c = fgetc(f) ? 'H' : 'V';
-			fprintf(xml, "%s\t<%cGUIDE>%g</%cGUIDE>\n", indent, c, ord/32., c);
+			char c = psd_fgetc(f) ? 'H' : 'V';
+			fprintf(psd_ctx->xml, "%s\t<%cGUIDE>%g</%cGUIDE>\n", indent, c, ord/32., c);
 		}
-		fprintf(xml, "%s</GUIDES>\n", indent);
+		fprintf(psd_ctx->xml, "%s</GUIDES>\n", indent);
 	}
 }
 
 static void ir_layersgroup(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml)
+	if(psd_ctx->xml)
 		for(; len >= 2; len -= 2)
-			fprintf(xml, "%s<GROUPID>%d</GROUPID>\n", tabs(level), get2B(f));
+			fprintf(psd_ctx->xml, "%s<GROUPID>%d</GROUPID>\n", tabs(level), get2B(f));
 }
 
 static void ir_layerselectionids(psd_file_t f, int level, int len, struct dictentry *parent){
 	int count = get2B(f);
-	if(xml)
+	if(psd_ctx->xml)
 		while(count--)
-			fprintf(xml, "%s<ID>%d</ID>\n", tabs(level), get4B(f));
+			fprintf(psd_ctx->xml, "%s<ID>%d</ID>\n", tabs(level), get4B(f));
 }
 
 static void ir_printflags(psd_file_t f, int level, int len, struct dictentry *parent){
@@ -191,20 +190,20 @@ static void ir_printflags(psd_file_t f, int level, int len, struct dictentry *pa
 		"LABELS", "CROPMARKS", "COLORBARS", "REGMARKS", "NEGATIVE",
 		"FLIP", "INTERPOLATE", "CAPTION", "PRINTFLAGS", NULL
 	};
-	if(xml){
+	if(psd_ctx->xml){
 		for(p = flags; *p; ++p)
-			fprintf(xml, "%s<%s>%d</%s>\n", indent, *p, fgetc(f), *p);
+			fprintf(psd_ctx->xml, "%s<%s>%d</%s>\n", indent, *p, psd_fgetc(f), *p);
 	}
 }
 
 static void ir_printflags10k(psd_file_t f, int level, int len, struct dictentry *parent){
 	const char *indent = tabs(level);
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, get2B(f));
-		fprintf(xml, "%s<CENTERCROPMARKS>%d</CENTERCROPMARKS>\n", indent, fgetc(f));
-		fgetc(f);
-		fprintf(xml, "%s<BLEEDWIDTH>%d</BLEEDWIDTH>\n", indent, get4B(f));
-		fprintf(xml, "%s<BLEEDWIDTHSCALE>%d</BLEEDWIDTHSCALE>\n", indent, get2B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, get2B(f));
+		fprintf(psd_ctx->xml, "%s<CENTERCROPMARKS>%d</CENTERCROPMARKS>\n", indent, psd_fgetc(f));
+		psd_fgetc(f);
+		fprintf(psd_ctx->xml, "%s<BLEEDWIDTH>%d</BLEEDWIDTH>\n", indent, get4B(f));
+		fprintf(psd_ctx->xml, "%s<BLEEDWIDTHSCALE>%d</BLEEDWIDTHSCALE>\n", indent, get2B(f));
 	}
 }
 
@@ -215,26 +214,26 @@ static void ir_colorsamplers(psd_file_t f, int level, int len, struct dictentry
 	int space;
 	struct colour_space *sp;
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%ld</VERSION>\n", indent, v);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%ld</VERSION>\n", indent, v);
 		while(n--){
-			fprintf(xml, "%s<SAMPLER>\n", indent);
+			fprintf(psd_ctx->xml, "%s<SAMPLER>\n", indent);
 			if(v >= 3)
-				fprintf(xml, "\t%s<VERSION>%d</VERSION>\n", indent, get2B(f)); // doc incorrectly says 4 byte
+				fprintf(psd_ctx->xml, "\t%s<VERSION>%d</VERSION>\n", indent, get2B(f)); // doc incorrectly says 4 byte
 			y.i = get4B(f);
 			x.i = get4B(f);
 			if(v == 1)
-				fprintf(xml, "\t%s<X>%g</X> <Y>%g</Y>\n", indent, x.i/32., y.i/32.); // undocumented fixed point factor
+				fprintf(psd_ctx->xml, "\t%s<X>%g</X> <Y>%g</Y>\n", indent, x.i/32., y.i/32.); // undocumented fixed point factor
 			else
-				fprintf(xml, "\t%s<X>%g</X> <Y>%g</Y>\n", indent, x.f, y.f);
+				fprintf(psd_ctx->xml, "\t%s<X>%g</X> <Y>%g</Y>\n", indent, x.f, y.f);
 			space = get2B(f);
 			if( (sp = find_colour_space(space)) )
-				fprintf(xml, "\t%s<COLORSPACE> <%s/> </COLORSPACE>\n", indent, sp->name);
+				fprintf(psd_ctx->xml, "\t%s<COLORSPACE> <%s/> </COLORSPACE>\n", indent, sp->name);
 			else
-				fprintf(xml, "\t%s<COLORSPACE>%d</COLORSPACE>\n", indent, space);
+				fprintf(psd_ctx->xml, "\t%s<COLORSPACE>%d</COLORSPACE>\n", indent, space);
 			if(v >= 2)
-				fprintf(xml, "\t%s<DEPTH>%d</DEPTH>\n", indent, get2B(f));
-			fprintf(xml, "%s</SAMPLER>\n", indent);
+				fprintf(psd_ctx->xml, "\t%s<DEPTH>%d</DEPTH>\n", indent, get2B(f));
+			fprintf(psd_ctx->xml, "%s</SAMPLER>\n", indent);
 		}
 	}
 }
@@ -245,38 +244,38 @@ static void displayinfo(int level, unsigned char data[]){
 	static const char *kind[] = {"ALPHACOLORSELECTED", "ALPHACOLORMASKED", "SPOTCHANNEL"};
 	const char *indent = tabs(level);
 
-	if(xml){
-		fprintf(xml, "%s<%s>\n", indent, kind[data[12]]);
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<%s>\n", indent, kind[data[12]]);
 		colorspace(level+1, peek2B(data), data+2);
-		fprintf(xml, "\t%s<OPACITY>%d</OPACITY>\n", indent, peek2B(data+10));
+		fprintf(psd_ctx->xml, "\t%s<OPACITY>%d</OPACITY>\n", indent, peek2B(data+10));
 		// kind values seem to be:
 		// 0 = alpha channel, colour indicates selected areas
 		// 1 = alpha channel, colour indicates masked areas
 		// 2 = spot colour channel
 		//fprintf(xml, "\t%s<KIND>%d</KIND>\n", indent, data[12]);
-		fprintf(xml, "%s</%s>\n", indent, kind[data[12]]);
+		fprintf(psd_ctx->xml, "%s</%s>\n", indent, kind[data[12]]);
 	}
 }
 
 static void ir_displayinfo(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml){
+	if(psd_ctx->xml){
 		for(; len >= 14; len -= 14){
 			unsigned char data[14];
-			fread(data, 1, 14, f);
+			psd_fread(data, 1, 14, f);
 			displayinfo(level, data);
 		}
 	}
 }
 
 static void ir_displayinfocs3(psd_file_t f, int level, int len, struct dictentry *parent){
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", tabs(level), get4B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", tabs(level), get4B(f));
 		len -= 4;
 		for(; len >= 13; len -= 13){
 			unsigned char data[13];
 			// it seems as if this resource doesn't use DisplayInfo padding
 			// (this divergence from API description isn't mentioned in File Format doc)
-			fread(data, 1, 13, f);
+			psd_fread(data, 1, 13, f);
 			displayinfo(level, data);
 		}
 	}
@@ -286,13 +285,13 @@ static void ir_altduotonecolors(psd_file_t f, int level, int len, struct dictent
 	const char *indent = tabs(level);
 	unsigned i;
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, get2B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, get2B(f));
 		for(i = get2B(f); i--;)
 			ed_colorspace(f, level, len, parent);
 		for(i = get2B(f); i--;){
-			int L = fgetc(f), a = fgetc(f), b = fgetc(f);
-			fprintf(xml, "%s<kLabSpace> <L>%d</L> <a>%d</a> <b>%d</b> </kLabSpace>\n",
+			int L = psd_fgetc(f), a = psd_fgetc(f), b = psd_fgetc(f);
+			fprintf(psd_ctx->xml, "%s<kLabSpace> <L>%d</L> <a>%d</a> <b>%d</b> </kLabSpace>\n",
 					indent, L, a, b);
 		}
 	}
@@ -302,13 +301,13 @@ static void ir_altspotcolors(psd_file_t f, int level, int len, struct dictentry
 	const char *indent = tabs(level);
 	unsigned i;
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, get2B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, get2B(f));
 		for(i = get2B(f); i--;){
-			fprintf(xml, "%s<CHANNEL>\n", indent);
-			fprintf(xml, "\t%s<ID>%d</ID>\n", indent, get4B(f));
+			fprintf(psd_ctx->xml, "%s<CHANNEL>\n", indent);
+			fprintf(psd_ctx->xml, "\t%s<ID>%d</ID>\n", indent, get4B(f));
 			ed_colorspace(f, level+1, len, parent);
-			fprintf(xml, "%s</CHANNEL>\n", indent);
+			fprintf(psd_ctx->xml, "%s</CHANNEL>\n", indent);
 		}
 	}
 }
@@ -317,60 +316,60 @@ static void ir_slices(psd_file_t f, int level, int len, struct dictentry *parent
 	const char *indent = tabs(level);
 	unsigned i, origin, version;
 
-	if(xml){
-		fprintf(xml, "%s<VERSION>%d</VERSION>\n", indent, version = get4B(f));
+	if(psd_ctx->xml){
+		fprintf(psd_ctx->xml, "%s<VERSION>%d</VERSION>\n", indent, version = get4B(f));
 
 		if(version == 6){
 			// TODO: Not tested, needs PS6...
-			fprintf(xml, "%s<BOUNDS>\n", indent);
-			fprintf(xml, "\t%s<TOP>%d</TOP>\n", indent, get4B(f));
-			fprintf(xml, "\t%s<LEFT>%d</LEFT>\n", indent, get4B(f));
-			fprintf(xml, "\t%s<BOTTOM>%d</BOTTOM>\n", indent, get4B(f));
-			fprintf(xml, "\t%s<RIGHT>%d</RIGHT>\n", indent, get4B(f));
-			fprintf(xml, "%s</BOUNDS>\n", indent);
-
-			fprintf(xml, "%s<NAME>", indent);
+			fprintf(psd_ctx->xml, "%s<BOUNDS>\n", indent);
+			fprintf(psd_ctx->xml, "\t%s<TOP>%d</TOP>\n", indent, get4B(f));
+			fprintf(psd_ctx->xml, "\t%s<LEFT>%d</LEFT>\n", indent, get4B(f));
+			fprintf(psd_ctx->xml, "\t%s<BOTTOM>%d</BOTTOM>\n", indent, get4B(f));
+			fprintf(psd_ctx->xml, "\t%s<RIGHT>%d</RIGHT>\n", indent, get4B(f));
+			fprintf(psd_ctx->xml, "%s</BOUNDS>\n", indent);
+
+			fprintf(psd_ctx->xml, "%s<NAME>", indent);
 			xml_unicodestr(f, get4B(f));
-			fputs("</NAME>\n", xml);
+			fputs("</NAME>\n", psd_ctx->xml);
 
 			for(i = get4B(f); i--;){
-				fprintf(xml, "%s<SLICE>\n", indent);
-				fprintf(xml, "\t%s<ID>%d</ID>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<GROUPID>%d</GROUPID>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<ORIGIN>%d</ORIGIN>\n", indent, origin = get4B(f));
+				fprintf(psd_ctx->xml, "%s<SLICE>\n", indent);
+				fprintf(psd_ctx->xml, "\t%s<ID>%d</ID>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<GROUPID>%d</GROUPID>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<ORIGIN>%d</ORIGIN>\n", indent, origin = get4B(f));
 				if(origin == 1)
-					fprintf(xml, "\t%s<ASSOCLAYERID>%d</ASSOCLAYERID>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<NAME>", indent);
+					fprintf(psd_ctx->xml, "\t%s<ASSOCLAYERID>%d</ASSOCLAYERID>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<NAME>", indent);
 				xml_unicodestr(f, get4B(f));
-				fputs("</NAME>\n", xml);
-				fprintf(xml, "\t%s<TYPE>%d</TYPE>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<LEFT>%d</LEFT>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<TOP>%d</TOP>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<RIGHT>%d</RIGHT>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<BOTTOM>%d</BOTTOM>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<URL>", indent);
+				fputs("</NAME>\n", psd_ctx->xml);
+				fprintf(psd_ctx->xml, "\t%s<TYPE>%d</TYPE>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<LEFT>%d</LEFT>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<TOP>%d</TOP>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<RIGHT>%d</RIGHT>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<BOTTOM>%d</BOTTOM>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<URL>", indent);
 				xml_unicodestr(f, get4B(f));
-				fputs("</URL>\n", xml);
-				fprintf(xml, "\t%s<TARGET>", indent);
+				fputs("</URL>\n", psd_ctx->xml);
+				fprintf(psd_ctx->xml, "\t%s<TARGET>", indent);
 				xml_unicodestr(f, get4B(f));
-				fputs("</TARGET>\n", xml);
-				fprintf(xml, "\t%s<MESSAGE>", indent);
+				fputs("</TARGET>\n", psd_ctx->xml);
+				fprintf(psd_ctx->xml, "\t%s<MESSAGE>", indent);
 				xml_unicodestr(f, get4B(f));
-				fputs("</MESSAGE>\n", xml);
-				fprintf(xml, "\t%s<ALT>", indent);
+				fputs("</MESSAGE>\n", psd_ctx->xml);
+				fprintf(psd_ctx->xml, "\t%s<ALT>", indent);
 				xml_unicodestr(f, get4B(f));
-				fputs("</ALT>\n", xml);
-				fprintf(xml, "\t%s<CELLTEXTISHTML>%d</CELLTEXTISHTML>\n", indent, fgetc(f));
-				fprintf(xml, "\t%s<CELLTEXT>", indent);
+				fputs("</ALT>\n", psd_ctx->xml);
+				fprintf(psd_ctx->xml, "\t%s<CELLTEXTISHTML>%d</CELLTEXTISHTML>\n", indent, psd_fgetc(f));
+				fprintf(psd_ctx->xml, "\t%s<CELLTEXT>", indent);
 				xml_unicodestr(f, get4B(f));
-				fputs("</CELLTEXT>\n", xml);
-				fprintf(xml, "\t%s<HALIGN>%d</HALIGN>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<VALIGN>%d</VALIGN>\n", indent, get4B(f));
-				fprintf(xml, "\t%s<ALPHACOLOR>%d</ALPHACOLOR>\n", indent, fgetc(f));
-				fprintf(xml, "\t%s<RED>%d</RED>\n", indent, fgetc(f));
-				fprintf(xml, "\t%s<GREEN>%d</GREEN>\n", indent, fgetc(f));
-				fprintf(xml, "\t%s<BLUE>%d</BLUE>\n", indent, fgetc(f));
-				fprintf(xml, "%s</SLICE>\n", indent);
+				fputs("</CELLTEXT>\n", psd_ctx->xml);
+				fprintf(psd_ctx->xml, "\t%s<HALIGN>%d</HALIGN>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<VALIGN>%d</VALIGN>\n", indent, get4B(f));
+				fprintf(psd_ctx->xml, "\t%s<ALPHACOLOR>%d</ALPHACOLOR>\n", indent, psd_fgetc(f));
+				fprintf(psd_ctx->xml, "\t%s<RED>%d</RED>\n", indent, psd_fgetc(f));
+				fprintf(psd_ctx->xml, "\t%s<GREEN>%d</GREEN>\n", indent, psd_fgetc(f));
+				fprintf(psd_ctx->xml, "\t%s<BLUE>%d</BLUE>\n", indent, psd_fgetc(f));
+				fprintf(psd_ctx->xml, "%s</SLICE>\n", indent);
 			}
 		}
 		else{
@@ -386,7 +385,7 @@ void ir_path(psd_file_t f, int level, int len, struct dictentry *parent){
 	const char *indent = tabs(level);
 	int subpath_count = 0;
 
-	if(xml)
+	if(psd_ctx->xml)
 		for(; len >= 26; len -= 26){
 			int i, sel = get2B(f), skip = 24;
 			double p[6];
@@ -397,8 +396,8 @@ void ir_path(psd_file_t f, int level, int len, struct dictentry *parent){
 				if(!subpath_count){
 					subpath_count = get2B(f);
 					skip -= 2;
-					fprintf(xml, "%s<SUBPATH>\n", indent);
-					fprintf(xml, "%s\t<%s/>\n", indent, sel ? "OPEN" : "CLOSED");
+					fprintf(psd_ctx->xml, "%s<SUBPATH>\n", indent);
+					fprintf(psd_ctx->xml, "%s\t<%s/>\n", indent, sel ? "OPEN" : "CLOSED");
 				}else
 					warn_msg("path resource: unexpected subpath record");
 				break;
@@ -410,46 +409,46 @@ void ir_path(psd_file_t f, int level, int len, struct dictentry *parent){
 					for(i = 0; i < 6; ++i)
 						p[i] = PATHFIX(get4B(f));
 					skip -= 24;
-					fprintf(xml, "%s\t<KNOT>\n", indent);
-					fprintf(xml, "%s\t\t<%sLINKED/>\n", indent,
+					fprintf(psd_ctx->xml, "%s\t<KNOT>\n", indent);
+					fprintf(psd_ctx->xml, "%s\t\t<%sLINKED/>\n", indent,
 							sel == 1 || sel == 4 ? "" : "UN");
-					fprintf(xml, "%s\t\t<IN><V>%.9f</V><H>%.9f</H></IN>\n",
+					fprintf(psd_ctx->xml, "%s\t\t<IN><V>%.9f</V><H>%.9f</H></IN>\n",
 							indent, p[0], p[1]);
-					fprintf(xml, "%s\t\t<ANCHOR><V>%.9f</V><H>%.9f</H></ANCHOR>\n",
+					fprintf(psd_ctx->xml, "%s\t\t<ANCHOR><V>%.9f</V><H>%.9f</H></ANCHOR>\n",
 							indent, p[2], p[3]);
-					fprintf(xml, "%s\t\t<OUT><V>%.9f</V><H>%.9f</H></OUT>\n",
+					fprintf(psd_ctx->xml, "%s\t\t<OUT><V>%.9f</V><H>%.9f</H></OUT>\n",
 							indent, p[4], p[5]);
-					fprintf(xml, "%s\t</KNOT>\n", indent);
+					fprintf(psd_ctx->xml, "%s\t</KNOT>\n", indent);
 					--subpath_count;
 					if(!subpath_count)
-						fprintf(xml, "%s</SUBPATH>\n", indent);
+						fprintf(psd_ctx->xml, "%s</SUBPATH>\n", indent);
 				}else
 					warn_msg("path resource: unexpected knot record");
 				break;
 			case 6: // path fill rule record
-				fprintf(xml, "%s<PATHFILLRULE/>\n", indent);
+				fprintf(psd_ctx->xml, "%s<PATHFILLRULE/>\n", indent);
 				break;
 			case 7: // clipboard record
-				fprintf(xml, "%s<CLIPBOARD>\n", indent);
-				fprintf(xml, "%s\t<BOUNDS>\n", indent);
-				fprintf(xml, "%s\t\t<TOP>%.9f</TOP>\n", indent, PATHFIX(get4B(f)));
-				fprintf(xml, "%s\t\t<LEFT>%.9f</LEFT>\n", indent, PATHFIX(get4B(f)));
-				fprintf(xml, "%s\t\t<BOTTOM>%.9f</BOTTOM>\n", indent, PATHFIX(get4B(f)));
-				fprintf(xml, "%s\t\t<RIGHT>%.9f</RIGHT>\n", indent, PATHFIX(get4B(f)));
-				fprintf(xml, "%s\t</BOUNDS>\n", indent);
-				fprintf(xml, "%s\t<RESOLUTION>%.9f</RESOLUTION>\n", indent, PATHFIX(get4B(f)));
-				fprintf(xml, "%s</CLIPBOARD>\n", indent);
+				fprintf(psd_ctx->xml, "%s<CLIPBOARD>\n", indent);
+				fprintf(psd_ctx->xml, "%s\t<BOUNDS>\n", indent);
+				fprintf(psd_ctx->xml, "%s\t\t<TOP>%.9f</TOP>\n", indent, PATHFIX(get4B(f)));
+				fprintf(psd_ctx->xml, "%s\t\t<LEFT>%.9f</LEFT>\n", indent, PATHFIX(get4B(f)));
+				fprintf(psd_ctx->xml, "%s\t\t<BOTTOM>%.9f</BOTTOM>\n", indent, PATHFIX(get4B(f)));
+				fprintf(psd_ctx->xml, "%s\t\t<RIGHT>%.9f</RIGHT>\n", indent, PATHFIX(get4B(f)));
+				fprintf(psd_ctx->xml, "%s\t</BOUNDS>\n", indent);
+				fprintf(psd_ctx->xml, "%s\t<RESOLUTION>%.9f</RESOLUTION>\n", indent, PATHFIX(get4B(f)));
+				fprintf(psd_ctx->xml, "%s</CLIPBOARD>\n", indent);
 				skip -= 20;
 				break;
 			case 8: // initial fill rule record
-				fprintf(xml, "%s<INITIALFILL>%d</INITIALFILL>\n", indent, get2B(f));
+				fprintf(psd_ctx->xml, "%s<INITIALFILL>%d</INITIALFILL>\n", indent, get2B(f));
 				skip -= 2;
 				break;
 			default:
 				warn_msg("path resource: unexpected record selector");
 			}
 			if(skip)
-				fseeko(f, skip, SEEK_CUR);
+				psd_fseeko(f, skip, SEEK_CUR);
 		}
 }
 
@@ -574,16 +573,16 @@ static long doirb(psd_file_t f){
 	size_t padded_size;
 	struct dictentry *d;
 
-	fread(type, 1, 4, f);
+	psd_fread(type, 1, 4, f);
 	id = get2B(f);
-	namelen = fgetc(f);
-	fread(name, 1, PAD2(1+namelen)-1, f);
+	namelen = psd_fgetc(f);
+	psd_fread(name, 1, PAD2(1+namelen)-1, f);
 	name[namelen] = 0;
 	size = get4B(f);
 	padded_size = PAD2(size);
 
 	d = findbyid(id);
-	if((verbose || print_rsrc || resdump) && !xmlout){
+	if((psd_ctx->verbose || print_rsrc || resdump) && !xmlout){
 		printf("  resource '%c%c%c%c' (%5d,\"%s\"):%5ld bytes",
 			   type[0],type[1],type[2],type[3], id, name, size);
 		if(d)
@@ -592,34 +591,34 @@ static long doirb(psd_file_t f){
 	}
 
 	if(d && d->tag){
-		if(xml){
-			fprintf(xml, "\t<RESOURCE TYPE='%c%c%c%c' ID='%d'",
+		if(psd_ctx->xml){
+			fprintf(psd_ctx->xml, "\t<RESOURCE TYPE='%c%c%c%c' ID='%d'",
 					type[0],type[1],type[2],type[3], id);
 			if(namelen)
-				fprintf(xml, " NAME='%s'", name);
+				fprintf(psd_ctx->xml, " NAME='%s'", name);
 		}
 		if(d->func){
-			if(xml) fputs(">\n", xml);
+			if(psd_ctx->xml) fputs(">\n", psd_ctx->xml);
 
 			entertag(f, 2, size, &resource, d, 1);
 
-			if(xml) fputs("\t</RESOURCE>\n\n", xml);
+			if(psd_ctx->xml) fputs("\t</RESOURCE>\n\n", psd_ctx->xml);
 		}
-		else if(xml){
-			fputs(" /> <!-- not parsed -->\n", xml);
+		else if(psd_ctx->xml){
+			fputs(" /> <!-- not parsed -->\n", psd_ctx->xml);
 		}
 	}
 
 	if(resdump){
 		char *temp_buf = checkmalloc(padded_size);
-		if(fread(temp_buf, 1, padded_size, f) < padded_size)
+		if(psd_fread(temp_buf, 1, padded_size, f) < padded_size)
 			fatal("did not read expected bytes in image resource\n");
 		dumphex((unsigned char*)temp_buf, size);
 		putchar('\n');
 		free(temp_buf);
 	}
 	else
-		fseeko(f, padded_size, SEEK_CUR); // skip resource block data
+		psd_fseeko(f, padded_size, SEEK_CUR); // skip resource block data
 
 	return 4+2+PAD2(1+namelen)+4+padded_size; /* returns total bytes in block */
 }
@@ -632,3 +631,103 @@ void doimageresources(psd_file_t f){
 	if(len != 0)
 		warn_msg("image resources overran expected size by %d bytes\n", -len);
 }
+
+// Find image resource 'id', reading only the resource block headers
+// (the file must be positioned at the image resources section).
+// Returns the file position of the resource's data, and its size in *size,
+// or zero if there is no such resource.
+
+psd_bytes_t findresource(psd_file_t f, int id, long *size){
+	char type[4];
+	int blockid, namelen;
+	long len = get4B(f);
+	psd_bytes_t pos;
+
+	while(len > 0){
+		psd_fread(type, 1, 4, f);
+		blockid = get2B(f);
+		namelen = psd_fgetc(f);
+		psd_fseeko(f, PAD2(1+namelen)-1, SEEK_CUR);
+		*size = get4B(f);
+		if(psd_feof(f) || *size < 0)
+			break;
+		pos = psd_ftello(f);
+		if(blockid == id)
+			return pos;
+		psd_fseeko(f, pos + PAD2(*size), SEEK_SET);
+		len -= 4+2+PAD2(1+namelen)+4+PAD2(*size);
+	}
+	return 0;
+}
+
+// Write the JPEG thumbnail that Photoshop keeps in the image resources
+// (--thumbnail), without reading any layer or image data.
+// The thumbnail resource begins with a 28 byte header, then the JFIF data.
+// Returns zero if there was no usable thumbnail.
+
+int writethumbnail(struct psd_context *ctx, psd_file_t f, char *psdpath, char *name){
+	char sig[4], fname[PATH_MAX];
+	unsigned char buf[0x10000], *p;
+	long size, n, format, width, height;
+	psd_bytes_t pos, resourcepos;
+	FILE *out;
+	int id, version;
+
+	psd_fread(sig, 1, 4, f);
+	version = get2Bu(f);
+	psd_fseeko(f, 26, SEEK_SET); // rest of the file header
+	if(psd_feof(f) || !KEYMATCH(sig, "8BPS") || version < 1 || version > 2){
+		alwayswarn("# \"%s\": couldn't read header, or is not a PSD/PSB\n", psdpath);
+		return 0;
+	}
+	skipblock(f, "color mode data");
+
+	// prefer the Photoshop 5.0 (RGB) thumbnail to the 4.0 one (BGR)
+	resourcepos = psd_ftello(f);
+	for(id = 1036; id >= 1033; id -= 3){
+		psd_fseeko(f, resourcepos, SEEK_SET);
+		if( (pos = findresource(f, id, &size)) && size > 28)
+			break;
+	}
+	if(id < 1033){
+		alwayswarn("# \"%s\": no thumbnail resource\n", psdpath);
+		return 0;
+	}
+
+	psd_fseeko(f, pos, SEEK_SET);
+	format = get4B(f);
+	width = get4B(f);
+	height = get4B(f);
+	if(format != 1){ // kJpegRGB
+		alwayswarn("# \"%s\": thumbnail isn't JPEG (format %ld), not writing it\n", psdpath, format);
+		return 0;
+	}
+
+	setoutdir(ctx, psdpath, "_png");
+	setupfile(fname, ctx->pngdir, name, ".thumb.jpg");
+	if( !(out = fopen(fname, "wb")) ){
+		alwayswarn("### can't open \"%s\" for writing\n", fname);
+		return 0;
+	}
+	UNQUIET("# writing thumbnail \"%s\" (%ld x %ld)\n", fname, width, height);
+	if(id == 1033)
+		UNQUIET("# (Photoshop 4.0 thumbnail, red and blue are swapped)\n");
+
+	// straight from the mapped file if possible, no copy
+	pos += 28;
+	size -= 28;
+	if( (p = psd_mapped(f, pos, size)) )
+		fwrite(p, 1, size, out);
+	else
+		for(; size; size -= n, pos += n){
+			n = size < (long)sizeof(buf) ? size : (long)sizeof(buf);
+			if((long)psd_pread(f, buf, n, pos) < n){
+				warn_msg("thumbnail data short");
+				break;
+			}
+			fwrite(buf, 1, n, out);
+		}
+	if(fclose(out))
+		alwayswarn("### error writing \"%s\"\n", fname);
+	return 1;
+}
@@ -20,10 +20,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#ifdef HAVE_ZLIB_H
-	#include "zlib.h"
-#endif
-
 #include "psdparse.h"
 
 extern struct dictentry bmdict[];
@@ -169,29 +165,7 @@ for --mergedrows, --mergedcols, --mergedchan, --depth and --mode.\n");
 size_t try_inflate(unsigned char *src_buf, size_t src_len,
 				   unsigned char *dst_buf, size_t dst_len)
 {
-#ifdef HAVE_ZLIB_H
-	z_stream stream;
-	int state;
-
-	memset(&stream, 0, sizeof(z_stream));
-	stream.data_type = Z_BINARY;
-
-	stream.next_in = src_buf;
-	stream.avail_in = src_len;
-	stream.next_out = dst_buf;
-	stream.avail_out = dst_len;
-
-	if(inflateInit(&stream) == Z_OK) {
-		do {
-			state = inflate(&stream, Z_FINISH);
-			//fprintf(stderr,"inflate: state=%d next_in=%p avail_in=%d next_out=%p avail_out=%d\n",
-			//		state, stream.next_in, stream.avail_in, stream.next_out, stream.avail_out);
-			if(state == Z_STREAM_END)
-				return stream.next_in - src_buf;
-		}  while (state == Z_OK && stream.avail_out > 0 && stream.avail_in > 0);
-	}
-#endif
-	return 0;
+	return psd_inflate(src_buf, src_len, dst_buf, dst_len, NULL);
 }
 
 // For each layer we know about, search for possible channel data
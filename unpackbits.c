@@ -21,14 +21,120 @@
 
 #include "psdparse.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define UNPACK_SIMD
+	#include <immintrin.h>
+#endif
+
+#ifdef UNPACK_SIMD
+
+// Vector decoders. These run only while there is room in both buffers for
+// the longest possible run or literal (128 bytes), so no checks are needed:
+// whole vectors are stored, which may write past the end of a run but never
+// past outlen, and the excess is overwritten by the data that follows.
+// Whatever remains is left for the careful loop in unpackbits().
+// Return the count of bytes output, and advance *inp and *inlen.
+
+__attribute__((target("sse2")))
+static psd_pixels_t unpack_sse2(unsigned char *outp, unsigned char **inp,
+								psd_pixels_t outlen, psd_pixels_t *inlen)
+{
+	unsigned char *p = *inp, *end = p + *inlen, *q = outp, *qend = outp + outlen;
+	unsigned len, k;
+	__m128i v;
+
+	while(qend - q >= 128 && end - p >= 130){
+		len = *p++;
+		if(len > 128){
+			len = 257 - len;
+			v = _mm_set1_epi8(*p++);
+			for(k = 0; k < len; k += 16)
+				_mm_storeu_si128((__m128i*)(q + k), v);
+			q += len;
+		}else if(len < 128){
+			++len;
+			for(k = 0; k < len; k += 16)
+				_mm_storeu_si128((__m128i*)(q + k), _mm_loadu_si128((__m128i*)(p + k)));
+			p += len;
+			q += len;
+		}
+	}
+	*inlen = end - p;
+	*inp = p;
+	return q - outp;
+}
+
+__attribute__((target("avx2")))
+static psd_pixels_t unpack_avx2(unsigned char *outp, unsigned char **inp,
+								psd_pixels_t outlen, psd_pixels_t *inlen)
+{
+	unsigned char *p = *inp, *end = p + *inlen, *q = outp, *qend = outp + outlen;
+	unsigned len, k;
+	__m256i v;
+
+	while(qend - q >= 128 && end - p >= 130){
+		len = *p++;
+		if(len > 128){
+			len = 257 - len;
+			v = _mm256_set1_epi8(*p++);
+			for(k = 0; k < len; k += 32)
+				_mm256_storeu_si256((__m256i*)(q + k), v);
+			q += len;
+		}else if(len < 128){
+			++len;
+			for(k = 0; k < len; k += 32)
+				_mm256_storeu_si256((__m256i*)(q + k), _mm256_loadu_si256((__m256i*)(p + k)));
+			p += len;
+			q += len;
+		}
+	}
+	*inlen = end - p;
+	*inp = p;
+	return q - outp;
+}
+
+static psd_pixels_t unpack_none(unsigned char *outp, unsigned char **inp,
+								psd_pixels_t outlen, psd_pixels_t *inlen)
+{
+	return 0;
+}
+
+// Choose the best decoder the CPU supports. This runs once, when the
+// program (or library) is loaded, before any threads can be started.
+
+static psd_pixels_t (*unpack_fast)(unsigned char *, unsigned char **,
+								   psd_pixels_t, psd_pixels_t *) = unpack_none;
+
+__attribute__((constructor)) static void unpack_select(void){
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		unpack_fast = unpack_avx2;
+	else if(__builtin_cpu_supports("sse2"))
+		unpack_fast = unpack_sse2;
+	else
+		unpack_fast = unpack_none;
+}
+
+#endif
+
+// Decode PackBits data from inp (inlen bytes) to outp, stopping after
+// outlen bytes. Returns the count of bytes decoded; anything in outp
+// after that is undefined (see readunpackrow()).
+
 psd_pixels_t unpackbits(unsigned char *outp, unsigned char *inp,
 						psd_pixels_t outlen, psd_pixels_t inlen)
 {
 	psd_pixels_t i, len;
 	int val;
 
+	i = 0;
+#ifdef UNPACK_SIMD
+	i = unpack_fast(outp, &inp, outlen, &inlen);
+	outp += i;
+#endif
+
 	/* i counts output bytes; outlen = expected output size */
-	for(i = 0; inlen > 1 && i < outlen;){
+	for(; inlen > 1 && i < outlen;){
 		/* get flag byte */
 		len = *inp++;
 		--inlen;
@@ -73,3 +179,74 @@ psd_pixels_t unpackbits(unsigned char *outp, unsigned char *inp,
 		warn_msg("not enough RLE data for row");
 	return i;
 }
+
+// Store the part of the output in [skip, skip+n) that a run or literal
+// covering [pos, pos+len) contributes (src is NULL for a run of val).
+
+static void window_put(unsigned char *outp, psd_pixels_t skip, psd_pixels_t n,
+					   psd_pixels_t pos, psd_pixels_t len, unsigned char *src, int val)
+{
+	psd_pixels_t a = pos > skip ? pos : skip,
+				 b = pos + len < skip + n ? pos + len : skip + n;
+
+	if(a < b){
+		if(src)
+			memcpy(outp + (a - skip), src + (a - pos), b - a);
+		else
+			memset(outp + (a - skip), val, b - a);
+	}
+}
+
+// As unpackbits(), for a row of rowbytes bytes of which only bytes
+// skip..skip+n-1 are wanted (stored at outp). Runs to the left of the
+// window are stepped over without being expanded, and decoding stops
+// at its right edge. Damaged data gives the same bytes as unpackbits()
+// would. Returns the count of bytes decoded into outp.
+
+psd_pixels_t unpackbits_window(unsigned char *outp, unsigned char *inp, psd_pixels_t rowbytes,
+							   psd_pixels_t skip, psd_pixels_t n, psd_pixels_t inlen)
+{
+	psd_pixels_t i, len, end = skip + n;
+	int val;
+
+	/* i counts output bytes, as in unpackbits() */
+	for(i = 0; inlen > 1 && i < end;){
+		len = *inp++;
+		--inlen;
+
+		if(len == 128) /* ignore this flag value */
+			;
+		else{
+			if(len > 128){
+				len = 1+256-len;
+				val = *inp++;
+				--inlen;
+
+				if((i+len) <= rowbytes)
+					window_put(outp, skip, n, i, len, NULL, val);
+				else{
+					window_put(outp, skip, n, i, rowbytes-i, NULL, val);
+					warn_msg("unpacked RLE data would overflow row (run)");
+					len = 0;
+				}
+			}else{
+				++len;
+				if((i+len) <= rowbytes){
+					if(len > inlen)
+						break; // abort - ran out of input data
+					window_put(outp, skip, n, i, len, inp, 0);
+					inp += len;
+					inlen -= len;
+				}else{
+					window_put(outp, skip, n, i, rowbytes-i, inp, 0);
+					warn_msg("unpacked RLE data would overflow row (copy)");
+					len = 0;
+				}
+			}
+			i += len;
+		}
+	}
+	if(i < end)
+		warn_msg("not enough RLE data for row");
+	return i <= skip ? 0 : (i < end ? i : end) - skip;
+}
@@ -24,11 +24,14 @@
 #include "psdparse.h"
 #include "version.h"
 
+#ifdef HAVE_PREAD
+	#include <unistd.h>
+#endif
+
 #define WARNLIMIT 10
 
-#ifdef HAVE_ICONV_H
-	iconv_t ic = (iconv_t)-1;
-#endif
+// the context of the document being parsed by this thread
+THREAD_LOCAL struct psd_context *psd_ctx = NULL;
 
 void fatal(char *s){
 	fflush(stdout);
@@ -38,19 +41,19 @@ void fatal(char *s){
 	// caller must be prepared for this function to return, of course
 	pl_fatal(s);
 #else
+	if(psd_ctx && psd_ctx->onfatal)
+		psd_ctx->onfatal(psd_ctx);
 	exit(EXIT_FAILURE);
 #endif
 }
 
-int nwarns = 0;
-
 void warn_msg(char *fmt, ...){
 	char s[0x200];
 	va_list v;
 
-	if(nwarns == WARNLIMIT) fputs("#   (further warnings suppressed)\n", stderr);
-	++nwarns;
-	if(nwarns <= WARNLIMIT){
+	if(psd_ctx->nwarns == WARNLIMIT) fputs("#   (further warnings suppressed)\n", stderr);
+	++psd_ctx->nwarns;
+	if(psd_ctx->nwarns <= WARNLIMIT){
 		va_start(v, fmt);
 		vsnprintf(s, 0x200, fmt, v);
 		va_end(v);
@@ -77,8 +80,9 @@ void *ckmalloc(size_t n, char *file, int line){
 		return p;
 	}
 	else{
-		fprintf(stderr, "can't get %ld bytes @ %s:%d\n", n, file, line);
-		exit(1);
+		char s[0x200];
+		snprintf(s, sizeof(s), "can't get %ld bytes @ %s:%d\n", (long)n, file, line);
+		fatal(s);
 	}
 	return NULL;
 }
@@ -121,14 +125,159 @@ void fwritexml(char *buf, size_t count, FILE *f){
 		fputcxml(*buf++, f);
 }
 
+#ifndef PSDPARSE_PLUGIN
+
+// Input file access. psd_fopen() memory-maps the file where possible,
+// and the psd_f*() functions then read directly from the mapped region.
+// Files that can't be mapped (pipes, or too large for the address space)
+// are read through stdio as before.
+
+psd_file_t psd_fopen(char *path){
+	psd_file_t f;
+	FILE *fp;
+#ifdef CAN_MMAP
+	struct stat sb;
+#endif
+
+	if( !(fp = fopen(path, "rb")) )
+		return NULL;
+
+	f = checkmalloc(sizeof(struct psd_file));
+	f->fp = fp;
+	f->addr = NULL;
+	f->size = f->pos = 0;
+	f->eof = 0;
+
+#ifdef CAN_MMAP
+	if(fstat(fileno(fp), &sb) == 0 && (sb.st_mode & S_IFMT) == S_IFREG
+	   && sb.st_size > 0 && (uint64_t)sb.st_size <= (size_t)-1)
+	{
+		if( (f->addr = map_file(fileno(fp), sb.st_size)) )
+			f->size = sb.st_size;
+		else{
+			VERBOSE("# mmap() failed (errno = %d), reading via stdio\n", errno);
+			unmap_file(NULL, 0); // needed for Windows cleanup
+		}
+	}
+#endif
+	return f;
+}
+
+void psd_fclose(psd_file_t f){
+#ifdef CAN_MMAP
+	if(f->addr)
+		unmap_file(f->addr, f->size);
+#endif
+	fclose(f->fp);
+	free(f);
+}
+
+int psd_fgetc(psd_file_t f){
+	if(f->addr){
+		if(f->pos < f->size)
+			return f->addr[f->pos++];
+		f->eof = 1;
+		return EOF;
+	}
+	return fgetc(f->fp);
+}
+
+size_t psd_fread(void *ptr, size_t s, size_t n, psd_file_t f){
+	psd_bytes_t count, avail;
+
+	if(f->addr){
+		count = (psd_bytes_t)s*n;
+		avail = f->pos < f->size ? f->size - f->pos : 0;
+		if(count > avail){
+			count = avail;
+			f->eof = 1;
+		}
+		memcpy(ptr, f->addr + f->pos, count);
+		f->pos += count;
+		return s ? count/s : 0;
+	}
+	return fread(ptr, s, n, f->fp);
+}
+
+int psd_fseeko(psd_file_t f, off_t pos, int wh){
+	if(f->addr){
+		switch(wh){
+		case SEEK_SET: break;
+		case SEEK_CUR: pos += f->pos; break;
+		case SEEK_END: pos += f->size; break;
+		default: return -1;
+		}
+		if(pos < 0)
+			return -1;
+		f->pos = pos;
+		f->eof = 0;
+		return 0;
+	}
+	return fseeko(f->fp, pos, wh);
+}
+
+off_t psd_ftello(psd_file_t f){
+	return f->addr ? (off_t)f->pos : ftello(f->fp);
+}
+
+int psd_feof(psd_file_t f){
+	return f->addr ? f->eof : feof(f->fp);
+}
+
+// Return a pointer to n bytes of mapped file data at pos,
+// or NULL if the file isn't mapped or the range is out of bounds.
+// This does not move the read cursor.
+unsigned char *psd_mapped(psd_file_t f, psd_bytes_t pos, psd_bytes_t n){
+	return f->addr && pos <= f->size && n <= f->size - pos ? f->addr + pos : NULL;
+}
+
+#endif
+
+// Read n bytes at file offset pos, independently of the read cursor.
+// Unlike seek+read, this is safe to call from several threads at once
+// (except in the plugin build, and where pread() isn't available).
+// Returns the number of bytes read.
+
+size_t psd_pread(psd_file_t f, void *buf, size_t n, psd_bytes_t pos){
+#ifdef PSDPARSE_PLUGIN
+	return pl_fseeko(f, pos, SEEK_SET) == -1 ? 0 : pl_fread(buf, 1, n, f);
+#else
+	size_t done;
+
+	if(f->addr){
+		if(pos >= f->size)
+			return 0;
+		if(n > f->size - pos)
+			n = f->size - pos;
+		memcpy(buf, f->addr + pos, n);
+		return n;
+	}
+#ifdef HAVE_PREAD
+	for(done = 0; done < n;){
+		ssize_t cnt = pread(fileno(f->fp), (char*)buf + done, n - done, pos + done);
+		if(cnt <= 0){
+			if(cnt == -1 && errno == EINTR)
+				continue;
+			break;
+		}
+		done += cnt;
+	}
+#else
+	// no positional read available; this moves the stream position
+	done = fseeko(f->fp, pos, SEEK_SET) == -1 ? 0 : fread(buf, 1, n, f->fp);
+#endif
+	return done;
+#endif
+}
+
 // fetch Pascal string (length byte followed by text)
 // N.B. This returns a pointer to the string as a C string (no length
-//      byte, and terminated by NUL).
+//      byte, and terminated by NUL), in a buffer private to the thread.
 char *getpstr(psd_file_t f){
-	static char pstr[0x100];
-	int len = fgetc(f);
+	static THREAD_LOCAL char pstr[0x100];
+	int len = psd_fgetc(f);
 	if(len != EOF){
-		fread(pstr, 1, len, f);
+		psd_fread(pstr, 1, len, f);
 		pstr[len] = 0;
 	}else
 		pstr[0] = 0;
@@ -137,21 +286,21 @@ char *getpstr(psd_file_t f){
 
 // Pascal string, padded to multiple of 2 bytes
 char *getpstr2(psd_file_t f){
-	static char pstr[0x100];
-	int len = fgetc(f);
+	static THREAD_LOCAL char pstr[0x100];
+	int len = psd_fgetc(f);
 	if(len != EOF){
-		fread(pstr, 1, len, f);
+		psd_fread(pstr, 1, len, f);
 		pstr[len] = 0;
 		if(!(len & 1))
-			fgetc(f); // skip padding
+			psd_fgetc(f); // skip padding
 	}else
 		pstr[0] = 0;
 	return pstr;
 }
 
 char *getkey(psd_file_t f){
-	static char k[5];
-	if(fread(k, 1, 4, f) == 4)
+	static THREAD_LOCAL char k[5];
+	if(psd_fread(k, 1, 4, f) == 4)
 		k[4] = 0;
 	else
 		k[0] = 0; // or return NULL?
@@ -170,7 +319,7 @@ double getdoubleB(psd_file_t f){
 		unsigned char c[8];
 	} u, urev;
 
-	if(fread(u.c, 1, 8, f) == 8){
+	if(psd_fread(u.c, 1, 8, f) == 8){
 		if(platform_is_LittleEndian()){
 			urev.c[0] = u.c[7];
 			urev.c[1] = u.c[6];
@@ -191,10 +340,18 @@ double getdoubleB(psd_file_t f){
 // Read a 4-byte signed binary value in BigEndian format.
 // Assumes sizeof(long) == 4 (and two's complement CPU :)
 int32_t get4B(psd_file_t f){
-	long n = fgetc(f)<<24;
-	n |= fgetc(f)<<16;
-	n |= fgetc(f)<<8;
-	return n | fgetc(f);
+	long n;
+
+#ifndef PSDPARSE_PLUGIN
+	if(f->addr && f->pos + 4 <= f->size){
+		f->pos += 4;
+		return peek4B(f->addr + f->pos - 4);
+	}
+#endif
+	n = psd_fgetc(f)<<24;
+	n |= psd_fgetc(f)<<16;
+	n |= psd_fgetc(f)<<8;
+	return n | psd_fgetc(f);
 }
 
 #ifndef __SC__ // MPW 68K compiler does not support long long
@@ -208,36 +365,52 @@ int64_t get8B(psd_file_t f){
 
 // Read a 2-byte signed binary value in BigEndian format.
 int get2B(psd_file_t f){
-	unsigned n = fgetc(f)<<8;
-	n |= fgetc(f);
+	unsigned n;
+
+#ifndef PSDPARSE_PLUGIN
+	if(f->addr && f->pos + 2 <= f->size){
+		f->pos += 2;
+		return peek2B(f->addr + f->pos - 2);
+	}
+#endif
+	n = psd_fgetc(f)<<8;
+	n |= psd_fgetc(f);
 	return n < 0x8000 ? n : n - 0x10000;
 }
 
 // Read a 2-byte unsigned binary value in BigEndian format.
 unsigned get2Bu(psd_file_t f){
-	unsigned n = fgetc(f)<<8;
-	return n |= fgetc(f);
+	unsigned n;
+
+#ifndef PSDPARSE_PLUGIN
+	if(f->addr && f->pos + 2 <= f->size){
+		f->pos += 2;
+		return peek2Bu(f->addr + f->pos - 2);
+	}
+#endif
+	n = psd_fgetc(f)<<8;
+	return n |= psd_fgetc(f);
 }
 
 
-unsigned put4B(psd_file_t f, int32_t value){
+unsigned put4B(FILE *f, int32_t value){
 	return fputc(value >> 24, f) != EOF
 		&& fputc(value >> 16, f) != EOF
 		&& fputc(value >>  8, f) != EOF
 		&& fputc(value, f) != EOF;
 }
 
-unsigned put8B(psd_file_t f, int64_t value){
+unsigned put8B(FILE *f, int64_t value){
 	return put4B(f, value >> 32) && put4B(f, value);
 }
 
-unsigned putpsdbytes(psd_file_t f, int version, uint64_t value){
+unsigned putpsdbytes(FILE *f, int version, uint64_t value){
 	if(version == 1 && value > UINT32_MAX)
 		fatal("## Value out of range for PSD format. Try without --rebuildpsd.\n");
 	return version == 1 ? put4B(f, value) : put8B(f, value);
 }
 
-unsigned put2B(psd_file_t f, int value){
+unsigned put2B(FILE *f, int value){
 	return fputc(value >> 8, f) != EOF
 		&& fputc(value, f) != EOF;
 }
@@ -281,54 +454,85 @@ int hexdigit(unsigned char c){
 	return c - (c >= 'A' ? 'A'-10 : '0');
 }
 
-char indir[PATH_MAX];
-FILE *rebuilt_psd;
+// Set up a context for parsing one document, according to the options,
+// and make it the calling thread's current context.
+// Free it with psd_context_free() when the document is done.
+
+void psd_context_init(struct psd_context *ctx){
+	memset(ctx, 0, sizeof(struct psd_context));
+	ctx->verbose = verbose;
+	ctx->quiet = quiet;
+	ctx->split = split;
+	ctx->additional = extra || unicode_filenames;
+	// output goes to the directory named after the document, unless --pngdir
+	ctx->pngdir = pngdir ? pngdir : ctx->indir;
+#ifdef HAVE_ICONV_H
+	ctx->ic = iconv_open("UTF-8", "UTF-16BE");
+	if(ctx->ic == (iconv_t)-1)
+		alwayswarn("iconv_open(): failed, errno = %d\n", errno);
+#endif
+	psd_ctx = ctx;
+}
 
-void openfiles(char *psdpath, struct psd_header *h)
-{
-	char *ext, fname[PATH_MAX], *dirsuffix;
+// Release a context's resources. Its output files must already be closed.
+
+void psd_context_free(struct psd_context *ctx){
+#ifdef HAVE_ICONV_H
+	if(ctx->ic != (iconv_t)-1)
+		iconv_close(ctx->ic);
+#endif
+	free(ctx->queue);
+	ctx->queue = NULL;
+	if(psd_ctx == ctx)
+		psd_ctx = NULL;
+}
 
-	strcpy(indir, psdpath);
-	dirsuffix = h->depth < 32 ? "_png" : "_raw";
-	if( (ext = strrchr(indir, '.')) )
+// Name the default output directory after the document
+// (e.g. foo.psd -> foo_png).
+
+void setoutdir(struct psd_context *ctx, char *psdpath, char *dirsuffix){
+	char *ext;
+
+	strcpy(ctx->indir, psdpath);
+	if( (ext = strrchr(ctx->indir, '.')) )
 		strcpy(ext, dirsuffix);
 	else
-		strcat(indir, dirsuffix);
+		strcat(ctx->indir, dirsuffix);
+}
+
+void openfiles(struct psd_context *ctx, char *psdpath, struct psd_header *h)
+{
+	char fname[PATH_MAX];
+
+	setoutdir(ctx, psdpath, h->depth < 32 ? "_png" : "_raw");
 
 	if(writelist){
-		setupfile(fname, pngdir, "list", ".txt");
-		listfile = fopen(fname, "w");
+		setupfile(fname, ctx->pngdir, "list", ".txt");
+		ctx->listfile = fopen(fname, "w");
 	}else{
-		listfile = NULL;
+		ctx->listfile = NULL;
 	}
 
-	if(rebuild){
+	if(rebuild || rebuild_v1){
 		char *basename = strrchr(psdpath, DIRSEP);
-		setupfile(fname, pngdir, basename ? basename : psdpath, "-rebuilt.psd");
-		rebuilt_psd = fopen(fname, "w");
+		setupfile(fname, ctx->pngdir, basename ? basename : psdpath, "-rebuilt.psd");
+		ctx->rebuilt_psd = fopen(fname, "w");
 	}else{
-		rebuilt_psd = NULL;
+		ctx->rebuilt_psd = NULL;
 	}
 
 	// see: http://hsivonen.iki.fi/producing-xml/
 	if(xmlout){
-		quiet = writexml = 1;
-		verbose = 0;
-		xml = stdout;
+		ctx->xml = stdout;
 	}else if(writexml){
-		setupfile(fname, pngdir, "psd", ".xml");
-		xml = fopen(fname, "w");
+		setupfile(fname, ctx->pngdir, "psd", ".xml");
+		ctx->xml = fopen(fname, "w");
 	}else{
-		xml = NULL;
+		ctx->xml = NULL;
 	}
-#ifdef HAVE_ICONV_H
-	ic = iconv_open("UTF-8", "UTF-16BE");
-	if(ic == (iconv_t)-1)
-		alwayswarn("iconv_open(): failed, errno = %d\n", errno);
-#endif
-	if(xml){
-		fputs("<?xml version='1.0' encoding='UTF-8'?>\n", xml);
-		fputs("<!-- generated by psdparse version " VERSION_STR " -->\n", xml);
+	if(ctx->xml){
+		fputs("<?xml version='1.0' encoding='UTF-8'?>\n", ctx->xml);
+		fputs("<!-- generated by psdparse version " VERSION_STR " -->\n", ctx->xml);
 	}
 }
 
@@ -21,26 +21,109 @@
 
 #include "png.h"
 
-static void writeimage(psd_file_t psd, char *dir, char *name,
+// Layer images queued for writing by worker threads (--jobs)
+
+struct image_job{
+	psd_file_t psd;
+	char *dir, *name;
+	struct layer_info *li;
+	struct channel_info *chan;
+	int channels;
+	long rows, cols;
+	struct psd_header *h;
+	int color_type;
+};
+
+static void writeimagenow(struct psd_context *ctx, psd_file_t psd, char *dir, char *name,
+						  struct layer_info *li,
+						  struct channel_info *chan,
+						  int channels, long rows, long cols,
+						  struct psd_header *h, int color_type)
+{
+	FILE *outfile;
+
+	if(h->depth == 32){
+		if((outfile = rawsetupwrite(ctx, psd, dir, name, cols, rows, channels, color_type, li, h)))
+			rawwriteimage(ctx, outfile, psd, li, chan, channels, h);
+	}else{
+		if((outfile = pngsetupwrite(ctx, psd, dir, name, cols, rows, channels, color_type, li, h)))
+			pngwriteimage(ctx, outfile, psd, li, chan, channels, h);
+	}
+}
+
+static void writeimage(struct psd_context *ctx, psd_file_t psd, char *dir, char *name,
 					   struct layer_info *li,
 					   struct channel_info *chan,
 					   int channels, long rows, long cols,
 					   struct psd_header *h, int color_type)
 {
-	FILE *outfile;
+	struct image_job *job;
+	int defer;
 
 	if(writepng){
-		if(h->depth == 32){
-			if((outfile = rawsetupwrite(psd, dir, name, cols, rows, channels, color_type, li, h)))
-				rawwriteimage(outfile, psd, li, chan, channels, h);
-		}else{
-			if((outfile = pngsetupwrite(psd, dir, name, cols, rows, channels, color_type, li, h)))
-				pngwriteimage(outfile, psd, li, chan, channels, h);
-		}
+		if(jobs > 1 && li && rows && cols){
+			// Describe the image now, so XML and messages keep document order,
+			// and write it later in writequeued().
+			defer = h->depth == 32
+				? rawdeferwrite(ctx, dir, name, cols, rows, channels)
+				: pngdeferwrite(ctx, dir, name, cols, rows, channels, color_type, chan->id, h);
+			if(defer){
+				if(ctx->queued == ctx->queuesize){
+					ctx->queuesize = ctx->queuesize ? 2*ctx->queuesize : 64;
+					ctx->queue = realloc(ctx->queue, ctx->queuesize*sizeof(struct image_job));
+					if(!ctx->queue)
+						fatal("can't allocate image queue");
+				}
+				job = ctx->queue + ctx->queued++;
+				job->psd = psd;
+				job->dir = dir;
+				job->name = checkmalloc(strlen(name)+1);
+				strcpy(job->name, name);
+				job->li = li;
+				job->chan = chan;
+				job->channels = channels;
+				job->rows = rows;
+				job->cols = cols;
+				job->h = h;
+				job->color_type = color_type;
+			}
+		}else
+			writeimagenow(ctx, psd, dir, name, li, chan, channels, rows, cols, h, color_type);
 	}
 }
 
-static void writechannels(psd_file_t f, char *dir, char *name,
+// Each image is written with a context of its own, a copy of the
+// document's which suppresses output other than warnings: the image
+// was already described (XML, messages) when it was queued.
+
+static void writejob(void *arg, long i){
+	struct psd_context *doc = arg, ctx = *doc, *save = psd_ctx;
+	struct image_job *job = doc->queue + i;
+
+	ctx.xml = NULL;
+	ctx.quiet = 1;
+	ctx.verbose = 0;
+	ctx.nwarns = 0;
+	ctx.onfatal = NULL; // may be on a worker thread
+	psd_ctx = &ctx;
+	writeimagenow(&ctx, job->psd, job->dir, job->name, job->li, job->chan,
+				  job->channels, job->rows, job->cols, job->h, job->color_type);
+	psd_ctx = save;
+	free(job->name);
+}
+
+// Write the layer images queued by writeimage(), using 'jobs' threads.
+// Must be called before the input file is closed and its layer info freed.
+
+void writequeued(struct psd_context *ctx){
+	if(ctx->queued)
+		parallel_for(jobs, ctx->queued, writejob, ctx);
+	free(ctx->queue);
+	ctx->queue = NULL;
+	ctx->queued = ctx->queuesize = 0;
+}
+
+static void writechannels(struct psd_context *ctx, psd_file_t f, char *dir, char *name,
 						  struct layer_info *li,
 						  struct channel_info *chan,
 						  int channels, struct psd_header *h)
@@ -53,34 +136,34 @@ static void writechannels(psd_file_t f, char *dir, char *name,
 		strcpy(pngname, name);
 
 		if(chan[ch].id == LMASK_CHAN_ID){
-					if(xml){
-						fprintf(xml, "\t\t<LAYERMASK TOP='%d' LEFT='%d' BOTTOM='%d' RIGHT='%d' ROWS='%d' COLUMNS='%d' DEFAULTCOLOR='%d'>\n",
+					if(ctx->xml){
+						fprintf(ctx->xml, "\t\t<LAYERMASK TOP='%d' LEFT='%d' BOTTOM='%d' RIGHT='%d' ROWS='%d' COLUMNS='%d' DEFAULTCOLOR='%d'>\n",
 								li->mask.top, li->mask.left, li->mask.bottom, li->mask.right,
 								li->mask.bottom - li->mask.top, li->mask.right - li->mask.left,
 								li->mask.default_colour);
-						if(li->mask.flags & 1) fputs("\t\t\t<POSITIONRELATIVE />\n", xml);
-						if(li->mask.flags & 2) fputs("\t\t\t<DISABLED />\n", xml);
-						if(li->mask.flags & 4) fputs("\t\t\t<INVERT />\n", xml);
+						if(li->mask.flags & 1) fputs("\t\t\t<POSITIONRELATIVE />\n", ctx->xml);
+						if(li->mask.flags & 2) fputs("\t\t\t<DISABLED />\n", ctx->xml);
+						if(li->mask.flags & 4) fputs("\t\t\t<INVERT />\n", ctx->xml);
 					}
 					strcat(pngname, ".lmask");
 		}else if(chan[ch].id == UMASK_CHAN_ID){
-			if(xml){
-				fprintf(xml, "\t\t<USERLAYERMASK TOP='%d' LEFT='%d' BOTTOM='%d' RIGHT='%d' ROWS='%d' COLUMNS='%d' DEFAULTCOLOR='%d'>\n",
+			if(ctx->xml){
+				fprintf(ctx->xml, "\t\t<USERLAYERMASK TOP='%d' LEFT='%d' BOTTOM='%d' RIGHT='%d' ROWS='%d' COLUMNS='%d' DEFAULTCOLOR='%d'>\n",
 						li->mask.real_top, li->mask.real_left, li->mask.real_bottom, li->mask.real_right,
 						li->mask.real_bottom - li->mask.real_top, li->mask.real_right - li->mask.real_left,
 						li->mask.real_default_colour);
-				if(li->mask.real_flags & 1) fputs("\t\t\t<POSITIONRELATIVE />\n", xml);
-				if(li->mask.real_flags & 2) fputs("\t\t\t<DISABLED />\n", xml);
-				if(li->mask.real_flags & 4) fputs("\t\t\t<INVERT />\n", xml);
+				if(li->mask.real_flags & 1) fputs("\t\t\t<POSITIONRELATIVE />\n", ctx->xml);
+				if(li->mask.real_flags & 2) fputs("\t\t\t<DISABLED />\n", ctx->xml);
+				if(li->mask.real_flags & 4) fputs("\t\t\t<INVERT />\n", ctx->xml);
 			}
 			strcat(pngname, ".umask");
 		}else if(chan[ch].id == TRANS_CHAN_ID){
-			if(xml) fputs("\t\t<TRANSPARENCY>\n", xml);
+			if(ctx->xml) fputs("\t\t<TRANSPARENCY>\n", ctx->xml);
 			strcat(pngname, li ? ".trans" : ".alpha");
 		}else{
-			if(xml)
-				fprintf(xml, "\t\t<CHANNEL ID='%d'>\n", chan[ch].id);
-			if(chan[ch].id < (int)strlen(channelsuffixes[h->mode])) // can identify channel by letter
+			if(ctx->xml)
+				fprintf(ctx->xml, "\t\t<CHANNEL ID='%d'>\n", chan[ch].id);
+			if(chan[ch].id >= 0 && chan[ch].id < (int)strlen(channelsuffixes[h->mode])) // can identify channel by letter
 				sprintf(pngname+strlen(pngname), ".%c", channelsuffixes[h->mode][chan[ch].id]);
 			else // give up and use a number
 				sprintf(pngname+strlen(pngname), ".%d", chan[ch].id);
@@ -89,20 +172,20 @@ static void writechannels(psd_file_t f, char *dir, char *name,
 		if(chan[ch].comptype == -1)
 			alwayswarn("## not writing \"%s\", bad channel compression type\n", pngname);
 		else
-			writeimage(f, dir, pngname, li, chan + ch, 1,
+			writeimage(ctx, f, dir, pngname, li, chan + ch, 1,
 					   chan[ch].rows, chan[ch].cols, h, PNG_COLOR_TYPE_GRAY);
 
 		if(chan[ch].id == LMASK_CHAN_ID){
-			if(xml) fputs("\t\t</LAYERMASK>\n", xml);
+			if(ctx->xml) fputs("\t\t</LAYERMASK>\n", ctx->xml);
 		}else if(chan[ch].id == TRANS_CHAN_ID){
-			if(xml) fputs("\t\t</TRANSPARENCY>\n", xml);
+			if(ctx->xml) fputs("\t\t</TRANSPARENCY>\n", ctx->xml);
 		}else{
-			if(xml) fputs("\t\t</CHANNEL>\n", xml);
+			if(ctx->xml) fputs("\t\t</CHANNEL>\n", ctx->xml);
 		}
 	}
 }
 
-void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header *h)
+void doimage(struct psd_context *ctx, psd_file_t f, struct layer_info *li, char *name, struct psd_header *h)
 {
 	// map channel count to a suitable PNG mode (when scavenging and actual mode is not known)
 	static int png_mode[] = {0, PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
@@ -110,10 +193,16 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 	int ch, pngchan = 0, color_type = 0, has_alpha = 0,
 		channels = li ? li->channels : h->channels;
 	psd_bytes_t image_data_end;
+	long rows, cols;
+
+	psd_ctx = ctx;
+
+	if(li && !li->chan)
+		return; // layer info was unreadable (see readlayerinfo())
 
 	if(h->mode == SCAVENGE_MODE){
 		pngchan = channels;
-		color_type = png_mode[pngchan];
+		color_type = pngchan < 5 ? png_mode[pngchan] : -1; // -1: can't be written as PNG
 	}
 	else{
 		has_alpha = li ? li->chindex[TRANS_CHAN_ID] != -1
@@ -122,7 +211,7 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 
 		switch(h->mode){
 		default: // multichannel, cmyk, lab etc
-			split = 1;
+			ctx->split = 1;
 		case ModeBitmap:
 		case ModeGrayScale:
 		case ModeGray16:
@@ -148,31 +237,40 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 			dochannel(f, li, li->chan + ch, 1/*count*/, h);
 		}
 
-		image_data_end = ftello(f);
+		image_data_end = psd_ftello(f);
+
+		rows = li->bottom - li->top;
+		cols = li->right - li->left;
+		if(preview){
+			for(ch = 0; ch < channels; ++ch)
+				setscale(li->chan + ch, preview, h->mode != ModeIndexedColor);
+			rows = (rows + preview - 1)/preview;
+			cols = (cols + preview - 1)/preview;
+		}
 
 		if(writepng && !merged_only){
-			nwarns = 0;
-			if(pngchan && !split){
-				writeimage(f, pngdir, name, li, li->chan,
+			ctx->nwarns = 0;
+			if(pngchan && !ctx->split){
+				writeimage(ctx, f, ctx->pngdir, name, li, li->chan,
 						   h->depth == 32 ? channels : pngchan,
-						   li->bottom - li->top, li->right - li->left,
-						   h, color_type);
+						   rows, cols, h, color_type);
 
 				if(h->depth < 32){
 					// spit out any 'extra' channels (e.g. layer mask)
 					for(ch = 0; ch < channels; ++ch)
 						if(li->chan[ch].id < -1 || li->chan[ch].id >= pngchan)
-							writechannels(f, pngdir, name, li, li->chan + ch, 1, h);
+							writechannels(ctx, f, ctx->pngdir, name, li, li->chan + ch, 1, h);
 				}
 			}
 			else{
 				UNQUIET("# writing layer as split channels...\n");
-				writechannels(f, pngdir, name, li, li->chan, channels, h);
+				writechannels(ctx, f, ctx->pngdir, name, li, li->chan, channels, h);
 			}
 		}
 	}
 	else{
 		h->merged_chans = checkmalloc(channels*sizeof(struct channel_info));
+		memset(h->merged_chans, 0, channels*sizeof(struct channel_info));
 
 		// The 'merged' or 'composite' image is where the flattened image is stored
 		// when 'Maximise Compatibility' is used.
@@ -190,33 +288,53 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 		VERBOSE("\n  merged image:\n");
 		dochannel(f, NULL, h->merged_chans, channels, h);
 
-		image_data_end = ftello(f);
+		image_data_end = psd_ftello(f);
+
+		if(crop){
+			// only this window of the image is wanted: rows outside it
+			// are never read, nor RLE data to the right of it decoded
+			for(ch = 0; ch < channels; ++ch)
+				if(!setwindow(h->merged_chans + ch, crop_left, crop_top, crop_cols, crop_rows)){
+					alwayswarn("# --crop window lies outside the image, not writing it\n");
+					psd_fseeko(f, image_data_end, SEEK_SET);
+					return;
+				}
+			VERBOSE("  (cropped to %u x %u @ %u,%u)\n", h->merged_chans->cols, h->merged_chans->rows,
+					crop_left, crop_top);
+		}
+		if(preview){
+			// decode only every preview'th row, and average columns
+			for(ch = 0; ch < channels; ++ch)
+				setscale(h->merged_chans + ch, preview, h->mode != ModeIndexedColor);
+			VERBOSE("  (preview at 1/%d: %u x %u)\n", preview,
+					h->merged_chans->cols, h->merged_chans->rows);
+		}
 
-		if(xml)
-			fprintf(xml, "\t<COMPOSITE CHANNELS='%d' HEIGHT='%d' WIDTH='%d'>\n",
+		if(ctx->xml)
+			fprintf(ctx->xml, "\t<COMPOSITE CHANNELS='%d' HEIGHT='%d' WIDTH='%d'>\n",
 					channels, h->rows, h->cols);
 
-		nwarns = 0;
+		ctx->nwarns = 0;
 		ch = 0;
-		if(pngchan && !split){
-			writeimage(f, pngdir, name, NULL, h->merged_chans,
+		if(pngchan && !ctx->split){
+			writeimage(ctx, f, ctx->pngdir, name, NULL, h->merged_chans,
 					   h->depth == 32 ? channels : pngchan,
-					   h->rows, h->cols, h, color_type);
+					   h->merged_chans->rows, h->merged_chans->cols, h, color_type);
 			ch += pngchan;
 		}
 		if(writepng && ch < channels){
-			if(split){
+			if(ctx->split){
 				UNQUIET("# writing %s image as split channels...\n", mode_names[h->mode]);
 			}else{
 				UNQUIET("# writing %d extra channels...\n", channels - ch);
 			}
 
-			writechannels(f, pngdir, name, NULL, h->merged_chans + ch, channels - ch, h);
+			writechannels(ctx, f, ctx->pngdir, name, NULL, h->merged_chans + ch, channels - ch, h);
 		}
 
-		if(xml) fputs("\t</COMPOSITE>\n", xml);
+		if(ctx->xml) fputs("\t</COMPOSITE>\n", ctx->xml);
 	}
 
 	// caller may expect this file position
-	fseeko(f, image_data_end, SEEK_SET);
+	psd_fseeko(f, image_data_end, SEEK_SET);
 }
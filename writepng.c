@@ -27,8 +27,119 @@
 	#include "zlib.h"
 #endif
 
-static png_structp png_ptr;
-static png_infop info_ptr;
+// thread local, so that images can be written concurrently (--jobs);
+// an image is set up and written start to finish by one thread
+static THREAD_LOCAL png_structp png_ptr;
+static THREAD_LOCAL png_infop info_ptr;
+
+// PNG compression profiles (--pngprofile), trading speed against size.
+// The filters apply only to images of 8 bits or more that aren't indexed;
+// others are never filtered. Strategy -1 means the libpng default
+// (Z_FILTERED if filtering, otherwise Z_DEFAULT_STRATEGY).
+// 'fastest' uses zlib's run-length matcher, which skips the hash chain
+// search that dominates deflate time at other settings.
+
+static struct png_profile{
+	char *name;
+	int level, strategy, filters;
+} png_profiles[] = {
+	{"fastest",  1, Z_RLE, PNG_FILTER_SUB},
+	{"balanced", 6, -1,    PNG_FILTER_NONE | PNG_FILTER_SUB | PNG_FILTER_UP},
+	{"smallest", Z_BEST_COMPRESSION, -1, PNG_ALL_FILTERS}, // default
+	{NULL, 0, 0, 0}
+}, *png_profile = png_profiles + 2;
+
+// Select compression profile by name. Returns zero if the name is not recognised.
+
+int pngsetprofile(char *name){
+	struct png_profile *p;
+
+	for(p = png_profiles; p->name; ++p)
+		if(!strcmp(p->name, name)){
+			png_profile = p;
+			return 1;
+		}
+	return 0;
+}
+
+// Compression parameters for an image, according to the profile.
+
+static void pngparams(struct psd_header *h, int *level, int *strategy, int *filters){
+	*level = png_profile->level;
+	*filters = h->mode == ModeIndexedColor || h->depth < 8
+			   ? PNG_FILTER_NONE : png_profile->filters;
+	if(png_profile->strategy >= 0)
+		*strategy = png_profile->strategy;
+	else
+		*strategy = *filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+}
+
+// Check the image parameters and build the PNG file name.
+// Returns the name of the PNG colour type, or NULL if the PNG can't be written.
+
+static char *pngcheck(char *pngname, char *dir, char *name, int *channels,
+					  int color_type, struct psd_header *h)
+{
+	setupfile(pngname, dir, name, ".png");
+
+	if(*channels < 1 || *channels > 4){
+		alwayswarn("## (BUG) bad channel count (%d), writing PNG \"%s\"\n", *channels, pngname);
+		if(*channels > 4)
+			*channels = 4; // try anyway
+		else
+			return NULL;
+	}
+
+	switch(color_type){
+	case PNG_COLOR_TYPE_GRAY:       return "GRAY";
+	case PNG_COLOR_TYPE_GRAY_ALPHA: return "GRAY_ALPHA";
+	case PNG_COLOR_TYPE_PALETTE:    return "PALETTE";
+	case PNG_COLOR_TYPE_RGB:        return "RGB";
+	case PNG_COLOR_TYPE_RGB_ALPHA:  return "RGB_ALPHA";
+	}
+	alwayswarn("## (BUG) bad color_type (%d), %d channels (%s), writing PNG \"%s\"\n",
+			   color_type, *channels, mode_names[h->mode], pngname);
+	return NULL;
+}
+
+// Describe the PNG in XML, and tell the user about it.
+// The XML element is completed by pngwriteimage().
+
+static void pngdescribe(struct psd_context *ctx, char *dir, char *name, char *pngname, psd_pixels_t width, psd_pixels_t height,
+						int channels, int color_type, char *pngtype, struct psd_header *h)
+{
+	if(ctx->xml){
+		fputs("\t\t<PNG NAME='", ctx->xml);
+		fputsxml(name, ctx->xml);
+		fputs("' DIR='", ctx->xml);
+		fputsxml(dir, ctx->xml);
+		fputs("' FILE='", ctx->xml);
+		fputsxml(pngname, ctx->xml);
+		fprintf(ctx->xml, "' WIDTH='%u' HEIGHT='%u' CHANNELS='%d' COLORTYPE='%d' COLORTYPENAME='%s' DEPTH='%d'",
+				width, height, channels, color_type, pngtype, h->depth);
+	}
+	UNQUIET("# writing PNG \"%s\"\n", pngname);
+	VERBOSE("#             %3ux%3u, depth=%d, channels=%d, type=%d(%s)\n",
+			width, height, h->depth, channels, color_type, pngtype);
+}
+
+// Used when writing is deferred (--jobs): describe the PNG now, so that
+// XML and messages stay in document order, and return nonzero if the
+// PNG should later be written by pngsetupwrite() and pngwriteimage().
+
+int pngdeferwrite(struct psd_context *ctx, char *dir, char *name, psd_pixels_t width, psd_pixels_t height,
+				  int channels, int color_type, int chindex, struct psd_header *h)
+{
+	char pngname[PATH_MAX], *pngtype;
+
+	if( (pngtype = pngcheck(pngname, dir, name, &channels, color_type, h)) ){
+		pngdescribe(ctx, dir, name, pngname, width, height, channels, color_type, pngtype, h);
+		if(ctx->xml)
+			fprintf(ctx->xml, " CHINDEX='%d' />\n", chindex);
+		return 1;
+	}
+	return 0;
+}
 
 // Prepare to write the PNG file. This function:
 // - creates a directory for it, if needed
@@ -37,6 +148,7 @@ static png_infop info_ptr;
 // - fetches the colour palette for Indexed Mode images, and gives to libpng 
 
 // Parameters:
+// ctx         context of the document being parsed
 // psd         file handle for input PSD
 // dir         pointer to output dir name
 // name        name for this PNG (e.g. layer name)
@@ -46,39 +158,20 @@ static png_infop info_ptr;
 // li          pointer to layer info for relevant layer, or NULL if no layer (e.g. merged composite)
 // h           pointer to PSD file header struct
 
-FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, 
+FILE* pngsetupwrite(struct psd_context *ctx, psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, 
 					int channels, int color_type, struct layer_info *li, struct psd_header *h)
 {
-	char pngname[PATH_MAX], *pngtype = NULL;
-	static FILE *f; // static, because it might get used post-longjmp()
+	char pngname[PATH_MAX], *pngtype;
+	static THREAD_LOCAL FILE *f; // static, because it might get used post-longjmp()
 	png_color *pngpal;
-	int i, n;
-	psd_bytes_t savepos;
+	unsigned char pal[3*256];
+	int i, n, level, strategy, filters;
 
 	f = NULL;
 	
 	if(width && height){
-		setupfile(pngname, dir, name, ".png");
-
-		if(channels < 1 || channels > 4){
-			alwayswarn("## (BUG) bad channel count (%d), writing PNG \"%s\"\n", channels, pngname);
-			if(channels > 4)
-				channels = 4; // try anyway
-			else
-				return NULL;
-		}
-
-		switch(color_type){
-		case PNG_COLOR_TYPE_GRAY:       pngtype = "GRAY"; break;
-		case PNG_COLOR_TYPE_GRAY_ALPHA: pngtype = "GRAY_ALPHA"; break;
-		case PNG_COLOR_TYPE_PALETTE:    pngtype = "PALETTE"; break;
-		case PNG_COLOR_TYPE_RGB:        pngtype = "RGB"; break;
-		case PNG_COLOR_TYPE_RGB_ALPHA:  pngtype = "RGB_ALPHA"; break;
-		default:
-			alwayswarn("## (BUG) bad color_type (%d), %d channels (%s), writing PNG \"%s\"\n", 
-					   color_type, channels, mode_names[h->mode], pngname);
+		if( !(pngtype = pngcheck(pngname, dir, name, &channels, color_type, h)) )
 			return NULL;
-		}
 
 		if( !(png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) ){
 			alwayswarn("### pngsetupwrite: png_create_write_struct failed\n");
@@ -86,19 +179,7 @@ FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 		}
 
 		if( (f = fopen(pngname, "wb")) ){
-			if(xml){
-				fputs("\t\t<PNG NAME='", xml);
-				fputsxml(name, xml);
-				fputs("' DIR='", xml);
-				fputsxml(dir, xml);
-				fputs("' FILE='", xml);
-				fputsxml(pngname, xml);
-				fprintf(xml, "' WIDTH='%u' HEIGHT='%u' CHANNELS='%d' COLORTYPE='%d' COLORTYPENAME='%s' DEPTH='%d'",
-						width, height, channels, color_type, pngtype, h->depth);
-			}
-			UNQUIET("# writing PNG \"%s\"\n", pngname);
-			VERBOSE("#             %3ux%3u, depth=%d, channels=%d, type=%d(%s)\n",
-					width, height, h->depth, channels, color_type, pngtype);
+			pngdescribe(ctx, dir, name, pngname, width, height, channels, color_type, pngtype, h);
 
 			if( !(info_ptr = png_create_info_struct(png_ptr)) || setjmp(png_jmpbuf(png_ptr)) )
 			{ /* If we get here, libpng had a problem */
@@ -117,25 +198,33 @@ FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 				png_set_invert_mono(png_ptr);
 			else if(h->mode == ModeIndexedColor){
 				// go get the colour palette
-				savepos = ftello(psd);
-				fseeko(psd, h->colormodepos, SEEK_SET);
-				n = get4B(psd)/3;
-				if(n > 256){ // sanity check...
+				// (by position, as other images may be being written concurrently)
+				memset(pal, 0xff, sizeof(pal));
+				psd_pread(psd, pal, 4, h->colormodepos);
+				n = peek4B(pal)/3;
+				if(n < 0)
+					n = 0;
+				else if(n > 256){ // sanity check...
 					warn_msg("# more than 256 entries in colour palette! (%d)\n", n);
 					n = 256;
 				}
+				psd_pread(psd, pal, 3*n, h->colormodepos + 4);
 				pngpal = checkmalloc(sizeof(png_color)*n);
-				for(i = 0; i < n; ++i) pngpal[i].red   = fgetc(psd);
-				for(i = 0; i < n; ++i) pngpal[i].green = fgetc(psd);
-				for(i = 0; i < n; ++i) pngpal[i].blue  = fgetc(psd);
-				fseeko(psd, savepos, SEEK_SET);
+				for(i = 0; i < n; ++i){
+					pngpal[i].red   = pal[i];
+					pngpal[i].green = pal[n + i];
+					pngpal[i].blue  = pal[2*n + i];
+				}
 				png_set_PLTE(png_ptr, info_ptr, pngpal, n);
 				free(pngpal);
 			}
 
 			png_write_info(png_ptr, info_ptr);
 			
-			png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+			pngparams(h, &level, &strategy, &filters);
+			png_set_compression_level(png_ptr, level);
+			png_set_compression_strategy(png_ptr, strategy);
+			png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filters);
 
 		}else alwayswarn("### can't open \"%s\" for writing\n", pngname);
 
@@ -144,7 +233,311 @@ FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 	return f;
 }
 
+// Fetch row j of the image, interleaving channels if there are several.
+// Returns a pointer to the row data (in rowbuf, or in inrows[0] if there
+// is only one channel).
+
+static unsigned char *pnggetrow(psd_file_t psd, struct channel_info *chan, int chancount,
+								int *map, psd_pixels_t j, unsigned char **inrows,
+								unsigned char *rledata, unsigned char *rowbuf, struct psd_header *h)
+{
+	psd_pixels_t i;
+	uint16_t *q;
+	unsigned char *p;
+	int ch;
+
+	for(ch = 0; ch < chancount; ++ch){
+		/* get row data */
+		if(map[ch] < 0 || map[ch] >= chancount){
+			warn_msg("bad map[%d]=%d, skipping a channel", ch, map[ch]);
+			memset(inrows[ch], 0, chan->rowbytes); // zero out the row
+		}else
+			readunpackrow(psd, chan + map[ch], j, inrows[ch], rledata);
+	}
+
+	if(chancount == 1)
+		return inrows[0];
+
+	/* interleave channels */
+	if(h->depth == 8)
+		for(i = 0, p = rowbuf; i < chan->rowbytes; ++i)
+			for(ch = 0; ch < chancount; ++ch)
+				*p++ = inrows[ch][i];
+	else
+		for(i = 0, q = (uint16_t*)rowbuf; i < chan->rowbytes/2; ++i)
+			for(ch = 0; ch < chancount; ++ch)
+				*q++ = ((uint16_t*)inrows[ch])[i];
+	return rowbuf;
+}
+
+// Parallel encoding (--jobs) of large merged images.
+// As in pigz, the image data is cut into segments of rows which worker
+// threads filter and deflate independently. Each segment's deflate stream
+// is primed with the last 32K of the previous segment and ends on a sync
+// flush, so the concatenation is one valid zlib stream, which is written
+// as one IDAT chunk per segment. Segments are processed in batches,
+// so memory use is bounded regardless of image size.
+
+#define SEGBYTES  (1 << 20) // approximate uncompressed size of one segment
+#define DICTBYTES 32768     // deflate window
+
+struct pngseg{
+	psd_pixels_t first, count; // rows in this segment
+	unsigned char *in, *out;   // filtered rows; zlib data (with room for header and trailer)
+	size_t inlen, outlen;
+	uLong adler;
+	int final;
+};
+
+struct pngpar{
+	psd_file_t psd;
+	struct channel_info *chan;
+	int chancount, *map, bpp, filters, level, strategy;
+	struct psd_header *h;
+	size_t linebytes;      // filter type byte + row data
+	struct pngseg *seg;    // current batch
+	unsigned char *dict;   // tail of the previous batch's last segment
+	size_t dictlen;
+};
+
+static unsigned filtersum(unsigned char *p, size_t n){
+	unsigned sum = 0;
+	while(n--){
+		sum += *p < 128 ? *p : 256 - *p;
+		++p;
+	}
+	return sum;
+}
+
+static unsigned char paeth(int a, int b, int c){
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+}
+
+// Filter one row into out (filter type byte + n bytes), given the previous
+// (unfiltered) row. As libpng does, if more than one filter is allowed by
+// the 'filters' mask (PNG_FILTER_NONE etc), try them all and keep the
+// one with the smallest sum of absolute values.
+
+static void pngfilterrow(unsigned char *out, unsigned char *row, unsigned char *prev,
+						 size_t n, int bpp, int filters, unsigned char *tmp)
+{
+	unsigned best, sum;
+	size_t i;
+	int f;
+
+	out[0] = PNG_FILTER_VALUE_NONE;
+	memcpy(out+1, row, n);
+	if(filters == PNG_FILTER_NONE)
+		return;
+
+	best = filters & PNG_FILTER_NONE ? filtersum(row, n) : UINT_MAX;
+	for(f = PNG_FILTER_VALUE_SUB; f <= PNG_FILTER_VALUE_PAETH; ++f){
+		if(!(filters & (PNG_FILTER_NONE << f)))
+			continue;
+		for(i = 0; i < n; ++i){
+			int a = i >= (size_t)bpp ? row[i-bpp] : 0,
+				b = prev[i],
+				c = i >= (size_t)bpp ? prev[i-bpp] : 0;
+			switch(f){
+			case PNG_FILTER_VALUE_SUB:   tmp[i] = row[i] - a; break;
+			case PNG_FILTER_VALUE_UP:    tmp[i] = row[i] - b; break;
+			case PNG_FILTER_VALUE_AVG:   tmp[i] = row[i] - ((a + b) >> 1); break;
+			case PNG_FILTER_VALUE_PAETH: tmp[i] = row[i] - paeth(a, b, c); break;
+			}
+		}
+		if( (sum = filtersum(tmp, n)) < best ){
+			best = sum;
+			out[0] = f;
+			memcpy(out+1, tmp, n);
+		}
+	}
+}
+
+// Worker: decode and filter the rows of one segment.
+
+static void pngfilterseg(void *arg, long k){
+	struct pngpar *pp = arg;
+	struct pngseg *s = pp->seg + k;
+	size_t n = pp->linebytes - 1;
+	unsigned char *inrows[4], *rledata, *rowbuf[2], *tmp, *row, *prev, *q;
+	psd_pixels_t j;
+	int ch, cur = 0;
+
+	for(ch = 0; ch < pp->chancount; ++ch)
+		inrows[ch] = checkmalloc(pp->chan->rowbytes);
+	rledata = checkmalloc(rlebufsize(pp->chan));
+	rowbuf[0] = checkmalloc(n);
+	rowbuf[1] = checkmalloc(n);
+	tmp = checkmalloc(n);
+
+	s->inlen = pp->linebytes*s->count;
+	s->in = checkmalloc(s->inlen);
+
+	// previous row is needed for filtering; the row above the image is zero
+	if(s->first){
+		row = pnggetrow(pp->psd, pp->chan, pp->chancount, pp->map, s->first-1,
+						inrows, rledata, rowbuf[cur], pp->h);
+		memcpy(rowbuf[cur], row, n);
+	}else
+		memset(rowbuf[cur], 0, n);
+
+	for(j = 0, q = s->in; j < s->count; ++j, q += pp->linebytes){
+		prev = rowbuf[cur];
+		cur ^= 1;
+		row = pnggetrow(pp->psd, pp->chan, pp->chancount, pp->map, s->first+j,
+						inrows, rledata, rowbuf[cur], pp->h);
+		if(row != rowbuf[cur])
+			memcpy(rowbuf[cur], row, n);
+		if(pp->h->mode == ModeBitmap) // see png_set_invert_mono()
+			for(row = rowbuf[cur]; row < rowbuf[cur] + n; ++row)
+				*row = ~*row;
+		pngfilterrow(q, rowbuf[cur], prev, n, pp->bpp, pp->filters, tmp);
+	}
+
+	for(ch = 0; ch < pp->chancount; ++ch)
+		free(inrows[ch]);
+	free(rledata);
+	free(rowbuf[0]);
+	free(rowbuf[1]);
+	free(tmp);
+}
+
+// Worker: deflate one segment's filtered rows.
+
+static void pngdeflateseg(void *arg, long k){
+	struct pngpar *pp = arg;
+	struct pngseg *s = pp->seg + k;
+	z_stream z;
+	size_t n;
+	int err;
+
+	s->adler = adler32(adler32(0, NULL, 0), s->in, s->inlen);
+
+	memset(&z, 0, sizeof(z));
+	if(deflateInit2(&z, pp->level, Z_DEFLATED, -15, 8, pp->strategy) != Z_OK)
+		fatal("## deflateInit2() failed\n");
+
+	if(k){
+		n = s[-1].inlen < DICTBYTES ? s[-1].inlen : DICTBYTES;
+		deflateSetDictionary(&z, s[-1].in + s[-1].inlen - n, n);
+	}else if(pp->dictlen)
+		deflateSetDictionary(&z, pp->dict, pp->dictlen);
+
+	// allow for zlib header (2 bytes), sync flush marker, and Adler-32 trailer
+	n = deflateBound(&z, s->inlen) + 16;
+	s->out = checkmalloc(n);
+	z.next_in = s->in;
+	z.avail_in = s->inlen;
+	z.next_out = s->out + 2;
+	z.avail_out = n - 6;
+	err = deflate(&z, s->final ? Z_FINISH : Z_SYNC_FLUSH);
+	if(err != (s->final ? Z_STREAM_END : Z_OK) || z.avail_in)
+		alwayswarn("### pngdeflateseg: deflate() failed (%d)\n", err);
+	s->outlen = z.total_out;
+	deflateEnd(&z);
+}
+
+static void pngchunk(FILE *f, char *type, unsigned char *data, size_t len){
+	uLong crc = crc32(crc32(0, NULL, 0), (unsigned char*)type, 4);
+
+	put4B(f, len);
+	fwrite(type, 1, 4, f);
+	if(len){
+		fwrite(data, 1, len, f);
+		crc = crc32(crc, data, len);
+	}
+	put4B(f, crc);
+}
+
+// Write the image data and end of file, after pngsetupwrite() has written
+// the PNG header.
+
+static void pngwriteparallel(FILE *png, psd_file_t psd, struct channel_info *chan,
+							 int chancount, int *map, struct psd_header *h)
+{
+	struct pngpar pp;
+	psd_pixels_t segrows;
+	long nseg, batch, b, k, n;
+	uLong adler = adler32(0, NULL, 0);
+	unsigned header, flags;
+	unsigned char *p;
+	struct pngseg *s;
+
+	pp.psd = psd;
+	pp.chan = chan;
+	pp.chancount = chancount;
+	pp.map = map;
+	pp.h = h;
+	pp.bpp = (chancount*h->depth + 7)/8;
+	pngparams(h, &pp.level, &pp.strategy, &pp.filters);
+	pp.linebytes = 1 + (size_t)chan->rowbytes*chancount;
+	pp.dict = checkmalloc(DICTBYTES);
+	pp.dictlen = 0;
+
+	segrows = SEGBYTES/pp.linebytes;
+	if(!segrows)
+		segrows = 1;
+	nseg = (chan->rows + segrows - 1)/segrows;
+	batch = 4*jobs;
+	pp.seg = checkmalloc(batch*sizeof(struct pngseg));
+
+	// zlib stream header, as deflateInit() would write it
+	flags = pp.strategy >= Z_HUFFMAN_ONLY || pp.level < 2 ? 0
+			: (pp.level < 6 ? 1 : (pp.level == 6 ? 2 : 3));
+	header = (Z_DEFLATED + ((15-8) << 4)) << 8 | flags << 6;
+	header += 31 - header % 31;
+
+	for(b = 0; b < nseg; b += batch){
+		n = nseg - b < batch ? nseg - b : batch;
+		for(k = 0; k < n; ++k){
+			s = pp.seg + k;
+			s->first = (b + k)*segrows;
+			s->count = s->first + segrows > chan->rows ? chan->rows - s->first : segrows;
+			s->final = b + k == nseg-1;
+		}
+
+		parallel_for(jobs, n, pngfilterseg, &pp);
+		parallel_for(jobs, n, pngdeflateseg, &pp);
+
+		for(k = 0; k < n; ++k){
+			s = pp.seg + k;
+			p = s->out + 2;
+			if(!b && !k){
+				p -= 2;
+				s->outlen += 2;
+				p[0] = header >> 8;
+				p[1] = header;
+			}
+			adler = adler32_combine(adler, s->adler, s->inlen);
+			if(s->final){
+				p[s->outlen]   = adler >> 24;
+				p[s->outlen+1] = adler >> 16;
+				p[s->outlen+2] = adler >> 8;
+				p[s->outlen+3] = adler;
+				s->outlen += 4;
+			}
+			pngchunk(png, "IDAT", p, s->outlen);
+		}
+
+		// keep the end of this batch as the dictionary for the next
+		s = pp.seg + n-1;
+		pp.dictlen = s->inlen < DICTBYTES ? s->inlen : DICTBYTES;
+		memcpy(pp.dict, s->in + s->inlen - pp.dictlen, pp.dictlen);
+
+		for(k = 0; k < n; ++k){
+			free(pp.seg[k].in);
+			free(pp.seg[k].out);
+		}
+	}
+	pngchunk(png, "IEND", NULL, 0);
+
+	free(pp.seg);
+	free(pp.dict);
+}
+
 void pngwriteimage(
+		struct psd_context *ctx,
 		FILE *png,
 		psd_file_t psd,
 		struct layer_info *li,
@@ -152,19 +545,18 @@ void pngwriteimage(
 		int chancount,
 		struct psd_header *h)
 {
-	psd_pixels_t i, j;
-	uint16_t *q;
-	unsigned char *rowbuf, *inrows[4], *rledata, *p;
+	psd_pixels_t j;
+	unsigned char *rowbuf, *inrows[4], *rledata;
 	int ch, map[4];
 	
-	if(xml)
-		fprintf(xml, " CHINDEX='%d' />\n", chan->id);
+	if(ctx->xml)
+		fprintf(ctx->xml, " CHINDEX='%d' />\n", chan->id);
 
 	// buffer used to construct a row interleaving all channels (if required)
 	rowbuf  = checkmalloc(chan->rowbytes*chancount);
 
 	// a buffer for RLE decompression (if required), we pass this to readunpackrow()
-	rledata = checkmalloc(chan->rowbytes*2);
+	rledata = checkmalloc(rlebufsize(chan));
 
 	// row buffers per channel, for reading non-interleaved rows
 	for(ch = 0; ch < chancount; ++ch){
@@ -185,36 +577,22 @@ void pngwriteimage(
 	//for( ch = 0 ; ch < chancount ; ++ch )
 	//	alwayswarn("# channel map[%d] -> %d\n", ch, map[ch]);
 
+	// Merged images are written one at a time, so spread a big one over
+	// the worker threads. (Layer images already have a thread each.)
+	if(jobs > 1 && !li && (psd_bytes_t)chan->rowbytes*chancount*chan->rows > 2*SEGBYTES){
+		pngwriteparallel(png, psd, chan, chancount, map, h);
+		goto err;
+	}
+
 	if( setjmp(png_jmpbuf(png_ptr)) )
 	{ /* If we get here, libpng had a problem writing the file */
 		alwayswarn("### pngwriteimage: Fatal error in libpng\n");
 		goto err;
 	}
 
-	for(j = 0; j < chan->rows; ++j){
-		for(ch = 0; ch < chancount; ++ch){
-			/* get row data */
-			if(map[ch] < 0 || map[ch] >= chancount){
-				warn_msg("bad map[%d]=%d, skipping a channel", ch, map[ch]);
-				memset(inrows[ch], 0, chan->rowbytes); // zero out the row
-			}else
-				readunpackrow(psd, chan + map[ch], j, inrows[ch], rledata);
-		}
-
-		if(chancount > 1){ /* interleave channels */
-			if(h->depth == 8)
-				for(i = 0, p = rowbuf; i < chan->rowbytes; ++i)
-					for(ch = 0; ch < chancount; ++ch)
-						*p++ = inrows[ch][i];
-			else
-				for(i = 0, q = (uint16_t*)rowbuf; i < chan->rowbytes/2; ++i)
-					for(ch = 0; ch < chancount; ++ch)
-						*q++ = ((uint16_t*)inrows[ch])[i];
-
-			png_write_row(png_ptr, rowbuf);
-		}else
-			png_write_row(png_ptr, inrows[0]);
-	}
+	for(j = 0; j < chan->rows; ++j)
+		png_write_row(png_ptr, pnggetrow(psd, chan, chancount, map, j,
+										 inrows, rledata, rowbuf, h));
 	
 	png_write_end(png_ptr, NULL /*info_ptr*/);
 
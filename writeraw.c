@@ -25,7 +25,35 @@
 
 /* This code could also be used as a template for other file types. */
 
-FILE* rawsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, 
+static void rawdescribe(struct psd_context *ctx, char *dir, char *name, char *rawname, char *txtname,
+						psd_pixels_t width, psd_pixels_t height, int channels)
+{
+	if(ctx->xml){
+		fputs("\t\t\t<RAW NAME='", ctx->xml);
+		fputsxml(name, ctx->xml);
+		fputs("' DIR='", ctx->xml);
+		fputsxml(dir, ctx->xml);
+		fputs("' FILE='", ctx->xml);
+		fputsxml(rawname, ctx->xml);
+		fprintf(ctx->xml, "' ROWS='%u' COLS='%u' CHANNELS='%d' />\n", height, width, channels);
+	}
+	UNQUIET("# writing raw \"%s\"\n# metadata in \"%s\"\n", rawname, txtname);
+}
+
+// Used when writing is deferred (--jobs): describe the raw file now,
+// so that XML and messages stay in document order.
+
+int rawdeferwrite(struct psd_context *ctx, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, int channels)
+{
+	char rawname[PATH_MAX], txtname[PATH_MAX];
+
+	setupfile(txtname, dir, name, ".txt");
+	setupfile(rawname, dir, name, ".raw");
+	rawdescribe(ctx, dir, name, rawname, txtname, width, height, channels);
+	return 1;
+}
+
+FILE* rawsetupwrite(struct psd_context *ctx, psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, 
 					int channels, int color_type, struct layer_info *li, struct psd_header *h)
 {
 	char rawname[PATH_MAX], txtname[PATH_MAX];
@@ -47,18 +75,9 @@ FILE* rawsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 
 		// now write the raw binary
 		setupfile(rawname, dir, name, ".raw");
-		if( (f = fopen(rawname, "wb")) ){
-			if(xml){
-				fputs("\t\t\t<RAW NAME='", xml);
-				fputsxml(name, xml);
-				fputs("' DIR='", xml);
-				fputsxml(dir, xml);
-				fputs("' FILE='", xml);
-				fputsxml(rawname, xml);
-				fprintf(xml, "' ROWS='%u' COLS='%u' CHANNELS='%d' />\n", height, width, channels);
-			}
-			UNQUIET("# writing raw \"%s\"\n# metadata in \"%s\"\n", rawname, txtname);
-		}else alwayswarn("### can't open \"%s\" for writing\n", rawname);
+		if( (f = fopen(rawname, "wb")) )
+			rawdescribe(ctx, dir, name, rawname, txtname, width, height, channels);
+		else alwayswarn("### can't open \"%s\" for writing\n", rawname);
 
 	}else alwayswarn("### skipping layer \"%s\" (%ldx%ld)\n", li->name, width, height);
 
@@ -66,6 +85,7 @@ FILE* rawsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 }
 
 void rawwriteimage(
+		struct psd_context *ctx,
 		FILE *raw,
 		psd_file_t psd,
 		struct layer_info *li,
@@ -77,7 +97,7 @@ void rawwriteimage(
 	unsigned char *inrow, *rlebuf;
 	int i;
 
-	rlebuf = checkmalloc(chan->rowbytes*2);
+	rlebuf = checkmalloc(rlebufsize(chan));
 	inrow  = checkmalloc(chan->rowbytes);
 
 	// write channels in a series of planes, not interleaved
@@ -85,8 +105,8 @@ void rawwriteimage(
 		UNQUIET("## rawwriteimage: channel %d\n", i);
 		for(j = 0; j < chan[i].rows; ++j){
 			/* get row data */
-			readunpackrow(psd, chan, j, inrow, rlebuf);
-			if((psd_pixels_t)fwrite(inrow, 1, chan[i].rowbytes, raw) != chan->rowbytes){
+			readunpackrow(psd, chan + i, j, inrow, rlebuf);
+			if((psd_pixels_t)fwrite(inrow, 1, chan[i].rowbytes, raw) != chan[i].rowbytes){
 				alwayswarn("# error writing raw data, aborting\n");
 				goto err;
 			}
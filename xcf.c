@@ -112,14 +112,14 @@ size_t putsxcf(FILE *f, char *s){
 #define CTABSIZE 0x300
 
 // FIXME: add proper return results
-void xcf_prop_colormap(FILE *xcf, FILE *psd, struct psd_header *h){
+void xcf_prop_colormap(FILE *xcf, psd_file_t psd, struct psd_header *h){
 	size_t len;
 	int i, entries = CTABSIZE/3;
 	unsigned char ctab[CTABSIZE];
 
-	fseeko(psd, h->colormodepos, SEEK_SET);
+	psd_fseeko(psd, h->colormodepos, SEEK_SET);
 	len = get4B(psd);
-	if(len == CTABSIZE && fread(ctab, 1, CTABSIZE, psd) == CTABSIZE){
+	if(len == CTABSIZE && psd_fread(ctab, 1, CTABSIZE, psd) == CTABSIZE){
 		put4xcf(xcf, PROP_COLORMAP);
 		put4xcf(xcf, 4 + CTABSIZE);
 		put4xcf(xcf, entries);
@@ -362,7 +362,7 @@ size_t xcf_rle(FILE *xcf, unsigned char *src, size_t n){
 
 #define XCF_TILE 64
 
-off_t xcf_level(FILE *xcf, FILE *psd, int w, int h,
+off_t xcf_level(FILE *xcf, psd_file_t psd, int w, int h,
 				int channel_cnt, struct channel_info *xcf_chan[], int compr)
 {
 	unsigned char *chan_data[4], *rlebuf, *tilebuf, *dst, *src;
@@ -474,7 +474,7 @@ off_t xcf_level(FILE *xcf, FILE *psd, int w, int h,
 767	  uint32   0       A zero ends the list of level pointers
  */
 
-off_t xcf_hierarchy(FILE *xcf, FILE *psd, int w, int h,
+off_t xcf_hierarchy(FILE *xcf, psd_file_t psd, int w, int h,
 					int channel_cnt, struct channel_info *chan[], int compr){
 	int n_levels, j, hh, ww;
 	off_t hptr, level_ptrs[32];
@@ -512,7 +512,7 @@ off_t xcf_hierarchy(FILE *xcf, FILE *psd, int w, int h,
 707	  uint32  hptr   Pointer to the hierarchy structure containing the pixels
  */
 
-off_t xcf_channel(FILE *xcf, FILE *psd, int w, int h, char *name, int visible,
+off_t xcf_channel(FILE *xcf, psd_file_t psd, int w, int h, char *name, int visible,
 				  struct channel_info *chan, int compr){
 	off_t hptr = xcf_hierarchy(xcf, psd, w, h, 1, &chan, compr), chptr;
 
@@ -577,7 +577,7 @@ static const char *xcf_modes[] = {
 	NULL
 };
 
-off_t xcf_layer(FILE *xcf, FILE *psd, struct layer_info *li, int compr)
+off_t xcf_layer(FILE *xcf, psd_file_t psd, struct layer_info *li, int compr)
 {
 	struct channel_info *xcf_chan[4] = {NULL, NULL, NULL, NULL};
 	off_t hptr, lmptr = 0, layerptr;
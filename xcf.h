@@ -42,7 +42,7 @@ size_t put4xcf(FILE *f, uint32_t v);
 size_t putfxcf(FILE *f, float v);
 size_t putsxcf(FILE *f, char *s);
 
-void xcf_prop_colormap(FILE *xcf, FILE *psd, struct psd_header *h);
+void xcf_prop_colormap(FILE *xcf, psd_file_t psd, struct psd_header *h);
 void xcf_prop_compression(FILE *xcf, int compr);
 void xcf_prop_resolution(FILE *xcf, float x_per_cm, float y_per_cm);
 void xcf_prop_mode(FILE *xcf, int m);
@@ -51,10 +51,10 @@ void xcf_prop_opacity(FILE *xcf, int op);
 void xcf_prop_end(FILE *xcf);
 
 size_t xcf_rle(FILE *xcf, unsigned char *input, size_t n);
-off_t xcf_level(FILE *xcf, FILE *psd, int w, int h, int channel_cnt,
+off_t xcf_level(FILE *xcf, psd_file_t psd, int w, int h, int channel_cnt,
 				struct channel_info *xcf_chan[], int compr);
-off_t xcf_hierarchy(FILE *xcf, FILE *psd, int w, int h, int channel_cnt,
+off_t xcf_hierarchy(FILE *xcf, psd_file_t psd, int w, int h, int channel_cnt,
 					struct channel_info *xcf_chan[], int compr);
-off_t xcf_channel(FILE *xcf, FILE *psd, int w, int h, char *name, int visible,
+off_t xcf_channel(FILE *xcf, psd_file_t psd, int w, int h, char *name, int visible,
 				  struct channel_info *chan, int compr);
-off_t xcf_layer(FILE *xcf, FILE *psd, struct layer_info *li, int compr);
+off_t xcf_layer(FILE *xcf, psd_file_t psd, struct layer_info *li, int compr);